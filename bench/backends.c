@@ -0,0 +1,272 @@
+// Compares the reader backends on one file: stdio, pread, mmap and io_uring,
+// and pread and io_uring with O_DIRECT. Each gets three passes, each started
+// after asking the kernel to drop the file from the page cache:
+//
+//   seq     blocking 64 KiB reads front to back, as a single reader does
+//   queue   READER_QUEUE_DEPTH reads in flight on a queue, as read-ahead does
+//   random  THREADS threads of 128 KiB reads at random offsets, as many
+//           readers of different files do; with latency percentiles
+//
+// Every pass checksums what it read, and a backend whose sum differs from
+// the first one's is reported.
+//
+// usage: backends FILE [THREADS]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "types.h"
+#include "reader.h"
+#include "stats.h"
+
+#define SEQ_CHUNK		0x10000
+#define RANDOM_CHUNK	0x20000
+#define RANDOM_READS	2048		// per thread
+#define MAX_THREADS		64
+
+typedef struct
+{
+	const char* name;
+	const char* backend;
+	int direct;
+} bench_config;
+
+static const bench_config configs[] =
+{
+	{ "stdio",           "stdio",    0 },
+	{ "pread",           "pread",    0 },
+	{ "mmap",            "mmap",     0 },
+	{ "io_uring",        "io_uring", 0 },
+	{ "pread+direct",    "pread",    1 },
+	{ "io_uring+direct", "io_uring", 1 },
+};
+
+static reader_context reader;
+static u64 filesize;
+static u32 threadcount;
+static u64 latencies[MAX_THREADS][RANDOM_READS];
+static int errors;
+
+static u64 checksum(const u8* data, size_t size)
+{
+	u64 sum = 0;
+	size_t i;
+
+	for(i=0; i<size; i+=512)
+		sum = sum * 31 + data[i];
+	return sum;
+}
+
+static void drop_cache(int fd)
+{
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static double rate(u64 bytes, u64 ns)
+{
+	return ns ? bytes * 1e9 / ns / (1 << 20) : 0;
+}
+
+static u64 run_seq(u8* buffer, u64* sum)
+{
+	u64 start = stats_now();
+	u64 offset;
+
+	*sum = 0;
+	for(offset=0; offset + SEQ_CHUNK <= filesize; offset+=SEQ_CHUNK)
+	{
+		if (!reader_read(&reader, offset, buffer, SEQ_CHUNK))
+		{
+			errors++;
+			break;
+		}
+		*sum += checksum(buffer, SEQ_CHUNK);
+	}
+	return stats_now() - start;
+}
+
+static u64 run_queue(u64* sum)
+{
+	reader_request requests[READER_QUEUE_DEPTH];
+	reader_request* request;
+	reader_queue queue;
+	u64 next = 0;
+	u64 start;
+	u32 i;
+
+	*sum = 0;
+	if (!reader_queue_init(&queue, &reader))
+	{
+		errors++;
+		return 0;
+	}
+
+	memset(requests, 0, sizeof(requests));
+	start = stats_now();
+	for(i=0; i<READER_QUEUE_DEPTH && next + READER_BUFSIZE <= filesize; i++)
+	{
+		requests[i].buffer = queue.buffers + i * READER_BUFSIZE;
+		requests[i].offset = next;
+		requests[i].size = READER_BUFSIZE;
+		next += READER_BUFSIZE;
+		if (!reader_submit(&queue, &requests[i]))
+			errors++;
+	}
+
+	while((request = reader_complete(&queue)) != 0)
+	{
+		if (!request->result)
+			errors++;
+		*sum += checksum(request->buffer, request->size);
+
+		if (next + READER_BUFSIZE <= filesize)
+		{
+			request->offset = next;
+			next += READER_BUFSIZE;
+			if (!reader_submit(&queue, request))
+				errors++;
+		}
+	}
+	start = stats_now() - start;
+
+	reader_queue_free(&queue);
+	return start;
+}
+
+static void* random_thread(void* arg)
+{
+	u32 id = (u32)(uintptr_t)arg;
+	u32 seed = id + 1;
+	u64 blocks = filesize / RANDOM_CHUNK;
+	u8* buffer = malloc(RANDOM_CHUNK);
+	u32 i;
+
+	for(i=0; i<RANDOM_READS; i++)
+	{
+		u64 offset = (u64)(rand_r(&seed) % blocks) * RANDOM_CHUNK;
+		u64 start = stats_now();
+
+		if (!reader_read(&reader, offset, buffer, RANDOM_CHUNK))
+			__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+		latencies[id][i] = stats_now() - start;
+	}
+	free(buffer);
+	return 0;
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+	u64 x = *(const u64*)a;
+	u64 y = *(const u64*)b;
+
+	return (x > y) - (x < y);
+}
+
+static u64 run_random(u64* p50, u64* p99)
+{
+	pthread_t threads[MAX_THREADS];
+	u64 count = (u64)threadcount * RANDOM_READS;
+	u64* all;
+	u64 start = stats_now();
+	u32 i;
+
+	for(i=0; i<threadcount; i++)
+		pthread_create(&threads[i], 0, random_thread, (void*)(uintptr_t)i);
+	for(i=0; i<threadcount; i++)
+		pthread_join(threads[i], 0);
+	start = stats_now() - start;
+
+	all = malloc(count * sizeof(u64));
+	for(i=0; i<threadcount; i++)
+		memcpy(all + (u64)i * RANDOM_READS, latencies[i], RANDOM_READS * sizeof(u64));
+	qsort(all, count, sizeof(u64), compare_u64);
+	*p50 = all[count / 2];
+	*p99 = all[count * 99 / 100];
+	free(all);
+	return start;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* path;
+	u64 expected = 0;
+	u8* buffer;
+	u32 i;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s FILE [THREADS]\n", argv[0]);
+		return 2;
+	}
+	path = argv[1];
+	threadcount = argc > 2 ? atoi(argv[2]) : 8;
+	if (threadcount < 1 || threadcount > MAX_THREADS)
+	{
+		fprintf(stderr, "THREADS must be 1 to %d\n", MAX_THREADS);
+		return 2;
+	}
+	buffer = malloc(SEQ_CHUNK);
+
+	printf("%-16s %10s %10s %10s %10s %10s\n", "backend", "seq MB/s", "queue MB/s", "rand MB/s", "p50 us", "p99 us");
+	for(i=0; i<sizeof(configs) / sizeof(configs[0]); i++)
+	{
+		const bench_config* config = &configs[i];
+		int fd = open(path, O_RDONLY);
+		int directfd = config->direct ? open(path, O_RDONLY | O_DIRECT) : -1;
+		FILE* file = fd >= 0 ? fdopen(dup(fd), "rb") : 0;
+		u64 seqsum, queuesum, seq, queue, random, p50, p99;
+
+		if (fd < 0 || file == 0)
+		{
+			perror(path);
+			return 2;
+		}
+		if ((config->direct && directfd < 0) || !reader_init(&reader, config->backend, file, fd, directfd))
+		{
+			printf("%-16s unavailable\n", config->name);
+			goto next;
+		}
+		filesize = reader.size;
+		if (filesize < RANDOM_CHUNK)
+		{
+			fprintf(stderr, "%s is too small\n", path);
+			return 2;
+		}
+
+		errors = 0;
+		drop_cache(fd);
+		seq = run_seq(buffer, &seqsum);
+		drop_cache(fd);
+		queue = run_queue(&queuesum);
+		drop_cache(fd);
+		random = run_random(&p50, &p99);
+		reader_close(&reader);
+
+		printf("%-16s %10.0f %10.0f %10.0f %10.1f %10.1f", config->name,
+			rate(filesize / SEQ_CHUNK * SEQ_CHUNK, seq),
+			rate(filesize / READER_BUFSIZE * READER_BUFSIZE, queue),
+			rate((u64)threadcount * RANDOM_READS * RANDOM_CHUNK, random),
+			p50 / 1e3, p99 / 1e3);
+		if (i == 0)
+			expected = seqsum;
+		if (errors)
+			printf("  %d read errors", errors);
+		if (seqsum != expected || queuesum != expected)
+			printf("  wrong data");
+		printf("\n");
+	next:
+		if (directfd >= 0)
+			close(directfd);
+		fclose(file);
+		close(fd);
+	}
+
+	free(buffer);
+	return 0;
+}
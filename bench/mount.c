@@ -0,0 +1,162 @@
+// Times what ctrfuse does with an image before the mount can serve
+// requests, next to what it used to do. Each run opens the image and
+// parses it as the mount does:
+//
+//   lazy    the NCSD and NCCH headers only, as the mount does now
+//   +romfs  lazy, then the RomFS loaded as the first look at /romfs does
+//   eager   everything up front: exheader, ExeFS, IVFC and RomFS metadata
+//
+// Each is run RUNS times with the image dropped from the page cache first
+// (as far as posix_fadvise can) and RUNS times warm, reporting the median
+// and the bytes read from the image.
+//
+// usage: mount IMAGE [RUNS]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "ncsd.h"
+#include "reader.h"
+#include "stats.h"
+#include "mem.h"
+
+#define MAX_RUNS	100
+
+typedef enum
+{
+	MOUNT_LAZY,
+	MOUNT_ROMFS,
+	MOUNT_EAGER,
+} mount_mode;
+
+static const char* names[] = { "lazy", "+romfs", "eager" };
+
+// The parsers read headers through stdio; count those bytes too, as the
+// mount's own backing stream does.
+static ssize_t counted_read(void* cookie, char* buf, size_t size)
+{
+	ssize_t n = read((int)(intptr_t)cookie, buf, size);
+
+	if (n > 0)
+		stats_add(STATS_BACKING_BYTES, n);
+	return n;
+}
+
+static int counted_seek(void* cookie, off64_t* offset, int whence)
+{
+	off_t pos = lseek((int)(intptr_t)cookie, *offset, whence);
+
+	if (pos < 0)
+		return -1;
+	*offset = pos;
+	return 0;
+}
+
+static int counted_close(void* cookie)
+{
+	return close((int)(intptr_t)cookie);
+}
+
+// Only the stream is closed after each run. The parsed contexts point into
+// one another and are small, and tearing them down is not what is being
+// timed, so they are left behind.
+static u64 mount_once(const char* path, mount_mode mode, int cold, u64* bytes)
+{
+	cookie_io_functions_t io = { counted_read, 0, counted_seek, counted_close };
+	ncsd_context* ncsd = malloc(sizeof(ncsd_context));
+	reader_context* reader = malloc(sizeof(reader_context));
+	u64 read = stats_get(STATS_BACKING_BYTES);
+	u64 start;
+	FILE* file;
+	int fd;
+
+	if (cold)
+	{
+		fd = open(path, O_RDONLY);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+
+	start = stats_now();
+	fd = open(path, O_RDONLY);
+	file = fd >= 0 ? fopencookie((void*)(intptr_t)fd, "rb", io) : 0;
+	if (file == 0 || ncsd == 0 || reader == 0)
+		return 0;
+	if (!reader_init(reader, "pread", file, fd, -1))
+		return 0;
+
+	ncsd_init(ncsd);
+	ncsd_set_file(ncsd, file);
+	ncsd_set_reader(ncsd, reader);
+	ncsd_set_size(ncsd, lseek(fd, 0, SEEK_END));
+	ncsd_process(ncsd, mode == MOUNT_EAGER ? 0 : LazyFlag);
+	if (mode == MOUNT_ROMFS)
+		ncch_load(&ncsd->ncch, NCCHTYPE_ROMFS);
+	start = stats_now() - start;
+
+	*bytes = stats_get(STATS_BACKING_BYTES) - read;
+	reader_close(reader);
+	fclose(file);
+	return start;
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+	u64 x = *(const u64*)a;
+	u64 y = *(const u64*)b;
+
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[])
+{
+	static u64 times[MAX_RUNS];
+	const char* path;
+	u32 runs;
+	u32 mode;
+	u32 warm;
+	u32 i;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s IMAGE [RUNS]\n", argv[0]);
+		return 2;
+	}
+	path = argv[1];
+	runs = argc > 2 ? atoi(argv[2]) : 20;
+	if (runs < 1 || runs > MAX_RUNS)
+	{
+		fprintf(stderr, "RUNS must be 1 to %d\n", MAX_RUNS);
+		return 2;
+	}
+	mem_init(0);
+
+	printf("%-8s %12s %12s %12s\n", "mount", "cold us", "warm us", "bytes read");
+	for(mode=MOUNT_LAZY; mode<=MOUNT_EAGER; mode++)
+	{
+		u64 median[2];
+		u64 bytes = 0;
+
+		for(warm=0; warm<2; warm++)
+		{
+			for(i=0; i<runs; i++)
+			{
+				times[i] = mount_once(path, mode, !warm, &bytes);
+				if (times[i] == 0)
+				{
+					fprintf(stderr, "could not open %s\n", path);
+					return 2;
+				}
+			}
+			qsort(times, runs, sizeof(u64), compare_u64);
+			median[warm] = times[runs / 2];
+		}
+		printf("%-8s %12.1f %12.1f %12llu\n", names[mode], median[0] / 1e3, median[1] / 1e3, bytes);
+	}
+	return 0;
+}
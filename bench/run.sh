@@ -0,0 +1,28 @@
+#!/bin/sh
+# Runs the benchmarks on scratch files made in BENCH_DIR (default: the
+# current directory, since O_DIRECT is refused on tmpfs). BENCH_SIZE is the
+# size of the backend benchmark's file in MB; BENCH_FILES is the number of
+# files in the mount benchmark's RomFS.
+set -e
+
+bench=$(dirname "$0")
+dir=${BENCH_DIR:-.}
+size=${BENCH_SIZE:-256}
+files=${BENCH_FILES:-20000}
+data=$dir/ctrfuse-bench.$$.bin
+image=$dir/ctrfuse-bench.$$.3ds
+trap 'rm -f "$data" "$image"' EXIT
+
+head -c $((size << 20)) /dev/urandom > "$data"
+echo "backends: $size MB, ${BENCH_THREADS:-8} threads"
+"$bench/backends" "$data" ${BENCH_THREADS:-8}
+rm -f "$data"
+
+encrypt=
+if command -v openssl >/dev/null; then
+	encrypt=--encrypt
+fi
+python3 "$bench/../tests/mkimage.py" "$image" --files $files $encrypt
+echo
+echo "mount: $files files${encrypt:+, encrypted}"
+"$bench/mount" "$image"
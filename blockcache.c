@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "types.h"
+#include "blockcache.h"
+#include "stats.h"
+
+#define BLOCKCACHE_NONE	0xFFFFFFFF
+
+typedef struct
+{
+	u64 image;
+	u64 offset;
+	u32 size;
+	u32 next;			// hash chain within the shard
+	u8 used;
+	u8 referenced;		// CLOCK bit, set on every hit
+	u8* data;
+} blockcache_entry;
+
+// Each shard is an independent CLOCK cache behind its own lock, so readers
+// of different blocks rarely wait on each other.
+typedef struct
+{
+	pthread_mutex_t lock;
+	blockcache_entry* entries;
+	u32* buckets;
+	u32 count;
+	u32 bucketmask;
+	u32 hand;
+} blockcache_shard;
+
+static blockcache_shard shards[BLOCKCACHE_SHARDS];
+static u32 shardcount;		// power of two, fewer for budgets of few blocks
+static int enabled = 0;
+
+static u64 blockcache_hash(u64 image, u64 offset)
+{
+	u64 hash = (image * 0x9E3779B97F4A7C15ull) ^ (offset / BLOCKCACHE_BLOCKSIZE);
+
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDull;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+static blockcache_shard* blockcache_shard_of(u64 hash)
+{
+	return &shards[hash & (shardcount - 1)];
+}
+
+// Sets aside room for budget bytes of blocks. Block memory itself is only
+// allocated as blocks are filled. A budget of 0 disables the cache.
+// The blocks are spread over the shards, so the cache never holds more
+// than the budget; a budget of fewer blocks than shards gets fewer shards.
+int blockcache_init(u64 budget)
+{
+	u64 blocks = budget / BLOCKCACHE_BLOCKSIZE;
+	u32 count, buckets;
+	u32 i, j;
+
+	if (blocks == 0)
+		return 1;
+
+	for(shardcount = BLOCKCACHE_SHARDS; shardcount > blocks; shardcount >>= 1)
+		;
+
+	for(i=0; i<shardcount; i++)
+	{
+		blockcache_shard* shard = &shards[i];
+
+		count = blocks / shardcount + (i < blocks % shardcount);
+		for(buckets = 1; buckets < count * 2; buckets <<= 1)
+			;
+
+		pthread_mutex_init(&shard->lock, 0);
+		shard->entries = calloc(count, sizeof(blockcache_entry));
+		shard->buckets = malloc(buckets * sizeof(u32));
+		if (shard->entries == 0 || shard->buckets == 0)
+			return 0;
+
+		for(j=0; j<buckets; j++)
+			shard->buckets[j] = BLOCKCACHE_NONE;
+		shard->count = count;
+		shard->bucketmask = buckets - 1;
+		stats_add(STATS_MEMORY, count * sizeof(blockcache_entry) + buckets * sizeof(u32));
+	}
+
+	enabled = 1;
+	return 1;
+}
+
+int blockcache_enabled(void)
+{
+	return enabled;
+}
+
+static blockcache_entry* blockcache_find(blockcache_shard* shard, u32 bucket, u64 image, u64 offset)
+{
+	u32 index;
+
+	for(index = shard->buckets[bucket]; index != BLOCKCACHE_NONE; index = shard->entries[index].next)
+	{
+		blockcache_entry* entry = &shard->entries[index];
+
+		if (entry->offset == offset && entry->image == image)
+			return entry;
+	}
+	return 0;
+}
+
+static void blockcache_unlink(blockcache_shard* shard, u32 index)
+{
+	blockcache_entry* entry = &shard->entries[index];
+	u32 bucket = (blockcache_hash(entry->image, entry->offset) / BLOCKCACHE_SHARDS) & shard->bucketmask;
+	u32* link = &shard->buckets[bucket];
+
+	while(*link != index)
+		link = &shard->entries[*link].next;
+	*link = entry->next;
+}
+
+// Reports whether the block at offset is cached, without touching it.
+int blockcache_contains(u64 image, u64 offset)
+{
+	u64 hash = blockcache_hash(image, offset);
+	blockcache_shard* shard = blockcache_shard_of(hash);
+	int found;
+
+	if (!enabled)
+		return 0;
+
+	pthread_mutex_lock(&shard->lock);
+	found = blockcache_find(shard, (hash / BLOCKCACHE_SHARDS) & shard->bucketmask, image, offset) != 0;
+	pthread_mutex_unlock(&shard->lock);
+	return found;
+}
+
+// Copies size bytes starting at start within the block at offset into
+// buffer. Returns 0 if the block is not cached.
+int blockcache_get(u64 image, u64 offset, u8* buffer, u32 start, u32 size)
+{
+	u64 hash = blockcache_hash(image, offset);
+	blockcache_shard* shard = blockcache_shard_of(hash);
+	blockcache_entry* entry;
+	int hit = 0;
+
+	if (!enabled)
+		return 0;
+
+	pthread_mutex_lock(&shard->lock);
+	entry = blockcache_find(shard, (hash / BLOCKCACHE_SHARDS) & shard->bucketmask, image, offset);
+	if (entry && start + size <= entry->size)
+	{
+		memcpy(buffer, entry->data + start, size);
+		entry->referenced = 1;
+		hit = 1;
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	stats_add(hit ? STATS_BLOCKCACHE_HITS : STATS_BLOCKCACHE_MISSES, 1);
+	return hit;
+}
+
+void blockcache_put(u64 image, u64 offset, const u8* data, u32 size)
+{
+	u64 hash = blockcache_hash(image, offset);
+	blockcache_shard* shard = blockcache_shard_of(hash);
+	u32 bucket = (hash / BLOCKCACHE_SHARDS) & shard->bucketmask;
+	blockcache_entry* entry;
+	u32 index;
+
+	if (!enabled)
+		return;
+
+	pthread_mutex_lock(&shard->lock);
+
+	// Another reader may have filled the same block in the meantime.
+	if (blockcache_find(shard, bucket, image, offset))
+		goto clean;
+
+	// Sweep the hand, giving recently used blocks a second chance.
+	for(;;)
+	{
+		index = shard->hand;
+		entry = &shard->entries[index];
+		shard->hand = (index + 1) % shard->count;
+
+		if (!entry->used)
+			break;
+		if (!entry->referenced)
+		{
+			blockcache_unlink(shard, index);
+			break;
+		}
+		entry->referenced = 0;
+	}
+
+	if (entry->data == 0)
+	{
+		entry->data = malloc(BLOCKCACHE_BLOCKSIZE);
+		if (entry->data == 0)
+		{
+			entry->used = 0;
+			goto clean;
+		}
+		stats_add(STATS_MEMORY, BLOCKCACHE_BLOCKSIZE);
+	}
+
+	memcpy(entry->data, data, size);
+	entry->image = image;
+	entry->offset = offset;
+	entry->size = size;
+	entry->used = 1;
+	entry->referenced = 0;
+	entry->next = shard->buckets[bucket];
+	shard->buckets[bucket] = index;
+
+clean:
+	pthread_mutex_unlock(&shard->lock);
+}
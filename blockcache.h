@@ -0,0 +1,24 @@
+#ifndef _BLOCKCACHE_H_
+#define _BLOCKCACHE_H_
+
+#include "types.h"
+
+#define BLOCKCACHE_BLOCKSIZE		0x10000
+#define BLOCKCACHE_SHARDS			16		// at most; power of two
+#define BLOCKCACHE_DEFAULT_SIZE		(64 * 1024 * 1024)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int  blockcache_init(u64 budget);
+int  blockcache_enabled(void);
+int  blockcache_contains(u64 image, u64 offset);
+int  blockcache_get(u64 image, u64 offset, u8* buffer, u32 start, u32 size);
+void blockcache_put(u64 image, u64 offset, const u8* data, u32 size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _BLOCKCACHE_H_
@@ -19,12 +19,12 @@ void cia_set_file(cia_context* ctx, FILE* file)
 	ctx->file = file;
 }
 
-void cia_set_offset(cia_context* ctx, u32 offset)
+void cia_set_offset(cia_context* ctx, u64 offset)
 {
 	ctx->offset = offset;
 }
 
-void cia_set_size(cia_context* ctx, u32 size)
+void cia_set_size(cia_context* ctx, u64 size)
 {
 	ctx->size = size;
 }
@@ -38,8 +38,8 @@ void cia_set_usersettings(cia_context* ctx, settings* usersettings)
 
 void cia_save(cia_context* ctx, u32 type, u32 flags)
 {
-	u32 offset;
-	u32 size;
+	u64 offset;
+	u64 size;
 	filepath* path = 0;
 	ctr_tmd_body *body;
 	ctr_tmd_contentchunk *chunk;
@@ -107,9 +107,9 @@ void cia_save(cia_context* ctx, u32 type, u32 flags)
 
 				ctr_init_cbc_decrypt(&ctx->aes, ctx->titlekey, ctx->iv);
 
-				cia_save_blob(ctx, tmpname, offset, getbe64(chunk->size) & 0xffffffff, 1);
+				cia_save_blob(ctx, tmpname, offset, getbe64(chunk->size), 1);
 
-				offset += getbe64(chunk->size) & 0xffffffff;
+				offset += getbe64(chunk->size);
 
 				chunk++;
 			}
@@ -125,12 +125,12 @@ void cia_save(cia_context* ctx, u32 type, u32 flags)
 	cia_save_blob(ctx, path->pathname, offset, size, 0);
 }
 
-void cia_save_blob(cia_context *ctx, char *out_path, u32 offset, u32 size, int do_cbc) 
+void cia_save_blob(cia_context *ctx, char *out_path, u64 offset, u64 size, int do_cbc) 
 {
 	FILE *fout = 0;
 	u8 buffer[16*1024];
 
-	fseek(ctx->file, ctx->offset + offset, SEEK_SET);
+	fseeko(ctx->file, ctx->offset + offset, SEEK_SET);
 
 	
 	fout = fopen(out_path, "wb");
@@ -172,7 +172,7 @@ clean:
 
 void cia_process(cia_context* ctx, u32 actions)
 {	
-	fseek(ctx->file, 0, SEEK_SET);
+	fseeko(ctx->file, 0, SEEK_SET);
 
 	if (fread(&ctx->header, 1, sizeof(ctr_ciaheader), ctx->file) != sizeof(ctr_ciaheader))
 	{
@@ -184,14 +184,14 @@ void cia_process(cia_context* ctx, u32 actions)
 	ctx->sizecert = getle32(ctx->header.certsize);
 	ctx->sizetik = getle32(ctx->header.ticketsize);
 	ctx->sizetmd = getle32(ctx->header.tmdsize);
-	ctx->sizecontent = (u32)getle64(ctx->header.contentsize);
+	ctx->sizecontent = getle64(ctx->header.contentsize);
 	ctx->sizemeta = getle32(ctx->header.metasize);
 	
 	ctx->offsetcerts = align(ctx->sizeheader, 64);
 	ctx->offsettik = align(ctx->offsetcerts + ctx->sizecert, 64);
 	ctx->offsettmd = align(ctx->offsettik + ctx->sizetik, 64);
 	ctx->offsetcontent = align(ctx->offsettmd + ctx->sizetmd, 64);
-	ctx->offsetmeta = align(ctx->offsetcontent + ctx->sizecontent, 64);
+	ctx->offsetmeta = align64(ctx->offsetcontent + ctx->sizecontent, 64);
 
 	if (actions & InfoFlag)
 		cia_print(ctx);
@@ -241,35 +241,49 @@ void cia_verify_contents(cia_context *ctx)
 {
 	ctr_tmd_body *body;
 	ctr_tmd_contentchunk *chunk;
-	u8 *verify_buf;
-	u32 content_size=0;
+	u8 buffer[16*1024];
+	u64 content_size=0;
+	u8 hash[32];
 	int i;
 
 	// verify TMD content hashes, requires decryption ..
 	body  = tmd_get_body(&ctx->tmd);
 	chunk = (ctr_tmd_contentchunk*)(body->contentinfo + (sizeof(ctr_tmd_contentinfo) * TMD_MAX_CONTENTS));
 
-	fseek(ctx->file, ctx->offset + ctx->offsetcontent, SEEK_SET);
+	fseeko(ctx->file, ctx->offset + ctx->offsetcontent, SEEK_SET);
 	for(i = 0; i < getbe16(body->contentcount); i++) 
 	{
-		content_size = getbe64(chunk->size) & 0xffffffff;
+		content_size = getbe64(chunk->size);
 
 		ctx->iv[0] = (getbe16(chunk->index) >> 8) & 0xff;
 		ctx->iv[1] = getbe16(chunk->index) & 0xff;
 
 		ctr_init_cbc_decrypt(&ctx->aes, ctx->titlekey, ctx->iv);
 
-		verify_buf = malloc(content_size);
-		fread(verify_buf, content_size, 1, ctx->file);
+		// Contents can be larger than memory, so hash them as they stream past.
+		ctr_sha_256_init(&ctx->sha);
+		while(content_size)
+		{
+			u32 max = sizeof(buffer);
+			if (max > content_size)
+				max = content_size;
+
+			if (max != fread(buffer, 1, max, ctx->file))
+				break;
 
-		ctr_decrypt_cbc(&ctx->aes, verify_buf, verify_buf, content_size);
+			ctr_decrypt_cbc(&ctx->aes, buffer, buffer, max);
+			ctr_sha_256_update(&ctx->sha, buffer, max);
+			content_size -= max;
+		}
+		ctr_sha_256_finish(&ctx->sha, hash);
 
-		if (ctr_sha_256_verify(verify_buf, content_size, chunk->hash) == Good)
+		if (content_size == 0 && memcmp(hash, chunk->hash, 0x20) == 0)
 			ctx->tmd.content_hash_stat[i] = 1;
 		else
 			ctx->tmd.content_hash_stat[i] = 2;
 
-		free(verify_buf);
+		// Keep the stream in step with the next content after a short read.
+		fseeko(ctx->file, content_size, SEEK_CUR);
 
 		chunk++;
 	}
@@ -288,8 +302,8 @@ void cia_print(cia_context* ctx)
 	fprintf(stdout, "Ticket size             0x%04x\n", ctx->sizetik);
 	fprintf(stdout, "TMD offset:             0x%08x\n", ctx->offsettmd);
 	fprintf(stdout, "TMD size:               0x%04x\n", ctx->sizetmd);
-	fprintf(stdout, "Meta offset:            0x%04x\n", ctx->offsetmeta);
+	fprintf(stdout, "Meta offset:            0x%04llx\n", ctx->offsetmeta);
 	fprintf(stdout, "Meta size:              0x%04x\n", ctx->sizemeta);
-	fprintf(stdout, "Content offset:         0x%08x\n", ctx->offsetcontent);
+	fprintf(stdout, "Content offset:         0x%08llx\n", ctx->offsetcontent);
 	fprintf(stdout, "Content size:           0x%016llx\n", getle64(header->contentsize));
 }
@@ -4,6 +4,8 @@
 #include <time.h>
 
 #include "ctr.h"
+#include "stats.h"
+#include "trace.h"
 
 
 void ctr_set_iv( ctr_aes_context* ctx,
@@ -95,6 +97,9 @@ void ctr_crypt_counter( ctr_aes_context* ctx,
 	u8 stream[16];
 	u32 i;
 
+	TRACE_SPAN("aes_ctr");
+	stats_add(STATS_DECRYPTED_BYTES, size);
+
 	while(size >= 16)
 	{
 		ctr_crypt_counter_block(ctx, input, output);
@@ -153,6 +158,8 @@ void ctr_decrypt_cbc( ctr_aes_context* ctx,
 					  u8* output,
 					  u32 size )
 {
+	TRACE_SPAN("aes_cbc");
+	stats_add(STATS_DECRYPTED_BYTES, size);
 	aes_crypt_cbc(&ctx->aes, AES_DECRYPT, size, ctx->iv, input, output);
 }
 
@@ -160,6 +167,8 @@ void ctr_sha_256( const u8* data,
 				  u32 size, 
 				  u8 hash[0x20] )
 {
+	TRACE_SPAN("sha256");
+	stats_add(STATS_HASHED_BYTES, size);
 	sha2(data, size, hash, 0);
 }
 
@@ -168,7 +177,9 @@ int ctr_sha_256_verify( const u8* data,
 				  const u8 checkhash[0x20] )
 {
 	u8 hash[0x20];
+	TRACE_SPAN("sha256");
 
+	stats_add(STATS_HASHED_BYTES, size);
 	sha2(data, size, hash, 0);
 
 	if (memcmp(hash, checkhash, 0x20) == 0)
@@ -186,6 +197,8 @@ void ctr_sha_256_update( ctr_sha256_context* ctx,
 							    const u8* data,
 								u32 size )
 {
+	TRACE_SPAN("sha256");
+	stats_add(STATS_HASHED_BYTES, size);
 	sha2_update(&ctx->sha, data, size);
 }
 
@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include "types.h"
+#include "decrypt.h"
+#include "exheader.h"
+#include "utils.h"
+#include "log.h"
+
+#define DECRYPT_NCCH_HEADER_SIZE	0x200
+#define DECRYPT_IN_PLACE			((u64)-1)	// a part's start is where it lies in the image
+
+static void decrypt_init(decrypt_context* ctx, FILE* file, reader_context* reader, u64 offset)
+{
+	memset(ctx, 0, sizeof(decrypt_context));
+	ctx->file = file;
+	ctx->reader = reader;
+	ctx->offset = offset;
+}
+
+void decrypt_close(decrypt_context* ctx)
+{
+	u32 i;
+
+	for(i=0; i<ctx->spancount; i++)
+		free(ctx->spans[i].data);
+	free(ctx->spans);
+	ctx->spans = 0;
+	ctx->spancount = 0;
+	ctx->spancapacity = 0;
+}
+
+static decrypt_span* decrypt_add_span(decrypt_context* ctx, u64 start, u64 size)
+{
+	decrypt_span* span;
+
+	if (ctx->spancount == ctx->spancapacity)
+	{
+		u32 capacity = ctx->spancapacity ? ctx->spancapacity * 2 : 16;
+		decrypt_span* spans = realloc(ctx->spans, capacity * sizeof(decrypt_span));
+
+		if (spans == 0)
+			return 0;
+		ctx->spans = spans;
+		ctx->spancapacity = capacity;
+	}
+
+	span = &ctx->spans[ctx->spancount++];
+	memset(span, 0, sizeof(decrypt_span));
+	span->start = start;
+	span->size = size;
+	return span;
+}
+
+// Adds the image bytes under [start, start+size) as they are.
+static int decrypt_add_raw(decrypt_context* ctx, u64 start, u64 size)
+{
+	decrypt_span* span = decrypt_add_span(ctx, start, size);
+
+	if (span == 0)
+		return 0;
+	region_init(&span->region, ctx->file, ctx->offset + start, size);
+	region_set_reader(&span->region, ctx->reader);
+	return 1;
+}
+
+// Adds one of the NCCH's encrypted parts, with the key and counter the
+// parsers use for it. ExeFS and RomFS get the same content image id as the
+// parsers' regions, so blocks either side decrypts are there for the other.
+static int decrypt_add_part(decrypt_context* ctx, u64 start, ncch_context* ncch, u32 type)
+{
+	decrypt_span* span;
+	u8 counter[16];
+	u64 offset, size;
+
+	switch(type)
+	{
+	case NCCHTYPE_EXHEADER:
+		offset = ncch_get_exheader_offset(ncch);
+		size = (u64)ncch_get_exheader_size(ncch) * 2;		// with the access descriptor
+		break;
+	case NCCHTYPE_EXEFS:
+		offset = ncch_get_exefs_offset(ncch);
+		size = ncch_get_exefs_size(ncch);
+		break;
+	case NCCHTYPE_ROMFS:
+		offset = ncch_get_romfs_offset(ncch);
+		size = ncch_get_romfs_size(ncch);
+		break;
+	default:
+		return 0;
+	}
+
+	if (size == 0)
+		return 1;
+
+	span = decrypt_add_span(ctx, start == DECRYPT_IN_PLACE ? offset - ctx->offset : start, size);
+	if (span == 0)
+		return 0;
+	ncch_get_counter(ncch, counter, type);
+	region_init(&span->region, ctx->file, offset, size);
+	region_set_reader(&span->region, ctx->reader);
+	region_set_crypto(&span->region, ncch->key, counter, ncch->encrypted);
+
+	// The exheader's own region covers only the exheader, so its cached
+	// blocks would not line up with ours; it is small enough to read raw.
+	if (type != NCCHTYPE_EXHEADER && ncch->encrypted && ncch->imageid)
+	{
+		region_set_image(&span->region, ncch->imageid + type);
+		span->cached = 1;
+	}
+	return 1;
+}
+
+// An NCCH with no key we know decrypts to noise. Where there is an
+// exheader, its program id must come out matching the header's.
+static int decrypt_ncch_usable(ncch_context* ncch)
+{
+	region_context region;
+	u8 counter[16];
+	u8 programid[8];
+
+	if (!ncch->encrypted || ncch_get_exheader_size(ncch) == 0)
+		return 1;
+
+	ncch_get_counter(ncch, counter, NCCHTYPE_EXHEADER);
+	region_init(&region, ncch->file, ncch_get_exheader_offset(ncch), sizeof(exheader_header));
+	region_set_reader(&region, ncch->reader);
+	region_set_crypto(&region, ncch->key, counter, ncch->encrypted);
+	if (!region_read_raw(&region, offsetof(exheader_header, arm11systemlocalcaps.programid), programid, sizeof(programid)))
+		return 0;
+	return memcmp(programid, ncch->header->programid, 8) == 0;
+}
+
+// Adds a decrypted NCCH at its place in the image: its header with the
+// crypto flags patched to say it is plaintext, then each encrypted part.
+static int decrypt_add_ncch(decrypt_context* ctx, ncch_context* ncch)
+{
+	ctr_ncchheader* header;
+	decrypt_span* span;
+
+	if (!ncch->encrypted)
+		return 1;
+
+	span = decrypt_add_span(ctx, ncch->offset - ctx->offset, DECRYPT_NCCH_HEADER_SIZE);
+	if (span == 0)
+		return 0;
+	span->data = malloc(DECRYPT_NCCH_HEADER_SIZE);
+	if (span->data == 0)
+		return 0;
+	memcpy(span->data, ncch->header, DECRYPT_NCCH_HEADER_SIZE);
+
+	header = (ctr_ncchheader*)span->data;
+	header->flags[3] = 0;				// crypto method
+	header->flags[7] &= ~(0x01 | 0x20);	// fixed key, seed
+	header->flags[7] |= 0x04;			// no crypto
+
+	return decrypt_add_part(ctx, DECRYPT_IN_PLACE, ncch, NCCHTYPE_EXHEADER) &&
+	       decrypt_add_part(ctx, DECRYPT_IN_PLACE, ncch, NCCHTYPE_EXEFS) &&
+	       decrypt_add_part(ctx, DECRYPT_IN_PLACE, ncch, NCCHTYPE_ROMFS);
+}
+
+static int decrypt_compare(const void* a, const void* b)
+{
+	const decrypt_span* x = a;
+	const decrypt_span* y = b;
+
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+	return 0;
+}
+
+// Sorts the spans added so far, clips them to size, drops any that overlap
+// an earlier one and fills the gaps between them with image bytes.
+static int decrypt_finish(decrypt_context* ctx, u64 size)
+{
+	decrypt_span* spans = ctx->spans;
+	u32 count = ctx->spancount;
+	u64 pos = 0;
+	u32 i;
+	int result = 0;
+
+	qsort(spans, count, sizeof(decrypt_span), decrypt_compare);
+	ctx->spans = 0;
+	ctx->spancount = 0;
+	ctx->spancapacity = 0;
+	ctx->size = size;
+
+	for(i=0; i<count; i++)
+	{
+		decrypt_span* span;
+
+		if (spans[i].start < pos || spans[i].start >= size)
+		{
+			if (spans[i].start < size)
+				log_warn("Warning, overlapping parts at 0x%llx left encrypted", spans[i].start);
+			free(spans[i].data);
+			continue;
+		}
+		if (spans[i].start > pos && !decrypt_add_raw(ctx, pos, spans[i].start - pos))
+			goto clean;
+		if (spans[i].size > size - spans[i].start)
+		{
+			// cut short, its blocks no longer match the parsers'
+			spans[i].size = size - spans[i].start;
+			spans[i].region.size = spans[i].size;
+			spans[i].cached = 0;
+		}
+
+		span = decrypt_add_span(ctx, spans[i].start, spans[i].size);
+		if (span == 0)
+			goto clean;
+		*span = spans[i];
+		spans[i].data = 0;
+		pos = span->start + span->size;
+	}
+	if (pos < size && !decrypt_add_raw(ctx, pos, size - pos))
+		goto clean;
+	result = 1;
+
+clean:
+	for(; i<count; i++)
+		free(spans[i].data);
+	free(spans);
+	return result;
+}
+
+// Sets up the whole image, with every NCCH partition decrypted in place.
+// Fails if a partition is encrypted with a key we don't have.
+int decrypt_open_ncsd(decrypt_context* ctx, ncsd_context* ncsd)
+{
+	ncch_context* ncch;
+	u32 i;
+
+	decrypt_init(ctx, ncsd->file, ncsd->reader, ncsd->offset);
+	if (ncsd_get_partition(ncsd, 0) == 0)
+		return 0;
+
+	for(i=0; i<8; i++)
+	{
+		ncch = ncsd_get_partition(ncsd, i);
+		if (ncch == 0)
+			continue;
+		if (!decrypt_ncch_usable(ncch))
+		{
+			log_warn("Warning, partition %d cannot be decrypted", i);
+			goto clean;
+		}
+		if (!decrypt_add_ncch(ctx, ncch))
+			goto clean;
+	}
+
+	if (!decrypt_finish(ctx, ncsd->size))
+		goto clean;
+	return 1;
+
+clean:
+	decrypt_close(ctx);
+	return 0;
+}
+
+// Sets up one part of an NCCH, the exheader with its access descriptor,
+// the ExeFS or the RomFS, as a file of its own. Fails if the part is
+// empty or encrypted with a key we don't have.
+int decrypt_open_ncch(decrypt_context* ctx, ncch_context* ncch, u32 type)
+{
+	decrypt_init(ctx, ncch->file, ncch->reader, 0);
+	if (!decrypt_ncch_usable(ncch) || !decrypt_add_part(ctx, 0, ncch, type) || ctx->spancount == 0)
+		goto clean;
+
+	if (!decrypt_finish(ctx, ctx->spans[0].size))
+		goto clean;
+	return 1;
+
+clean:
+	decrypt_close(ctx);
+	return 0;
+}
+
+u64 decrypt_get_size(decrypt_context* ctx)
+{
+	return ctx->size;
+}
+
+// Returns the span holding offset, which must be below the size.
+static decrypt_span* decrypt_find_span(decrypt_context* ctx, u64 offset)
+{
+	u32 lo = 0;
+	u32 hi = ctx->spancount;
+
+	while(hi - lo > 1)
+	{
+		u32 mid = lo + (hi - lo) / 2;
+
+		if (ctx->spans[mid].start <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return &ctx->spans[lo];
+}
+
+ssize_t decrypt_read(decrypt_context* ctx, char* buf, off_t offset, size_t size)
+{
+	decrypt_span* span;
+	size_t done = 0;
+
+	if (offset < 0 || (u64)offset >= ctx->size)
+		return 0;
+	if (size > ctx->size - offset)
+		size = ctx->size - offset;
+
+	span = decrypt_find_span(ctx, offset);
+	while(done < size)
+	{
+		u64 within = offset + done - span->start;
+		size_t max = size - done;
+		int ok;
+
+		if (max > span->size - within)
+			max = span->size - within;
+
+		if (span->data)
+		{
+			memcpy(buf + done, span->data + within, max);
+			ok = 1;
+		}
+		else if (span->cached)
+			ok = region_read(&span->region, within, buf + done, max);
+		else
+			ok = region_read_raw(&span->region, within, buf + done, max);
+
+		if (!ok)
+			return -EIO;
+		done += max;
+		span++;
+	}
+
+	return size;
+}
+
+// Finds a file descriptor holding the decrypted bytes at offset, for as
+// much of size as lies in one span, which is only possible where they are
+// the image's own plaintext or sit verified in the disk cache.
+int decrypt_locate(decrypt_context* ctx, off_t offset, size_t* size, int* fd, u64* position)
+{
+	decrypt_span* span;
+	u64 within;
+
+	if (offset < 0 || (u64)offset >= ctx->size)
+		return 0;
+
+	span = decrypt_find_span(ctx, offset);
+	if (span->data)
+		return 0;
+
+	within = offset - span->start;
+	if (*size > span->size - within)
+		*size = span->size - within;
+	return region_locate(&span->region, within, *size, fd, position);
+}
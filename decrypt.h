@@ -0,0 +1,48 @@
+#ifndef _DECRYPT_H_
+#define _DECRYPT_H_
+
+#include <sys/types.h>
+#include "types.h"
+#include "region.h"
+#include "ncsd.h"
+
+// One stretch of a decrypted file: image bytes read through region, or
+// bytes held in data when the image's own had to be patched.
+typedef struct
+{
+	u64 start;				// in the decrypted file
+	u64 size;
+	region_context region;
+	int cached;				// read through the block cache, shared with the parsers
+	u8* data;
+} decrypt_span;
+
+// A plaintext view of an image, or of one part of an NCCH, decrypted as it
+// is read. Nothing is decrypted up front; spans are sorted by start.
+typedef struct
+{
+	FILE* file;
+	reader_context* reader;
+	u64 offset;				// where the view starts in the image
+	u64 size;
+	decrypt_span* spans;
+	u32 spancount;
+	u32 spancapacity;
+} decrypt_context;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int     decrypt_open_ncsd(decrypt_context* ctx, ncsd_context* ncsd);
+int     decrypt_open_ncch(decrypt_context* ctx, ncch_context* ncch, u32 type);
+void    decrypt_close(decrypt_context* ctx);
+u64     decrypt_get_size(decrypt_context* ctx);
+ssize_t decrypt_read(decrypt_context* ctx, char* buf, off_t offset, size_t size);
+int     decrypt_locate(decrypt_context* ctx, off_t offset, size_t* size, int* fd, u64* position);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DECRYPT_H_
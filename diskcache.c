@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "types.h"
+#include "diskcache.h"
+#include "blockcache.h"
+#include "stats.h"
+#include "log.h"
+
+// Each image gets one sparse file, <image id>.blk, that holds decrypted
+// blocks at their offset within the region. Nothing read back from it is
+// used until it has passed the image's own hashes, or matched a block that
+// has; verified tracks the blocks that have, for this mount. The directory
+// and its files must belong to this user and be closed to everyone else,
+// since verified ranges are handed to the kernel straight from the file.
+typedef struct
+{
+	u64 image;
+	int fd;
+	u8* verified;
+	u64 verifiedblocks;
+} diskcache_image;
+
+typedef struct
+{
+	char name[32];
+	time_t mtime;
+	u64 size;
+} diskcache_file;
+
+static char* cachedir;
+static u64 budget;
+static u64 used;
+static diskcache_image images[DISKCACHE_MAX_IMAGES];
+static u32 imagecount;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int diskcache_is_blockfile(const char* name, u64* image)
+{
+	char* end;
+
+	*image = strtoull(name, &end, 16);
+	return end == name + 16 && strcmp(end, ".blk") == 0;
+}
+
+static int diskcache_is_open(u64 image)
+{
+	u32 i;
+
+	for(i=0; i<imagecount; i++)
+	{
+		if (images[i].image == image)
+			return 1;
+	}
+	return 0;
+}
+
+// Lists the block files in the cache directory and returns the bytes they
+// take up on disk.
+static u64 diskcache_scan(diskcache_file** files, u32* count)
+{
+	DIR* dir = opendir(cachedir);
+	struct dirent* entry;
+	struct stat st;
+	char path[1024];
+	u64 total = 0;
+	u32 capacity = 0;
+	u64 image;
+
+	*files = 0;
+	*count = 0;
+	if (dir == 0)
+		return 0;
+
+	while((entry = readdir(dir)) != 0)
+	{
+		if (!diskcache_is_blockfile(entry->d_name, &image))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", cachedir, entry->d_name);
+		if (stat(path, &st) != 0)
+			continue;
+
+		if (*count == capacity)
+		{
+			diskcache_file* grown = realloc(*files, (capacity * 2 + 16) * sizeof(diskcache_file));
+			if (grown == 0)
+				break;
+			*files = grown;
+			capacity = capacity * 2 + 16;
+		}
+
+		// diskcache_is_blockfile has checked the name is exactly 20 bytes.
+		memcpy((*files)[*count].name, entry->d_name, 21);
+		(*files)[*count].mtime = st.st_mtime;
+		(*files)[*count].size = (u64)st.st_blocks * 512;
+		total += (u64)st.st_blocks * 512;
+		(*count)++;
+	}
+
+	closedir(dir);
+	return total;
+}
+
+static int diskcache_compare_mtime(const void* a, const void* b)
+{
+	const diskcache_file* x = a;
+	const diskcache_file* y = b;
+
+	return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+// Deletes the least recently mounted images until needed more bytes fit.
+// Files of images this mount has open are never deleted. Called locked.
+static int diskcache_evict(u64 needed)
+{
+	diskcache_file* files;
+	char path[1024];
+	u32 count, i;
+	u64 image;
+
+	used = diskcache_scan(&files, &count);
+	qsort(files, count, sizeof(diskcache_file), diskcache_compare_mtime);
+
+	for(i=0; i<count && used + needed > budget; i++)
+	{
+		diskcache_is_blockfile(files[i].name, &image);
+		if (diskcache_is_open(image))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", cachedir, files[i].name);
+		if (unlink(path) == 0)
+		{
+			log_info("evicted %s from the disk cache", files[i].name);
+			used -= files[i].size;
+		}
+	}
+
+	free(files);
+	return used + needed <= budget;
+}
+
+// Accepts a cache directory or file only if this user owns it and no one
+// else can get at it.
+static int diskcache_private(const struct stat* st)
+{
+	return st->st_uid == geteuid() && (st->st_mode & 077) == 0;
+}
+
+int diskcache_init(const char* dir, u64 size)
+{
+	diskcache_file* files;
+	struct stat st;
+	u32 count;
+
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+		return 0;
+	if (lstat(dir, &st) != 0)
+		return 0;
+	if (!S_ISDIR(st.st_mode) || !diskcache_private(&st))
+	{
+		log_error("Error, disk cache %s must be a directory only its owner can use", dir);
+		errno = EACCES;
+		return 0;
+	}
+
+	cachedir = strdup(dir);
+	if (cachedir == 0)
+		return 0;
+
+	budget = size;
+	used = diskcache_scan(&files, &count);
+	free(files);
+	return 1;
+}
+
+int diskcache_enabled(void)
+{
+	return cachedir != 0;
+}
+
+// Finds the cache file for image, opening it on first use. Opening marks
+// the image as recently used for eviction. Called locked.
+static diskcache_image* diskcache_open(u64 image)
+{
+	diskcache_image* entry;
+	char path[1024];
+	struct stat st;
+	u32 i;
+	int fd;
+
+	for(i=0; i<imagecount; i++)
+	{
+		if (images[i].image == image)
+			return &images[i];
+	}
+
+	if (imagecount == DISKCACHE_MAX_IMAGES)
+		return 0;
+
+	snprintf(path, sizeof(path), "%s/%016llx.blk", cachedir, image);
+	fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0)
+	{
+		log_warn("could not open disk cache file %s", path);
+		return 0;
+	}
+	// A file others can get at is remembered with no fd, so it is refused
+	// once rather than on every block.
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || !diskcache_private(&st))
+	{
+		log_warn("disk cache file %s is not private, not using it", path);
+		close(fd);
+		fd = -1;
+	}
+	else
+		futimens(fd, 0);
+
+	entry = &images[imagecount++];
+	entry->image = image;
+	entry->fd = fd;
+	entry->verified = 0;
+	entry->verifiedblocks = 0;
+	return entry;
+}
+
+static int diskcache_test_verified(diskcache_image* entry, u64 block)
+{
+	if (block >= entry->verifiedblocks)
+		return 0;
+	return (entry->verified[block / 8] >> (block % 8)) & 1;
+}
+
+// Reads a whole block back. verified says whether this mount has already
+// checked it; if not, the caller must check it before using it.
+int diskcache_get(u64 image, u64 offset, u8* buffer, u32 size, int* verified)
+{
+	diskcache_image* entry;
+	int fd = -1;
+
+	pthread_mutex_lock(&lock);
+	entry = diskcache_open(image);
+	if (entry)
+	{
+		fd = entry->fd;
+		*verified = diskcache_test_verified(entry, offset / BLOCKCACHE_BLOCKSIZE);
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (fd < 0)
+		return 0;
+
+	// A hole means the block was never written; don't bother hashing zeros.
+	if (!*verified && lseek(fd, offset, SEEK_DATA) != (off_t)offset)
+		goto miss;
+
+	if (pread(fd, buffer, size, offset) != (ssize_t)size)
+		goto miss;
+
+	stats_add(STATS_DISKCACHE_HITS, 1);
+	return 1;
+
+miss:
+	stats_add(STATS_DISKCACHE_MISSES, 1);
+	return 0;
+}
+
+void diskcache_set_verified(u64 image, u64 offset)
+{
+	diskcache_image* entry;
+	u64 block = offset / BLOCKCACHE_BLOCKSIZE;
+
+	pthread_mutex_lock(&lock);
+	entry = diskcache_open(image);
+	if (entry && block >= entry->verifiedblocks)
+	{
+		u64 blocks = (block + 64) & ~63ull;
+		u8* grown = realloc(entry->verified, blocks / 8);
+
+		if (grown)
+		{
+			memset(grown + entry->verifiedblocks / 8, 0, (blocks - entry->verifiedblocks) / 8);
+			entry->verified = grown;
+			entry->verifiedblocks = blocks;
+		}
+	}
+	if (entry && block < entry->verifiedblocks)
+		entry->verified[block / 8] |= 1 << (block % 8);
+	pthread_mutex_unlock(&lock);
+}
+
+// Stores a freshly decrypted block, making room within the budget first.
+// A block the caller has checked only counts as verified once it has been
+// read back from the file and found to be what was written; any other is
+// checked when it is next read.
+void diskcache_put(u64 image, u64 offset, const u8* buffer, u32 size, int checked)
+{
+	diskcache_image* entry;
+	u8* readback;
+	int fd = -1;
+
+	pthread_mutex_lock(&lock);
+	entry = diskcache_open(image);
+	if (entry && entry->fd >= 0 && (used + size <= budget || diskcache_evict(size)))
+	{
+		fd = entry->fd;
+		used += size;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (fd < 0)
+		return;
+
+	if (pwrite(fd, buffer, size, offset) != (ssize_t)size || !checked)
+		return;
+
+	readback = malloc(size);
+	if (readback == 0)
+		return;
+	if (pread(fd, readback, size, offset) == (ssize_t)size && memcmp(readback, buffer, size) == 0)
+		diskcache_set_verified(image, offset);
+	free(readback);
+}
+
+// Reports whether every block under [offset, offset+size) is on disk and
+// verified, so the range can be handed to the kernel straight from fd.
+int diskcache_locate(u64 image, u64 offset, u64 size, int* fd)
+{
+	u64 block, last;
+	int found = 0;
+	u32 i;
+
+	if (size == 0)
+		return 0;
+
+	pthread_mutex_lock(&lock);
+	for(i=0; i<imagecount; i++)
+	{
+		if (images[i].image != image)
+			continue;
+
+		found = 1;
+		last = (offset + size - 1) / BLOCKCACHE_BLOCKSIZE;
+		for(block = offset / BLOCKCACHE_BLOCKSIZE; block <= last && found; block++)
+			found = diskcache_test_verified(&images[i], block);
+		*fd = images[i].fd;
+		break;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return found;
+}
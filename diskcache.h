@@ -0,0 +1,24 @@
+#ifndef _DISKCACHE_H_
+#define _DISKCACHE_H_
+
+#include "types.h"
+
+#define DISKCACHE_MAX_IMAGES		16		// open cache files per mount
+#define DISKCACHE_DEFAULT_SIZE		(4ull * 1024 * 1024 * 1024)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int  diskcache_init(const char* dir, u64 budget);
+int  diskcache_enabled(void);
+int  diskcache_get(u64 image, u64 offset, u8* buffer, u32 size, int* verified);
+void diskcache_put(u64 image, u64 offset, const u8* buffer, u32 size, int checked);
+void diskcache_set_verified(u64 image, u64 offset);
+int  diskcache_locate(u64 image, u64 offset, u64 size, int* fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DISKCACHE_H_
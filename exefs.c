@@ -5,6 +5,8 @@
 #include "types.h"
 #include "exefs.h"
 #include "utils.h"
+#include "log.h"
+#include "trace.h"
 #include "ncch.h"
 #include "lzss.h"
 
@@ -18,12 +20,17 @@ void exefs_set_file(exefs_context* ctx, FILE* file)
 	ctx->file = file;
 }
 
-void exefs_set_offset(exefs_context* ctx, u32 offset)
+void exefs_set_reader(exefs_context* ctx, reader_context* reader)
+{
+	ctx->reader = reader;
+}
+
+void exefs_set_offset(exefs_context* ctx, u64 offset)
 {
 	ctx->offset = offset;
 }
 
-void exefs_set_size(exefs_context* ctx, u32 size)
+void exefs_set_size(exefs_context* ctx, u64 size)
 {
 	ctx->size = size;
 }
@@ -33,7 +40,7 @@ void exefs_set_usersettings(exefs_context* ctx, settings* usersettings)
 	ctx->usersettings = usersettings;
 }
 
-void exefs_set_partitionid(exefs_context* ctx, u8 partitionid[8])
+void exefs_set_partitionid(exefs_context* ctx, const u8 partitionid[8])
 {
 	memcpy(ctx->partitionid, partitionid, 8);
 }
@@ -53,6 +60,11 @@ void exefs_set_key(exefs_context* ctx, u8 key[16])
 	memcpy(ctx->key, key, 16);
 }
 
+void exefs_set_imageid(exefs_context* ctx, u64 imageid)
+{
+	ctx->imageid = imageid;
+}
+
 void exefs_set_counter(exefs_context* ctx, u8 counter[16])
 {
 	memcpy(ctx->counter, counter, 16);
@@ -76,6 +88,7 @@ void exefs_determine_key(exefs_context* ctx, u32 actions)
 
 ssize_t exefs_read(exefs_context* ctx, u32 index, u32 flags, char* buf, off_t bufoffset, size_t bufsize)
 {
+	TRACE_SPAN("exefs_read");
 	exefs_sectionheader* section = (exefs_sectionheader*)(ctx->header.section + index);
 	char name[64];
 	u32 offset;
@@ -97,44 +110,37 @@ ssize_t exefs_read(exefs_context* ctx, u32 index, u32 flags, char* buf, off_t bu
 
 	if (size >= ctx->size)
 	{
-		fprintf(stderr, "Error, ExeFS section %d size invalid\n", index);
+		log_error("Error, ExeFS section %d size invalid", index);
 		return 0;
 	}
 
 	memset(name, 0, sizeof(name));
 	memcpy(name, section->name, 8);
 
-	fseek(ctx->file, ctx->offset + offset, SEEK_SET);
-	ctr_init_counter(&ctx->aes, ctx->key, ctx->counter);
-	ctr_add_counter(&ctx->aes, offset / 0x10);
-
 	if (index == 0 && ctx->compressedflag && ((flags & RawFlag) == 0))
 	{
-		fprintf(stdout, "Decompressing section %s...\n", name);
+		log_debug("Decompressing section %s...", name);
 
 		compressedsize = size;
 		compressedbuffer = malloc(compressedsize);
 
 		if (compressedbuffer == 0)
 		{
-			fprintf(stdout, "Error allocating memory\n");
+			log_error("Error allocating memory");
 			goto clean;
 		}
-		if (compressedsize != fread(compressedbuffer, 1, compressedsize, ctx->file))
+		if (!region_read(&ctx->region, offset, compressedbuffer, compressedsize))
 		{
-			fprintf(stdout, "Error reading input file\n");
+			log_error("Error reading input file");
 			goto clean;
 		}
 
-		if (ctx->encrypted)
-			ctr_crypt_counter(&ctx->aes, compressedbuffer, compressedbuffer, compressedsize);
-
 
 		decompressedsize = lzss_get_decompressed_size(compressedbuffer, compressedsize);
 		decompressedbuffer = malloc(decompressedsize);
 		if (decompressedbuffer == 0)
 		{
-			fprintf(stdout, "Error allocating memory\n");
+			log_error("Error allocating memory");
 			goto clean;
 		}
 
@@ -144,31 +150,25 @@ ssize_t exefs_read(exefs_context* ctx, u32 index, u32 flags, char* buf, off_t bu
 		/*
 		if (decompressedsize != fwrite(decompressedbuffer, 1, decompressedsize, fout))
 		{
-			fprintf(stdout, "Error writing output file\n");
+			log_error("Error writing output file");
 			goto clean;
 		}
 		*/
 	}
 	else
 	{
-		fprintf(stdout, "Saving section %s...\n", name);
+		log_debug("Saving section %s...", name);
 
-		fseek(ctx->file, bufoffset, SEEK_CUR);
-		ctr_add_counter(&ctx->aes, bufoffset / 0x10);
-		// XXX counter not correct if bufoffset not block-aligned
 		size -= bufoffset;
 		if (size > bufsize) {
 			size = bufsize;
 		}
 
-		if (size != fread(buf, 1, size, ctx->file)) {
-			fprintf(stdout, "Error reading input file\n");
+		if (!region_read(&ctx->region, offset + bufoffset, buf, size)) {
+			log_error("Error reading input file");
 			goto clean;
 		}
 
-		if (ctx->encrypted)
-			ctr_crypt_counter(&ctx->aes, (u8*)buf, (u8*)buf, size);
-
 		return size;
 	}
 
@@ -180,13 +180,13 @@ clean:
 
 void exefs_read_header(exefs_context* ctx, u32 flags)
 {
-	fseek(ctx->file, ctx->offset, SEEK_SET);
-	fread(&ctx->header, 1, sizeof(exefs_header), ctx->file);
-
-	ctr_init_counter(&ctx->aes, ctx->key, ctx->counter);
+	region_init(&ctx->region, ctx->file, ctx->offset, ctx->size);
+	region_set_reader(&ctx->region, ctx->reader);
+	region_set_crypto(&ctx->region, ctx->key, ctx->counter, ctx->encrypted);
+	if (ctx->imageid)
+		region_set_image(&ctx->region, ctx->imageid);
 
-	if (ctx->encrypted)
-		ctr_crypt_counter(&ctx->aes, (u8*)&ctx->header, (u8*)&ctx->header, sizeof(exefs_header));
+	region_read(&ctx->region, 0, &ctx->header, sizeof(exefs_header));
 }
 
 void exefs_calculate_hash(exefs_context* ctx, u8 hash[32])
@@ -242,7 +242,7 @@ int exefs_verify(exefs_context* ctx, u32 index, u32 flags)
 	if (size == 0)
 		return 0;
 
-	fseek(ctx->file, ctx->offset + offset, SEEK_SET);
+	fseeko(ctx->file, ctx->offset + offset, SEEK_SET);
 	ctr_init_counter(&ctx->aes, ctx->key, ctx->counter);
 	ctr_add_counter(&ctx->aes, offset / 0x10);
 
@@ -256,7 +256,7 @@ int exefs_verify(exefs_context* ctx, u32 index, u32 flags)
 
 		if (max != fread(buffer, 1, max, ctx->file))
 		{
-			fprintf(stdout, "Error reading input file\n");
+			log_error("Error reading input file");
 			goto clean;
 		}
 
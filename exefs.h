@@ -6,6 +6,7 @@
 #include "ctr.h"
 #include "filepath.h"
 #include "settings.h"
+#include "region.h"
 
 
 typedef struct
@@ -26,12 +27,15 @@ typedef struct
 typedef struct
 {
 	FILE* file;
+	reader_context* reader;
 	settings* usersettings;
 	u8 partitionid[8];
 	u8 counter[16];
 	u8 key[16];
-	u32 offset;
-	u32 size;
+	u64 imageid;
+	u64 offset;
+	u64 size;
+	region_context region;
 	exefs_header header;
 	ctr_aes_context aes;
 	ctr_sha256_context sha;
@@ -42,13 +46,15 @@ typedef struct
 
 void exefs_init(exefs_context* ctx);
 void exefs_set_file(exefs_context* ctx, FILE* file);
-void exefs_set_offset(exefs_context* ctx, u32 offset);
-void exefs_set_size(exefs_context* ctx, u32 size);
+void exefs_set_reader(exefs_context* ctx, reader_context* reader);
+void exefs_set_offset(exefs_context* ctx, u64 offset);
+void exefs_set_size(exefs_context* ctx, u64 size);
 void exefs_set_usersettings(exefs_context* ctx, settings* usersettings);
-void exefs_set_partitionid(exefs_context* ctx, u8 partitionid[8]);
+void exefs_set_partitionid(exefs_context* ctx, const u8 partitionid[8]);
 void exefs_set_counter(exefs_context* ctx, u8 counter[16]);
 void exefs_set_compressedflag(exefs_context* ctx, int compressedflag);
 void exefs_set_key(exefs_context* ctx, u8 key[16]);
+void exefs_set_imageid(exefs_context* ctx, u64 imageid);
 void exefs_set_encrypted(exefs_context* ctx, u32 encrypted);
 void exefs_read_header(exefs_context* ctx, u32 flags);
 void exefs_calculate_hash(exefs_context* ctx, u8 hash[32]);
@@ -4,7 +4,9 @@
 #include "types.h"
 #include "exheader.h"
 #include "utils.h"
+#include "log.h"
 #include "ncch.h"
+#include "region.h"
 
 void exheader_init(exheader_context* ctx)
 {
@@ -16,12 +18,17 @@ void exheader_set_file(exheader_context* ctx, FILE* file)
 	ctx->file = file;
 }
 
-void exheader_set_offset(exheader_context* ctx, u32 offset)
+void exheader_set_reader(exheader_context* ctx, reader_context* reader)
+{
+	ctx->reader = reader;
+}
+
+void exheader_set_offset(exheader_context* ctx, u64 offset)
 {
 	ctx->offset = offset;
 }
 
-void exheader_set_size(exheader_context* ctx, u32 size)
+void exheader_set_size(exheader_context* ctx, u64 size)
 {
 	ctx->size = size;
 }
@@ -31,12 +38,12 @@ void exheader_set_usersettings(exheader_context* ctx, settings* usersettings)
 	ctx->usersettings = usersettings;
 }
 
-void exheader_set_partitionid(exheader_context* ctx, u8 partitionid[8])
+void exheader_set_partitionid(exheader_context* ctx, const u8 partitionid[8])
 {
 	memcpy(ctx->partitionid, partitionid, 8);
 }
 
-void exheader_set_programid(exheader_context* ctx, u8 programid[8])
+void exheader_set_programid(exheader_context* ctx, const u8 programid[8])
 {
 	memcpy(ctx->programid, programid, 8);
 }
@@ -61,6 +68,11 @@ void exheader_set_key(exheader_context* ctx, u8 key[16])
 	memcpy(ctx->key, key, 16);
 }
 
+void exheader_set_imageid(exheader_context* ctx, u64 imageid)
+{
+	ctx->imageid = imageid;
+}
+
 
 void exheader_determine_key(exheader_context* ctx, u32 actions)
 {
@@ -82,12 +94,14 @@ void exheader_read(exheader_context* ctx, u32 actions)
 {
 	if (ctx->haveread == 0)
 	{
-		fseek(ctx->file, ctx->offset, SEEK_SET);
-		fread(&ctx->header, 1, sizeof(exheader_header), ctx->file);
+		region_context region;
 
-		ctr_init_counter(&ctx->aes, ctx->key, ctx->counter);
-		if (ctx->encrypted)
-			ctr_crypt_counter(&ctx->aes, (u8*)&ctx->header, (u8*)&ctx->header, sizeof(exheader_header));
+		region_init(&region, ctx->file, ctx->offset, sizeof(exheader_header));
+		region_set_reader(&region, ctx->reader);
+		region_set_crypto(&region, ctx->key, ctx->counter, ctx->encrypted);
+		if (ctx->imageid)
+			region_set_image(&region, ctx->imageid);
+		region_read(&region, 0, &ctx->header, sizeof(exheader_header));
 
 		ctx->haveread = 1;
 	}
@@ -99,9 +113,8 @@ int exheader_programid_valid(exheader_context* ctx)
 	{
 		if (memcmp(ctx->header.arm11systemlocalcaps.programid, ctx->programid, 8))
 		{
-			fprintf(stderr, "Error, program id mismatch. Wrong key?\n");
-			memdump(stderr, "ctx programid:    ", ctx->programid, 8);
-			memdump(stderr, "header programid: ", ctx->header.arm11systemlocalcaps.programid, 8);
+			log_error("Error, program id mismatch (ctx %016llx, header %016llx). Wrong key?",
+				getle64(ctx->programid), getle64(ctx->header.arm11systemlocalcaps.programid));
 			return 0;
 		}
 	}
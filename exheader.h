@@ -5,6 +5,7 @@
 #include "types.h"
 #include "ctr.h"
 #include "settings.h"
+#include "reader.h"
 
 typedef struct
 {
@@ -104,13 +105,15 @@ typedef struct
 {
 	int haveread;
 	FILE* file;
+	reader_context* reader;
 	settings* usersettings;
 	u8 partitionid[8];
 	u8 programid[8];
 	u8 counter[16];
 	u8 key[16];
-	u32 offset;
-	u32 size;
+	u64 imageid;
+	u64 offset;
+	u64 size;
 	exheader_header header;
 	ctr_aes_context aes;
 	ctr_rsa_context rsa;
@@ -124,13 +127,15 @@ typedef struct
 
 void exheader_init(exheader_context* ctx);
 void exheader_set_file(exheader_context* ctx, FILE* file);
-void exheader_set_offset(exheader_context* ctx, u32 offset);
-void exheader_set_size(exheader_context* ctx, u32 size);
-void exheader_set_partitionid(exheader_context* ctx, u8 partitionid[8]);
+void exheader_set_reader(exheader_context* ctx, reader_context* reader);
+void exheader_set_offset(exheader_context* ctx, u64 offset);
+void exheader_set_size(exheader_context* ctx, u64 size);
+void exheader_set_partitionid(exheader_context* ctx, const u8 partitionid[8]);
 void exheader_set_counter(exheader_context* ctx, u8 counter[16]);
-void exheader_set_programid(exheader_context* ctx, u8 programid[8]);
+void exheader_set_programid(exheader_context* ctx, const u8 programid[8]);
 void exheader_set_encrypted(exheader_context* ctx, u32 encrypted);
 void exheader_set_key(exheader_context* ctx, u8 key[16]);
+void exheader_set_imageid(exheader_context* ctx, u64 imageid);
 void exheader_set_usersettings(exheader_context* ctx, settings* usersettings);
 int exheader_get_compressedflag(exheader_context* ctx);
 void exheader_read(exheader_context* ctx, u32 actions);
@@ -6,14 +6,42 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
 
+// make FUSE=3 builds against libfuse3
+#ifdef CTRFUSE_FUSE3
+#define FUSE_USE_VERSION 31
+#else
 #define FUSE_USE_VERSION 26
+#endif
 #include <fuse.h>
 
+// plus says st is complete and may go to the kernel as a readdirplus entry
+#ifdef CTRFUSE_FUSE3
+#define ctrfuse_fill(filler, buf, name, st, off, plus) filler(buf, name, st, off, (plus) ? FUSE_FILL_DIR_PLUS : 0)
+#else
+#define ctrfuse_fill(filler, buf, name, st, off, plus) ((void)(plus), filler(buf, name, st, off))
+#endif
+
 #include "ncsd.h"
 #include "exefs.h"
 #include "romfs.h"
 #include "utf16.h"
+#include "stats.h"
+#include "log.h"
+#include "trace.h"
+#include "blockcache.h"
+#include "shmcache.h"
+#include "diskcache.h"
+#include "prefetch.h"
+#include "iosched.h"
+#include "verify.h"
+#include "mem.h"
+#include "search.h"
+#include "decrypt.h"
+#include "tar.h"
 
 enum {
 	Root,
@@ -22,12 +50,20 @@ enum {
 	ExefsSection,
 	RomfsDir,
 	RomfsFile,
+	VirtualDir,
+	Dynamic,
+	SearchDir,
+	SearchResult,
+	Symlink,
+	Decrypted,
+	RomfsTar,
 };
 
 struct node {
 	int type;
 	void* ctx;
 	char* name;
+	ino_t ino;
 
 	struct node* next;
 	struct node* child;
@@ -39,35 +75,198 @@ struct node {
 	int diroffset;
 	int fileoffset;
 
-	// for virtual files
+	// set once lazily built children or data may be read
+	int populated;
+
+	// handles open on the node; an evicted subtree is only freed at zero
+	u32 opens;
+	// eviction pass during which a RomFS directory was last looked up
+	u64 used;
+	// set by the evictor on nodes it has cut loose
+	int detached;
+
+	// sha256 of a RomFS file, filled in the first time it is asked for
+	u8 hash[32];
+	int hashed;
+
+	// for virtual files, and the target of a symlink
 	char* data;
 	off_t size;
+
+	// for decrypted files, ctx is the decrypt_context
+
+	// info text, built on first use and dropped under memory pressure
+	struct blob* blob;
+
+	// layout of romfs.tar, the same; size keeps the archive size once known
+	tar_map* tar;
+
+	// for dynamic files, regenerated on every open
+	void (*print)(void* ctx, FILE* fp);
 };
 
 struct context {
 	ncsd_context ncsd;
 	time_t mtime;
 	struct node* root;
+	struct node* info;
+	struct node* tar;
+	struct node* search;
+	int fd;				// image file, for posix_fadvise
+	int direct;			// data reads bypass the page cache
+	reader_context reader;
+	u64 readahead;		// largest read-ahead window, 0 for none
+	int verify;			// check the whole image in the background
+	u64 started;		// stats_now() at startup
+};
+
+// text generated on demand, published and dropped as a single pointer
+struct blob {
+	size_t size;
+	char data[];
+};
+
+// readdir cursor, kept in fi->fh between opendir and releasedir.
+// pos is the offset cookie of the next entry to emit: 0 is ".", 1 is ".."
+// and 2+i is the i'th child. node and next are pinned while referenced.
+struct dirhandle {
+	struct node* node;
+	struct node* next;
+	off_t pos;
+};
+
+// open file, kept in fi->fh between open and release.
+// data holds the snapshot of a Dynamic node.
+// next, run and ahead track sequential reading of a RomFS file: the offset
+// a sequential reader asks for next, how many reads in a row did so, and
+// how far read-ahead has already been queued.
+struct filehandle {
+	struct node* node;
+	char* data;
+	size_t size;
+
+	pthread_mutex_t lock;
+	off_t next;
+	u32 run;
+	off_t ahead;
+};
+
+// reads in a row that make a handle sequential
+#define READAHEAD_MIN_RUN 2
+
+// bytes hashed per read when computing user.ctr.sha256
+#define XATTR_HASH_CHUNK (256 * 1024)
+
+// unit statfs reports sizes in
+#define STATFS_BLOCK_SIZE 4096
+
+// Where a file's bytes lie in the image, or what a directory holds, as
+// reported through xattrs.
+struct layout {
+	int isfile;
+	u64 offset;			// absolute offset in the image file
+	u64 size;
+	int encrypted;
+	region_context* region;	// RomFS region and offset within it, for hashing
+	u64 regionoffset;
+	int hasblocks;		// RomFS files: IVFC level 3 blocks holding the data
+	u64 firstblock;
+	u64 lastblock;
+	int hashed;
+	u8 hash[32];
+	int hastotals;		// RomFS directories: everything below, recursively
+	romfs_dirtotal total;
+};
+
+enum {
+	XATTR_SHA256,
+	XATTR_OFFSET,
+	XATTR_ENCRYPTED,
+	XATTR_BLOCKS,
+	XATTR_TOTAL_BYTES,
+	XATTR_TOTAL_FILES,
+	XATTR_TOTAL_DIRS,
+	XATTR_COUNT
+};
+
+static const char* xattrnames[XATTR_COUNT] = {
+	"user.ctr.sha256",
+	"user.ctr.offset",
+	"user.ctr.encrypted",
+	"user.ctr.blocks",
+	"user.ctr.total_bytes",
+	"user.ctr.total_files",
+	"user.ctr.total_dirs",
 };
 
 const char* strip_prefix(const char* path);
 int path_has_prefix(const char* path, const char* name);
+void ctrfuse_populate(struct context* ctx, struct node* node);
+struct node* ctrfuse_children(struct context* ctx, struct node* node);
 void ctrfuse_init_romfs(struct node* node);
+void ctrfuse_init_search(struct node* node);
+struct node* ctrfuse_new_search(struct node* dir, const char* path);
 struct node* newnode(int type, const char* name);
 
+static size_t nodesize(struct node* node) {
+	return sizeof(struct node) + strlen(node->name) + 1;
+}
+
 struct node* newnode(int type, const char* name) {
+	static ino_t lastino = 0;
 	struct node* node = malloc(sizeof(struct node));
 	memset(node, 0, sizeof(struct node));
 	node->type = type;
 	node->name = strdup(name);
+	node->ino = __atomic_add_fetch(&lastino, 1, __ATOMIC_RELAXED);
+	stats_add(STATS_NODES, 1);
+	mem_charge(nodesize(node));
 	return node;
 }
 
+// Frees a list of siblings and everything below them, returning the bytes
+// given back.
+static u64 freenodes(struct node* node) {
+	u64 freed = 0;
+	struct node* next;
+
+	for (; node != NULL; node = next) {
+		next = node->next;
+		freed += freenodes(node->child) + nodesize(node);
+		if (node->data != NULL) {
+			freed += strlen(node->data) + 1;
+		}
+		stats_add(STATS_NODES, -1);
+		free(node->data);
+		free(node->name);
+		free(node);
+	}
+	return freed;
+}
+
+static void pin(struct node* node) {
+	if (node != NULL) {
+		__atomic_add_fetch(&node->opens, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void unpin(struct node* node) {
+	if (node != NULL) {
+		__atomic_sub_fetch(&node->opens, 1, __ATOMIC_RELEASE);
+	}
+}
+
 
-struct node* lookup(struct context* ctx, const char* path) {
+// Finds the node at path. A search under /.search that hasn't been opened
+// is built privately and returned in transient; the caller frees it with
+// ctrfuse_drop once done with anything under it, or keeps it with
+// ctrfuse_keep_search.
+struct node* lookup(struct context* ctx, const char* path, struct node** transient) {
+	TRACE_SPAN("lookup");
 	struct node* node = ctx->root;
 	struct node* x;
 
+	*transient = NULL;
 	if (strcmp(path, "") == 0 || path[0] != '/') {
 		return NULL;
 	}
@@ -78,26 +277,38 @@ struct node* lookup(struct context* ctx, const char* path) {
 
 	while (node != NULL && path[0] != '\0') {
 		//fprintf(stderr, "lookup %s\n", path);
-		if (node->type == RomfsDir) {
-			ctrfuse_init_romfs(node);
-		}
-		for (x = node->child; x != NULL; x = x->next) {
+		for (x = ctrfuse_children(ctx, node); x != NULL; x = x->next) {
 			//fprintf(stderr, "lookup %s: visiting %s\n", path, x->name);
 			if (path_has_prefix(path, x->name)) {
 				//fprintf(stderr, "lookup %s: found %s\n", path, x->name);
-				path = strip_prefix(path);
 				break;
 			}
 		}
+		if (x == NULL && node->type == SearchDir) {
+			x = ctrfuse_new_search(node, path);
+			*transient = x;
+		}
+		if (x != NULL) {
+			path = strip_prefix(path);
+		}
 		node = x;
 	}
 
-	if (node && node->type == RomfsDir) {
-		ctrfuse_init_romfs(node);
+	// A search is only run once something lists or looks inside it.
+	if (node && node != *transient) {
+		ctrfuse_populate(ctx, node);
 	}
 	return node;
 }
 
+// Frees a search built by lookup that nobody kept. It was never visible
+// to anyone else, so there is no need to wait for readers.
+static void ctrfuse_drop(struct node* transient) {
+	if (transient != NULL) {
+		mem_charge(-(s64)freenodes(transient));
+	}
+}
+
 const char* strip_prefix(const char* path) {
 	if (*path == '/') {
 		path++;
@@ -124,21 +335,83 @@ int path_has_prefix(const char* path, const char* name) {
 	return (path[i] == '\0' || path[i] == '/') && name[i] == '\0';
 }
 
-void ctrfuse_init_info(struct node* node)
+// Lazily filled nodes are built without a lock and published under
+// populatelock by release stores to child and populated, so reading the
+// RomFS tables never holds up lookups elsewhere. A node that is already
+// filled, the common case, costs one acquire load and no lock.
+static pthread_mutex_t populatelock = PTHREAD_MUTEX_INITIALIZER;
+
+// The info text and the romfs.tar layout each have their own lock, held
+// while they are built so that only one thread builds them.
+static pthread_mutex_t infolock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t tarlock = PTHREAD_MUTEX_INITIALIZER;
+
+// bumped by every eviction pass; directories remember the last one they
+// were looked up in, which orders them from cold to hot
+static u64 evictpass;
+
+static int ctrfuse_populated(struct node* node)
+{
+	return __atomic_load_n(&node->populated, __ATOMIC_ACQUIRE);
+}
+
+// Returns 1 if node still has to be filled. The caller builds the children
+// privately and hands them to ctrfuse_populate_end.
+static int ctrfuse_populate_begin(struct node* node)
+{
+	return !ctrfuse_populated(node);
+}
+
+// Publishes children as node's. Threads that filled the same node at once
+// all get here; the first one's list is kept and the others are freed.
+static void ctrfuse_populate_end(struct node* node, struct node* children)
+{
+	pthread_mutex_lock(&populatelock);
+	if (node->populated) {
+		pthread_mutex_unlock(&populatelock);
+		mem_charge(-(s64)freenodes(children));
+		return;
+	}
+	__atomic_store_n(&node->child, children, __ATOMIC_RELEASE);
+	__atomic_store_n(&node->populated, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&populatelock);
+}
+
+// Publishes node as having no children, for a directory whose contents
+// could not be loaded. The failure is for good, so it is never retried.
+static void ctrfuse_populate_empty(struct node* node)
+{
+	if (ctrfuse_populate_begin(node)) {
+		ctrfuse_populate_end(node, NULL);
+	}
+}
+
+// Returns the info text, rendering it if it isn't there. The text may be
+// evicted, so it is only good until the caller's read section ends.
+struct blob* ctrfuse_init_info(struct node* node)
 {
+	struct blob* blob = __atomic_load_n(&node->blob, __ATOMIC_ACQUIRE);
 	char *buf = NULL;
 	size_t size = 0;
 	FILE *stream;
 
-	if (node->type != Info || node->data != NULL) {
-		return;
+	if (blob != NULL || node->type != Info) {
+		return blob;
+	}
+
+	pthread_mutex_lock(&infolock);
+	blob = node->blob;
+	if (blob != NULL) {
+		pthread_mutex_unlock(&infolock);
+		return blob;
 	}
 
 	stream = open_memstream(&buf, &size);
 	if (stream == NULL) {
 		perror("open_memstream");
 		//return -errno;
-		return;
+		pthread_mutex_unlock(&infolock);
+		return NULL;
 	}
 
 	ncsd_print((ncsd_context*)node->ctx, stream);
@@ -146,35 +419,100 @@ void ctrfuse_init_info(struct node* node)
 	if (fclose(stream) < 0) {
 		perror("fclose");
 		//return -errno;
-		return;
+		free(buf);
+		pthread_mutex_unlock(&infolock);
+		return NULL;
+	}
+
+	blob = malloc(sizeof(struct blob) + size);
+	if (blob != NULL) {
+		blob->size = size;
+		memcpy(blob->data, buf, size);
+		mem_charge(sizeof(struct blob) + size);
+		__atomic_store_n(&node->blob, blob, __ATOMIC_RELEASE);
+	}
+	free(buf);
+	pthread_mutex_unlock(&infolock);
+	return blob;
+}
+
+// Returns the layout of romfs.tar, working it out if it isn't there, and
+// records the archive size. Like the info text it may be evicted, so it is
+// only good until the caller's read section ends.
+tar_map* ctrfuse_init_tar(struct node* node)
+{
+	struct context* ctx = fuse_get_context()->private_data;
+	tar_map* map = __atomic_load_n(&node->tar, __ATOMIC_ACQUIRE);
+
+	if (map != NULL || node->type != RomfsTar) {
+		return map;
+	}
+	if (!ncch_load(&ctx->ncsd.ncch, NCCHTYPE_ROMFS)) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&tarlock);
+	map = node->tar;
+	if (map == NULL) {
+		map = malloc(sizeof(tar_map));
+		if (map != NULL && tar_build(map, node->ctx, "romfs", ctx->mtime)) {
+			mem_charge(tar_memory(map));
+			__atomic_store_n(&node->size, map->size, __ATOMIC_RELAXED);
+			__atomic_store_n(&node->tar, map, __ATOMIC_RELEASE);
+		} else {
+			free(map);
+			map = NULL;
+		}
 	}
+	pthread_mutex_unlock(&tarlock);
+	return map;
+}
 
-	node->data = buf;
-	node->size = size;
+int ctrfuse_snapshot(struct node* node, char** data, size_t* size)
+{
+	FILE* stream = open_memstream(data, size);
+	if (stream == NULL) {
+		return -errno;
+	}
+	node->print(node->ctx, stream);
+	if (fclose(stream) < 0) {
+		return -errno;
+	}
+	return 0;
 }
 
 void ctrfuse_init_romfs(struct node* node) {
+	TRACE_SPAN("ctrfuse_init_romfs");
 	romfs_context* ctx = node->ctx;
-	if (node->type != RomfsDir || node->child != NULL) {
+	struct node* children = NULL;
+	struct node** tail = &children;
+	if (node->type != RomfsDir) {
+		return;
+	}
+	if (!ctrfuse_populate_begin(node)) {
+		stats_add(STATS_DIRCACHE_HITS, 1);
 		return;
 	}
+	stats_add(STATS_DIRCACHE_MISSES, 1);
 
-	fprintf(stderr, "initing %d\n", node->diroffset);
+	log_debug("initing %d", node->diroffset);
 
+	// Children are linked up privately and only become visible with the
+	// publish at the end.
 	int diroffset = node->diroffset;
 	romfs_direntry entry;
 	if (!romfs_dirblock_readentry(ctx, diroffset, &entry)) {
-		fprintf(stderr, "error reading direntry %d\n", diroffset);
+		log_error("error reading direntry %d", diroffset);
+		ctrfuse_populate_end(node, NULL);
 		return;
 	}
 
 	diroffset = getle32(entry.childoffset);
-	struct node** tail = &node->child;
 	while (diroffset != (u32)~0) {
 		struct node* node;
 		romfs_direntry entry;
 		if (!romfs_dirblock_readentry(ctx, diroffset, &entry)) {
-			fprintf(stderr, "error reading direntry %d\n", diroffset);
+			log_error("error reading direntry %d", diroffset);
 			break;
 		}
 		char* name = utf16to8(entry.name, getle32(entry.namesize));
@@ -193,7 +531,7 @@ void ctrfuse_init_romfs(struct node* node) {
 		struct node* node;
 
 		if (!romfs_fileblock_readentry(ctx, fileoffset, &entry)) {
-			fprintf(stderr, "error reading fileentry %d\n", fileoffset);
+			log_error("error reading fileentry %d", fileoffset);
 			break;
 		}
 
@@ -207,179 +545,1700 @@ void ctrfuse_init_romfs(struct node* node) {
 		tail = &node->next;
 		fileoffset = getle32(entry.siblingoffset);
 	}
+
+	ctrfuse_populate_end(node, children);
 }
 
-int ctrfuse_getattr(const char *path, struct stat *stbuf)
-{
-	struct context* ctx = fuse_get_context()->private_data;
-	if (strcmp(path, "/") == 0 || strcmp(path, "/romfs") == 0 || strcmp(path, "/exefs") == 0) {
-		stbuf->st_nlink = 2;
-		stbuf->st_mode = S_IFDIR | 0555;
-	} else {
-		struct node* node = lookup(ctx, path);
-		if (node == NULL) {
-			return -ENOENT;
-		}
-		if (node->type == Info) {
-			ctrfuse_init_info(node);
-		}
-		stbuf->st_nlink = 1;
-		stbuf->st_mode = S_IFREG | 0444;
-		stbuf->st_size = node->size;
-		if (node->type == RomfsDir) {
-			stbuf->st_mode = S_IFDIR | 0555;
+void ctrfuse_init_exefs(struct node* node) {
+	ncch_context* ncch = node->ctx;
+	exefs_context* exefs = &ncch->exefs;
+	struct node* children = NULL;
+	struct node** tail = &children;
+	int i;
+
+	if (!ctrfuse_populate_begin(node)) {
+		return;
+	}
+	if (!ncch_load(ncch, NCCHTYPE_EXEFS)) {
+		ctrfuse_populate_end(node, NULL);
+		return;
+	}
+
+	for (i = 0; i < 8; i++) {
+		if (getle32(exefs->header.section[i].size)) {
+			char name[sizeof exefs->header.section[i].name + 5];
+			memset(name, 0, sizeof name);
+			strncpy(name, (char*)exefs->header.section[i].name, sizeof exefs->header.section[i].name);
+			strcat(name, ".bin");
+
+			struct node* child = newnode(ExefsSection, name[0] == '.' ? name+1 : name);
+			child->ctx = exefs;
+			child->size = getle32(exefs->header.section[i].size);
+			child->section = i;
+			*tail = child;
+			tail = &child->next;
 		}
 	}
-	return 0;
+
+	ctrfuse_populate_end(node, children);
 }
 
-int ctrfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
-{
-	struct context* ctx = fuse_get_context()->private_data;
+// Searches are numbered by their pattern, so one built again after being
+// dropped keeps its inode number.
+static ino_t ctrfuse_search_ino(const char* pattern) {
+	u64 hash = 0xcbf29ce484222325ULL;
 
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-	if (strcmp(path, "/") == 0) {
-		filler(buf, "info", NULL, 0);
-		filler(buf, "exefs", NULL, 0);
-		filler(buf, "romfs", NULL, 0);
-		return 0;
-	} else {
-		struct node* node;
-		struct node* x;
+	for (; *pattern != '\0'; pattern++) {
+		hash = (hash ^ (u8)*pattern) * 0x100000001b3ULL;
+	}
+	return (ino_t)(hash | (1ULL << 63));
+}
 
-		node = lookup(ctx, path);
-		if (node == NULL) {
-			return -ENOENT;
-		}
+// Builds the search named by the first component of path, not yet linked
+// into dir. Its listing is only built once something looks inside.
+struct node* ctrfuse_new_search(struct node* dir, const char* path) {
+	struct node* node;
+	char* pattern;
+	size_t len;
 
-		for (x = node->child; x != NULL; x = x->next) {
-			filler(buf, x->name, NULL, 0);
-		}
-		return 0;
+	if (*path == '/') {
+		path++;
+	}
+	len = strcspn(path, "/");
+	if (len == 0 || len > SEARCH_MAX_PATTERN) {
+		return NULL;
+	}
+	pattern = strndup(path, len);
+	if (pattern == NULL) {
+		return NULL;
 	}
-	return -ENOENT;
+	node = newnode(SearchResult, pattern);
+	node->ino = ctrfuse_search_ino(pattern);
+	node->ctx = dir->ctx;
+	free(pattern);
+	return node;
 }
 
-int ctrfuse_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
-{
-	struct context* ctx = fuse_get_context()->private_data;
+// Links a search from lookup into /.search, once it has been opened, and
+// returns it. If the same search was linked meanwhile, that one is
+// returned and the caller still owns, and must drop, its own.
+static struct node* ctrfuse_keep_search(struct context* ctx, struct node* search) {
+	struct node* dir = ctx->search;
+	struct node* node;
 
-	struct node* node = lookup(ctx, path);
+	pthread_mutex_lock(&populatelock);
+	for (node = dir->child; node != NULL; node = node->next) {
+		if (strcmp(node->name, search->name) == 0) {
+			break;
+		}
+	}
 	if (node == NULL) {
-		return -ENOENT;
+		node = search;
+		node->next = dir->child;
+		__atomic_store_n(&dir->child, node, __ATOMIC_RELEASE);
 	}
+	pthread_mutex_unlock(&populatelock);
+	return node;
+}
 
-	if (node->type == Info) {
-		ctrfuse_init_info(node);
-		if (0 <= offset &&  offset < node->size) { // XXX overflow
-			if (size > node->size - offset) {
-				size = node->size - offset;
-			}
-			memmove(buf, &node->data[offset], size);
-			return size;
+// where ctrfuse_search_found appends the links it makes
+struct searchfill {
+	romfs_context* romfs;
+	struct node** tail;
+};
+
+// Links a match into the search result. The link is named after the
+// file's path with / and % escaped, and points back into /romfs.
+static void ctrfuse_search_found(void* arg, u32 fileoffset) {
+	struct searchfill* fill = arg;
+	char* path = romfs_get_path(fill->romfs, fileoffset);
+	char* name;
+	char* target;
+	const char* p;
+	char* q;
+	struct node* node;
+
+	if (path == NULL) {
+		return;
+	}
+	name = malloc(strlen(path) * 3 + 1);
+	target = malloc(strlen(path) + sizeof "../../romfs/");
+	if (name == NULL || target == NULL) {
+		free(name);
+		free(target);
+		free(path);
+		return;
+	}
+	for (p = path, q = name; *p != '\0'; p++) {
+		if (*p == '/' || *p == '%') {
+			q += sprintf(q, "%%%02X", *p);
+		} else {
+			*q++ = *p;
 		}
-		return 0;
-	} else if (node->type == ExefsSection) {
-		exefs_context* exefsctx = &ctx->ncsd.ncch.exefs;
-		int section = node->section;
-		return exefs_read(exefsctx, section, RawFlag, buf, offset, size);
-	} else if (node->type == RomfsFile) {
-		romfs_context* romfsctx = node->ctx;
-		return romfs_read_file(romfsctx, node->fileoffset, buf, offset, size);
 	}
+	*q = '\0';
+	sprintf(target, "../../romfs/%s", path);
 
-	return 0; // ????
+	node = newnode(Symlink, name);
+	node->data = target;
+	mem_charge(strlen(target) + 1);
+	*fill->tail = node;
+	fill->tail = &node->next;
+	free(name);
+	free(path);
 }
 
-void make_nodes(struct context* ctx) {
-	struct node* infonode;
-	struct node* exefsnode;
-	struct node* romfsnode;
-	int i;
-	ctx->root = newnode(Root, "/");
+// Fills a /.search/PATTERN directory with a link to every RomFS file whose
+// name matches, from one scan of the RomFS file table.
+void ctrfuse_init_search(struct node* node) {
+	TRACE_SPAN("ctrfuse_init_search");
+	search_pattern pattern;
+	struct node* children = NULL;
+	struct searchfill fill = { node->ctx, &children };
 
-	infonode = newnode(Info, "info");
-	exefsnode = newnode(ExefsDir, "exefs");
-	romfsnode = newnode(RomfsDir, "romfs");
+	if (!ctrfuse_populate_begin(node)) {
+		return;
+	}
+	if (search_compile(&pattern, node->name)) {
+		romfs_search(node->ctx, &pattern, ctrfuse_search_found, &fill);
+	} else {
+		log_warn("bad search pattern %s", node->name);
+	}
+	ctrfuse_populate_end(node, children);
+}
 
-	ctx->root->child = infonode;
-	ctx->root->child->next = exefsnode;
-	ctx->root->child->next->next = romfsnode;
+// Fills in a directory's children on first visit. ExeFS and RomFS are only
+// parsed at that point, so mounting reads little more than the headers.
+static const char* partfiles[] = {
+	[NCCHTYPE_EXHEADER] = "exheader.bin",
+	[NCCHTYPE_EXEFS] = "exefs.bin",
+	[NCCHTYPE_ROMFS] = "romfs.bin",
+};
 
-	infonode->ctx = &ctx->ncsd;
+static struct node* ctrfuse_new_decrypted(const char* name, decrypt_context* dc) {
+	struct node* node = newnode(Decrypted, name);
+	node->ctx = dc;
+	node->size = decrypt_get_size(dc);
+	return node;
+}
 
-	exefs_context* exefs = &ctx->ncsd.ncch.exefs;
-	struct node** tail = &exefsnode->child;
-	for (i = 0; i < 8; i++) {
-		if (getle32(exefs->header.section[i].size)) {
-			char name[sizeof exefs->header.section[i].name + 5];
-			memset(name, 0, sizeof name);
-			strncpy(name, (char*)exefs->header.section[i].name, sizeof exefs->header.section[i].name);
-			strcat(name, ".bin");
+// Builds decrypted.3ds and partitionN/{exheader,exefs,romfs}.bin in front of
+// next: the image and its parts as plaintext, decrypted as they are read.
+// Only headers are looked at here. Anything encrypted with a key we don't
+// have is left out.
+struct node* ctrfuse_init_decrypted(struct context* ctx, struct node* next) {
+	struct node* head = next;
+	struct node* dir;
+	struct node* file;
+	ncch_context* ncch;
+	decrypt_context* dc;
+	char name[16];
+	int i, type;
 
-			struct node* node = newnode(ExefsSection, name[0] == '.' ? name+1 : name);
-			node->ctx = exefs;
-			node->size = getle32(exefs->header.section[i].size);
-			node->section = i;
-			*tail = node;
-			tail = &node->next;
+	for (i = 7; i >= 0; i--) {
+		ncch = ncsd_get_partition(&ctx->ncsd, i);
+		if (ncch == NULL) {
+			continue;
+		}
+		snprintf(name, sizeof name, "partition%d", i);
+		dir = newnode(VirtualDir, name);
+		for (type = NCCHTYPE_ROMFS; type >= NCCHTYPE_EXHEADER; type--) {
+			dc = malloc(sizeof(decrypt_context));
+			if (dc == NULL || !decrypt_open_ncch(dc, ncch, type)) {
+				free(dc);
+				continue;
+			}
+			file = ctrfuse_new_decrypted(partfiles[type], dc);
+			file->next = dir->child;
+			dir->child = file;
 		}
+		if (dir->child == NULL) {
+			mem_charge(-(s64)freenodes(dir));
+			continue;
+		}
+		dir->next = head;
+		head = dir;
 	}
 
-	romfsnode->diroffset = 0;
-	romfsnode->ctx = &ctx->ncsd.ncch.romfs;
+	dc = malloc(sizeof(decrypt_context));
+	if (dc != NULL && decrypt_open_ncsd(dc, &ctx->ncsd)) {
+		file = ctrfuse_new_decrypted("decrypted.3ds", dc);
+		file->next = head;
+		head = file;
+	} else {
+		free(dc);
+	}
+	return head;
 }
 
-struct fuse_operations fuse_ops =
-{
-	.getattr	= ctrfuse_getattr,
-	//.opendir	= ctrfuse_opendir,
-	.readdir	= ctrfuse_readdir,
-	//.open		= ctrfuse_open,
-	.read		= ctrfuse_read,
-};
+void ctrfuse_populate(struct context* ctx, struct node* node) {
+	switch (node->type) {
+	case ExefsDir:
+		ctrfuse_init_exefs(node);
+		break;
+	case RomfsDir:
+		if (ctrfuse_populated(node)) {
+			break;
+		}
+		if (ncch_load(&ctx->ncsd.ncch, NCCHTYPE_ROMFS)) {
+			ctrfuse_init_romfs(node);
+		} else {
+			ctrfuse_populate_empty(node);
+		}
+		break;
+	case SearchResult:
+		if (ctrfuse_populated(node)) {
+			break;
+		}
+		if (ncch_load(&ctx->ncsd.ncch, NCCHTYPE_ROMFS)) {
+			ctrfuse_init_search(node);
+		} else {
+			ctrfuse_populate_empty(node);
+		}
+		break;
+	}
+}
 
-int main(int argc, char **argv)
-{
-	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
-	int i, ret;
-	char *filename;
-	FILE *infile;
-	off_t infilesize;
-	struct context ctx;
+// Directories whose children can be dropped and built again.
+static int ctrfuse_evictable(struct node* node) {
+	return node->type == RomfsDir || node->type == SearchResult;
+}
 
-	if(argc < 3)
-	{
-		printf("Usage: %s file.nds mount_point [fuse_options]\n",argv[0]);
-		return 1;
+// Returns node's children, filling them in first. A directory whose
+// children were evicted reads as unpopulated and is simply filled again.
+struct node* ctrfuse_children(struct context* ctx, struct node* node) {
+	struct node* child;
+	u64 pass;
+
+	if (ctrfuse_evictable(node)) {
+		pass = __atomic_load_n(&evictpass, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&node->used, __ATOMIC_RELAXED) != pass) {
+			__atomic_store_n(&node->used, pass, __ATOMIC_RELAXED);
+		}
 	}
+	for (;;) {
+		ctrfuse_populate(ctx, node);
+		child = __atomic_load_n(&node->child, __ATOMIC_ACQUIRE);
+		if (child != NULL || !ctrfuse_evictable(node)) {
+			return child;
+		}
+		// Eviction clears populated before child, so an empty list with
+		// populated still set is a directory that really is empty.
+		if (ctrfuse_populated(node) && __atomic_load_n(&node->child, __ATOMIC_ACQUIRE) == NULL) {
+			return NULL;
+		}
+	}
+}
 
-	filename = argv[1];
+// Fills in node's attributes and returns 1 if they are complete. The sizes
+// of the info text and romfs.tar take work to find out; without build
+// they are left at 0 unless already known, and 0 is returned.
+int ctrfuse_fill_stat(struct node* node, struct stat *stbuf, int build)
+{
+	int complete = 1;
 
-	infile = fopen(filename, "rb");
-	if (infile == 0)
-	{
-		fprintf(stderr, "error: could not open input file!\n");
-		return -1;
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = node->ino;
+	switch (node->type) {
+	case Root:
+	case ExefsDir:
+	case RomfsDir:
+	case VirtualDir:
+	case SearchDir:
+	case SearchResult:
+		stbuf->st_nlink = 2;
+		stbuf->st_mode = S_IFDIR | 0555;
+		break;
+	case Symlink:
+		stbuf->st_nlink = 1;
+		stbuf->st_mode = S_IFLNK | 0444;
+		stbuf->st_size = strlen(node->data);
+		break;
+	case Info: {
+		struct blob* blob = build ? ctrfuse_init_info(node) : __atomic_load_n(&node->blob, __ATOMIC_ACQUIRE);
+		stbuf->st_nlink = 1;
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_size = blob != NULL ? blob->size : 0;
+		complete = blob != NULL;
+		break;
+	}
+	case RomfsTar:
+		// laid out on the first getattr; the size outlives the layout
+		stbuf->st_nlink = 1;
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_size = __atomic_load_n(&node->size, __ATOMIC_RELAXED);
+		if (stbuf->st_size == 0 && build && ctrfuse_init_tar(node) != NULL) {
+			stbuf->st_size = __atomic_load_n(&node->size, __ATOMIC_RELAXED);
+		}
+		complete = stbuf->st_size != 0;
+		break;
+	default:
+		stbuf->st_nlink = 1;
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_size = node->size;
+		break;
 	}
+	return complete;
+}
 
-	fseek(infile, 0, SEEK_END);
+#ifdef CTRFUSE_FUSE3
+int ctrfuse_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+#else
+int ctrfuse_getattr(const char *path, struct stat *stbuf)
+#endif
+{
+	TRACE_SPAN("fuse_getattr");
+	struct context* ctx = fuse_get_context()->private_data;
+	u64 start = stats_now();
+	int ret = -ENOENT;
+	int epoch = mem_read_begin();
+	struct node* transient;
+	struct node* node = lookup(ctx, path, &transient);
+	if (node != NULL) {
+		ctrfuse_fill_stat(node, stbuf, 1);
+		ret = 0;
+	}
+	mem_read_end(epoch);
+	ctrfuse_drop(transient);
+	stats_record(STATS_OP_GETATTR, start);
+	return ret;
+}
+
+int ctrfuse_opendir(const char *path, struct fuse_file_info *fi)
+{
+	TRACE_SPAN("fuse_opendir");
+	struct context* ctx = fuse_get_context()->private_data;
+	struct dirhandle* dh;
+	struct node* node;
+	struct node* transient;
+	int epoch = mem_read_begin();
+	int ret = 0;
+
+	node = lookup(ctx, path, &transient);
+	if (node != NULL && node == transient) {
+		// an opened search is kept, and listed in /.search
+		node = ctrfuse_keep_search(ctx, transient);
+		if (node == transient) {
+			transient = NULL;
+		}
+	}
+	if (node == NULL) {
+		ret = -ENOENT;
+	} else if (node->type != Root && node->type != ExefsDir && node->type != RomfsDir && node->type != VirtualDir &&
+	           node->type != SearchDir && node->type != SearchResult) {
+		ret = -ENOTDIR;
+	} else if ((dh = malloc(sizeof(struct dirhandle))) == NULL) {
+		ret = -ENOMEM;
+	} else {
+		dh->node = node;
+		dh->next = ctrfuse_children(ctx, node);
+		dh->pos = 0;
+		pin(dh->node);
+		pin(dh->next);
+		fi->fh = (uintptr_t)dh;
+#ifdef CTRFUSE_FUSE3
+		// Listings never change, except /.search gaining searches, so
+		// the kernel may answer readdir from its own cache.
+		if (node->type != SearchDir) {
+			fi->cache_readdir = 1;
+			fi->keep_cache = 1;
+		}
+#endif
+	}
+	mem_read_end(epoch);
+	ctrfuse_drop(transient);
+	return ret;
+}
+
+int ctrfuse_readlink(const char *path, char *buf, size_t size)
+{
+	struct context* ctx = fuse_get_context()->private_data;
+	int epoch = mem_read_begin();
+	struct node* transient;
+	struct node* node = lookup(ctx, path, &transient);
+	int ret = 0;
+
+	if (node == NULL) {
+		ret = -ENOENT;
+	} else if (node->type != Symlink) {
+		ret = -EINVAL;
+	} else {
+		snprintf(buf, size, "%s", node->data);
+	}
+	mem_read_end(epoch);
+	ctrfuse_drop(transient);
+	return ret;
+}
+
+int ctrfuse_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	struct dirhandle* dh = (struct dirhandle*)(uintptr_t)fi->fh;
+	if (dh != NULL) {
+		unpin(dh->next);
+		unpin(dh->node);
+		free(dh);
+	}
+	fi->fh = 0;
+	return 0;
+}
+
+// Moves a cursor on, keeping the node it points at pinned.
+static void ctrfuse_dirhandle_seek(struct dirhandle* dh, struct node* next)
+{
+	pin(next);
+	unpin(dh->next);
+	dh->next = next;
+}
+
+// Every entry is handed over with its attributes. libfuse 2 passes on only
+// the inode number (with use_ino) and the file type, so there ls -l still
+// costs the kernel a getattr per entry; with libfuse3 the rest reaches it
+// whenever the kernel asks for readdirplus.
+#ifdef CTRFUSE_FUSE3
+int ctrfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi,
+                    enum fuse_readdir_flags flags)
+#else
+int ctrfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+#endif
+{
+	TRACE_SPAN("fuse_readdir");
+	struct context* ctx = fuse_get_context()->private_data;
+	struct dirhandle* dh = (struct dirhandle*)(uintptr_t)fi->fh;
+	u64 start = stats_now();
+	struct stat st;
+	int epoch;
+#ifdef CTRFUSE_FUSE3
+	int plus = (flags & FUSE_READDIR_PLUS) != 0;
+#else
+	int plus = 0;
+#endif
+
+	if (dh == NULL) {
+		return -EBADF;
+	}
+	epoch = mem_read_begin();
+
+	// Resuming where the last call left off is the common case and costs
+	// nothing; anything else (seekdir, rewinddir) walks the child list.
+	if (offset != dh->pos) {
+		struct node* next = ctrfuse_children(ctx, dh->node);
+		off_t i;
+		for (i = 2; i < offset && next != NULL; i++) {
+			next = next->next;
+		}
+		ctrfuse_dirhandle_seek(dh, next);
+		dh->pos = offset;
+	}
+
+	if (dh->pos == 0) {
+		ctrfuse_fill_stat(dh->node, &st, 0);
+		if (ctrfuse_fill(filler, buf, ".", &st, 1, plus)) {
+			goto out;
+		}
+		dh->pos = 1;
+	}
+	if (dh->pos == 1) {
+		memset(&st, 0, sizeof st);
+		st.st_mode = S_IFDIR | 0555;
+		if (ctrfuse_fill(filler, buf, "..", &st, 2, 0)) {
+			goto out;
+		}
+		dh->pos = 2;
+	}
+
+	while (dh->next != NULL) {
+		// Listing / must not lay out romfs.tar or render the info text,
+		// so entries whose size isn't known yet go out with their mode
+		// only and the kernel asks for the rest if it wants it.
+		int complete = ctrfuse_fill_stat(dh->next, &st, 0);
+		if (ctrfuse_fill(filler, buf, dh->next->name, &st, dh->pos + 1, plus && complete)) {
+			break;
+		}
+		ctrfuse_dirhandle_seek(dh, dh->next->next);
+		dh->pos++;
+	}
+out:
+	mem_read_end(epoch);
+	stats_record(STATS_OP_READDIR, start);
+	return 0;
+}
+
+int ctrfuse_open(const char *path, struct fuse_file_info *fi)
+{
+	TRACE_SPAN("fuse_open");
+	struct context* ctx = fuse_get_context()->private_data;
+	struct filehandle* fh;
+	struct node* node;
+	struct node* transient;
+	int epoch = mem_read_begin();
+	int ret = 0;
+
+	node = lookup(ctx, path, &transient);
+	if (node == NULL) {
+		ret = -ENOENT;
+		goto out;
+	}
+	// nothing under /.search is a file; the kernel only opens links
+	// that way with O_NOFOLLOW
+	if (transient != NULL) {
+		ret = node->type == Symlink ? -ELOOP : -EISDIR;
+		goto out;
+	}
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		ret = -EACCES;
+		goto out;
+	}
+
+	fh = calloc(1, sizeof(struct filehandle));
+	if (fh == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	fh->node = node;
+	pthread_mutex_init(&fh->lock, NULL);
+
+	if (node->type == Dynamic) {
+		ret = ctrfuse_snapshot(node, &fh->data, &fh->size);
+		if (ret < 0) {
+			free(fh);
+			goto out;
+		}
+		// the size reported by getattr is meaningless, so read to EOF
+		fi->direct_io = 1;
+	} else {
+		// the image is read-only, so pages cached by an earlier open
+		// are still good
+		fi->keep_cache = 1;
+	}
+
+	pin(node);
+	fi->fh = (uintptr_t)fh;
+out:
+	mem_read_end(epoch);
+	ctrfuse_drop(transient);
+	return ret;
+}
+
+int ctrfuse_release(const char *path, struct fuse_file_info *fi)
+{
+	struct filehandle* fh = (struct filehandle*)(uintptr_t)fi->fh;
+	if (fh != NULL) {
+		unpin(fh->node);
+		pthread_mutex_destroy(&fh->lock);
+		free(fh->data);
+		free(fh);
+	}
+	fi->fh = 0;
+	return 0;
+}
+
+static int ctrfuse_read_memory(const char* data, off_t datasize, char *buf, size_t size, off_t offset)
+{
+	if (0 <= offset && offset < datasize) {
+		if (size > datasize - offset) {
+			size = datasize - offset;
+		}
+		memmove(buf, &data[offset], size);
+		return size;
+	}
+	return 0;
+}
+
+// Called after each RomFS read. Once a handle has read sequentially a few
+// times, the window grows with every further sequential read, doubling up to
+// ctx->readahead, and the part not yet queued is handed to the prefetcher
+// while the kernel is told to start fetching the encrypted bytes.
+static void ctrfuse_readahead(struct context* ctx, struct filehandle* fh, off_t offset, size_t size)
+{
+	romfs_context* romfsctx = fh->node->ctx;
+	off_t end = offset + size;
+	off_t from;
+	u64 window, regionoffset;
+	size_t len;
+	int sequential;
+
+	pthread_mutex_lock(&fh->lock);
+	if (offset == fh->next) {
+		fh->run++;
+	} else {
+		fh->run = 0;
+		fh->ahead = 0;
+	}
+	fh->next = end;
+	sequential = fh->run == READAHEAD_MIN_RUN;
+
+	if (fh->run < READAHEAD_MIN_RUN) {
+		pthread_mutex_unlock(&fh->lock);
+		return;
+	}
+
+	window = ctx->readahead;
+	if (fh->run - READAHEAD_MIN_RUN < 32 && ((u64)size << (fh->run - READAHEAD_MIN_RUN + 1)) < window) {
+		window = (u64)size << (fh->run - READAHEAD_MIN_RUN + 1);
+	}
+
+	// Top up only once half the window has been consumed, so requests stay
+	// large and few.
+	from = fh->ahead > end ? fh->ahead : end;
+	if ((u64)(from - end) > window / 2) {
+		pthread_mutex_unlock(&fh->lock);
+		return;
+	}
+	len = end + window - from;
+	if (!romfs_locate_file(romfsctx, fh->node->fileoffset, from, &len, &regionoffset) || len == 0) {
+		pthread_mutex_unlock(&fh->lock);
+		return;
+	}
+	fh->ahead = from + len;
+	pthread_mutex_unlock(&fh->lock);
+
+	// With direct reads the hints would only fill the page cache with
+	// bytes nobody reads from it.
+	if (sequential && !ctx->direct) {
+		size_t filesize = fh->node->size;
+		u64 filestart;
+
+		if (romfs_locate_file(romfsctx, fh->node->fileoffset, 0, &filesize, &filestart)) {
+			posix_fadvise(ctx->fd, romfsctx->region.offset + filestart, filesize, POSIX_FADV_SEQUENTIAL);
+		}
+	}
+	if (!ctx->direct) {
+		posix_fadvise(ctx->fd, romfsctx->region.offset + regionoffset, len, POSIX_FADV_WILLNEED);
+	}
+	prefetch_region(&romfsctx->region, regionoffset, len);
+}
+
+int ctrfuse_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	TRACE_SPAN("fuse_read");
+	struct context* ctx = fuse_get_context()->private_data;
+	struct filehandle* fh = (struct filehandle*)(uintptr_t)fi->fh;
+	u64 start = stats_now();
+	struct node* node;
+	struct node* transient = NULL;
+	int ret = 0;
+	int epoch;
+
+	iosched_foreground_begin();
+	epoch = mem_read_begin();
+	node = fh != NULL ? fh->node : lookup(ctx, path, &transient);
+	if (node == NULL) {
+		ret = -ENOENT;
+	} else if (node->type == Info) {
+		struct blob* blob = ctrfuse_init_info(node);
+		if (blob != NULL) {
+			ret = ctrfuse_read_memory(blob->data, blob->size, buf, size, offset);
+		}
+	} else if (node->type == Dynamic && fh != NULL) {
+		ret = ctrfuse_read_memory(fh->data, fh->size, buf, size, offset);
+	} else if (node->type == ExefsSection) {
+		exefs_context* exefsctx = &ctx->ncsd.ncch.exefs;
+		int section = node->section;
+		ret = exefs_read(exefsctx, section, RawFlag, buf, offset, size);
+	} else if (node->type == Decrypted) {
+		ret = decrypt_read(node->ctx, buf, offset, size);
+	} else if (node->type == RomfsTar) {
+		tar_map* map = ctrfuse_init_tar(node);
+		ret = map != NULL ? tar_read(map, node->ctx, buf, offset, size) : -EIO;
+	} else if (node->type == RomfsFile) {
+		romfs_context* romfsctx = node->ctx;
+		ret = romfs_read_file(romfsctx, node->fileoffset, buf, offset, size);
+		if (ret > 0 && fh != NULL && ctx->readahead > 0) {
+			ctrfuse_readahead(ctx, fh, offset, ret);
+		}
+	}
+
+	if (ret > 0) {
+		stats_add(STATS_RETURNED_BYTES, ret);
+	}
+	mem_read_end(epoch);
+	ctrfuse_drop(transient);
+	stats_record(STATS_OP_READ, start);
+	iosched_foreground_end();
+	return ret;
+}
+
+// Reads of plaintext data, or of RomFS blocks all verified in the disk
+// cache, are handed to the kernel as a file descriptor, so the data is
+// never copied through us.
+int ctrfuse_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct context* ctx = fuse_get_context()->private_data;
+	struct filehandle* fh = (struct filehandle*)(uintptr_t)fi->fh;
+	struct fuse_bufvec* bufv;
+	struct node* node;
+	struct node* transient = NULL;
+	size_t len = size;
+	u64 regionoffset, position, start;
+	int fd, ret, found = 0;
+	int epoch;
+
+	bufv = malloc(sizeof(struct fuse_bufvec));
+	if (bufv == NULL) {
+		return -ENOMEM;
+	}
+	*bufv = FUSE_BUFVEC_INIT(size);
+
+	start = stats_now();
+	epoch = mem_read_begin();
+	node = fh != NULL ? fh->node : lookup(ctx, path, &transient);
+	if (node != NULL && node->type == RomfsFile) {
+		romfs_context* romfsctx = node->ctx;
+		found = romfs_locate_file(romfsctx, node->fileoffset, offset, &len, &regionoffset) && len > 0 &&
+		        region_locate(&romfsctx->region, regionoffset, len, &fd, &position);
+	} else if (node != NULL && node->type == ExefsSection && offset >= 0 && offset < node->size) {
+		exefs_context* exefsctx = node->ctx;
+		if (len > (size_t)(node->size - offset)) {
+			len = node->size - offset;
+		}
+		regionoffset = sizeof(exefs_header) + getle32(exefsctx->header.section[node->section].offset) + offset;
+		found = region_locate(&exefsctx->region, regionoffset, len, &fd, &position);
+	} else if (node != NULL && node->type == Decrypted) {
+		found = decrypt_locate(node->ctx, offset, &len, &fd, &position);
+	} else if (node != NULL && node->type == RomfsTar) {
+		tar_map* map = ctrfuse_init_tar(node);
+		u32 fileoffset;
+		u64 within;
+		found = map != NULL && tar_locate(map, offset, &len, &fileoffset, &within) &&
+		        romfs_locate_file(node->ctx, fileoffset, within, &len, &regionoffset) && len > 0 &&
+		        region_locate(&((romfs_context*)node->ctx)->region, regionoffset, len, &fd, &position);
+	}
+	mem_read_end(epoch);
+	ctrfuse_drop(transient);
+
+	if (found) {
+		bufv->buf[0].size = len;
+		bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		bufv->buf[0].fd = fd;
+		bufv->buf[0].pos = position;
+		*bufp = bufv;
+		stats_add(STATS_ZEROCOPY_READS, 1);
+		stats_add(STATS_RETURNED_BYTES, len);
+		stats_record(STATS_OP_READ, start);
+		return 0;
+	}
+
+	bufv->buf[0].mem = malloc(size);
+	if (bufv->buf[0].mem == NULL) {
+		free(bufv);
+		return -ENOMEM;
+	}
+
+	ret = ctrfuse_read(path, bufv->buf[0].mem, size, offset, fi);
+	if (ret < 0) {
+		free(bufv->buf[0].mem);
+		free(bufv);
+		return ret;
+	}
+
+	bufv->buf[0].size = ret;
+	*bufp = bufv;
+	return 0;
+}
+
+// A subtree cut loose while something in it was still open. Only the
+// trimmer thread touches these.
+struct zombie {
+	struct node* list;
+	struct zombie* next;
+};
+
+static struct zombie* zombies;
+
+static int ctrfuse_pinned(struct node* node) {
+	for (; node != NULL; node = node->next) {
+		if (__atomic_load_n(&node->opens, __ATOMIC_ACQUIRE) || ctrfuse_pinned(node->child)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Marks a detached subtree and returns its size.
+static u64 ctrfuse_detach(struct node* node) {
+	u64 size = 0;
+	for (; node != NULL; node = node->next) {
+		node->detached = 1;
+		size += nodesize(node) + ctrfuse_detach(node->child);
+	}
+	return size;
+}
+
+// Frees the subtree now if nothing in it is open, else parks it.
+static u64 ctrfuse_retire(struct node* list) {
+	struct zombie* zombie;
+
+	if (!ctrfuse_pinned(list)) {
+		return freenodes(list);
+	}
+	zombie = malloc(sizeof(struct zombie));
+	if (zombie != NULL) {
+		zombie->list = list;
+		zombie->next = zombies;
+		zombies = zombie;
+	}
+	return 0;
+}
+
+// a directory the evictor could cut, with its last use taken at the time
+struct candidate {
+	struct node* node;
+	u64 used;
+};
+
+// Lists the populated RomFS directories and searches under node. Called
+// holding populatelock, so no listing changes underneath.
+static void ctrfuse_collect(struct node* node, struct candidate** dirs, size_t* count, size_t* capacity) {
+	for (; node != NULL; node = node->next) {
+		if (node->type == SearchDir) {
+			ctrfuse_collect(node->child, dirs, count, capacity);
+		}
+		if (!ctrfuse_evictable(node) || !node->populated || node->child == NULL) {
+			continue;
+		}
+		if (*count == *capacity) {
+			size_t n = *capacity ? *capacity * 2 : 64;
+			struct candidate* grown = realloc(*dirs, n * sizeof(struct candidate));
+			if (grown == NULL) {
+				return;
+			}
+			*dirs = grown;
+			*capacity = n;
+		}
+		(*dirs)[*count].node = node;
+		(*dirs)[*count].used = __atomic_load_n(&node->used, __ATOMIC_RELAXED);
+		(*count)++;
+		ctrfuse_collect(node->child, dirs, count, capacity);
+	}
+}
+
+// Unlinks the searches in /.search that nothing has open, which one scan
+// builds again, into the slots of dirs. Called holding populatelock.
+static size_t ctrfuse_unlink_searches(struct context* ctx, struct candidate** dirs, size_t* capacity, u64* cut) {
+	struct node** link = &ctx->search->child;
+	struct node* node;
+	size_t count = 0;
+
+	while ((node = *link) != NULL) {
+		if (__atomic_load_n(&node->opens, __ATOMIC_ACQUIRE) || ctrfuse_pinned(node->child)) {
+			link = &node->next;
+			continue;
+		}
+		if (count == *capacity) {
+			size_t n = *capacity ? *capacity * 2 : 64;
+			struct candidate* grown = realloc(*dirs, n * sizeof(struct candidate));
+			if (grown == NULL) {
+				break;
+			}
+			*dirs = grown;
+			*capacity = n;
+		}
+		// readers still on node go on to node->next, so it is left as is
+		__atomic_store_n(link, node->next, __ATOMIC_RELEASE);
+		node->detached = 1;
+		*cut += nodesize(node) + ctrfuse_detach(node->child);
+		(*dirs)[count++].node = node;
+	}
+	return count;
+}
+
+static int ctrfuse_colder(const void* a, const void* b) {
+	u64 x = ((const struct candidate*)a)->used;
+	u64 y = ((const struct candidate*)b)->used;
+	return x < y ? -1 : x > y;
+}
+
+// Evictor for RomFS directory listings and search results. Searches that
+// are not open go first, whole; then the children of the directories
+// looked up longest ago are cut loose until want bytes are covered. A
+// later lookup fills them in again from the RomFS metadata. Cut subtrees
+// are freed once no reader can still be walking them.
+static u64 ctrfuse_evict_dirs(void* arg, u64 want) {
+	struct context* ctx = arg;
+	struct zombie** zp = &zombies;
+	struct candidate* searches = NULL;
+	struct candidate* dirs = NULL;
+	size_t count = 0, capacity = 0, searchcapacity = 0, nsearches, nlists = 0, i;
+	u64 freed = 0, cut = 0;
+
+	while (*zp != NULL) {
+		struct zombie* zombie = *zp;
+		if (ctrfuse_pinned(zombie->list)) {
+			zp = &zombie->next;
+			continue;
+		}
+		freed += freenodes(zombie->list);
+		*zp = zombie->next;
+		free(zombie);
+	}
+	if (freed >= want) {
+		return freed;
+	}
+
+	pthread_mutex_lock(&populatelock);
+	nsearches = ctrfuse_unlink_searches(ctx, &searches, &searchcapacity, &cut);
+	ctrfuse_collect(ctx->root->child, &dirs, &count, &capacity);
+	qsort(dirs, count, sizeof(struct candidate), ctrfuse_colder);
+	// The lists cut off are kept in the slots of candidates already seen.
+	for (i = 0; i < count && freed + cut < want; i++) {
+		struct node* dir = dirs[i].node;
+		if (dir->detached) {
+			continue;
+		}
+		__atomic_store_n(&dir->populated, 0, __ATOMIC_RELEASE);
+		dirs[nlists].node = dir->child;
+		__atomic_store_n(&dir->child, NULL, __ATOMIC_RELEASE);
+		cut += ctrfuse_detach(dirs[nlists++].node);
+	}
+	__atomic_add_fetch(&evictpass, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&populatelock);
+
+	if (nlists > 0 || nsearches > 0) {
+		mem_synchronize();
+		for (i = 0; i < nsearches; i++) {
+			searches[i].node->next = NULL;
+			freed += ctrfuse_retire(searches[i].node);
+		}
+		for (i = 0; i < nlists; i++) {
+			freed += ctrfuse_retire(dirs[i].node);
+		}
+	}
+	free(searches);
+	free(dirs);
+	mem_charge(-(s64)freed);
+	return freed;
+}
+
+// Evictor for the rendered info text.
+static u64 ctrfuse_evict_info(void* arg, u64 want) {
+	struct context* ctx = arg;
+	struct blob* blob;
+
+	blob = __atomic_exchange_n(&ctx->info->blob, NULL, __ATOMIC_ACQ_REL);
+	if (blob == NULL) {
+		return 0;
+	}
+	mem_synchronize();
+	want = sizeof(struct blob) + blob->size;
+	free(blob);
+	mem_charge(-(s64)want);
+	return want;
+}
+
+// Evictor for the layout of romfs.tar.
+static u64 ctrfuse_evict_tar(void* arg, u64 want) {
+	struct context* ctx = arg;
+	tar_map* map;
+
+	map = __atomic_exchange_n(&ctx->tar->tar, NULL, __ATOMIC_ACQ_REL);
+	if (map == NULL) {
+		return 0;
+	}
+	mem_synchronize();
+	want = tar_memory(map);
+	tar_free(map);
+	free(map);
+	mem_charge(-(s64)want);
+	return want;
+}
+
+// Evictor of last resort: every RomFS read needs the file metadata, so it
+// is only dropped once the listings, info and archive layout are gone.
+static u64 ctrfuse_evict_romfs(void* arg, u64 want) {
+	struct context* ctx = arg;
+
+	return romfs_evict(&ctx->ncsd.ncch.romfs);
+}
+
+// Fills in layout for an ExeFS section, RomFS file or RomFS directory.
+// Called inside a read section; returns 0 for anything else.
+static int ctrfuse_layout(struct node* node, struct layout* layout) {
+	memset(layout, 0, sizeof *layout);
+
+	if (node->type == RomfsDir) {
+		layout->hastotals = romfs_get_totals(node->ctx, node->diroffset, &layout->total);
+		return layout->hastotals;
+	}
+
+	layout->isfile = 1;
+	if (node->type == ExefsSection) {
+		exefs_context* exefs = node->ctx;
+		exefs_sectionheader* section = &exefs->header.section[node->section];
+
+		layout->offset = exefs->offset + sizeof(exefs_header) + getle32(section->offset);
+		layout->size = getle32(section->size);
+		layout->encrypted = exefs->encrypted;
+		// the header hashes the section as stored, which is what we serve
+		memcpy(layout->hash, exefs->header.hashes[7 - node->section], 32);
+		layout->hashed = 1;
+		return 1;
+	}
+
+	if (node->type == RomfsFile) {
+		romfs_context* romfs = node->ctx;
+		ivfc_context* ivfc = &romfs->ivfc;
+		size_t size = node->size;
+
+		if (!romfs_locate_file(romfs, node->fileoffset, 0, &size, &layout->regionoffset)) {
+			return 0;
+		}
+		layout->offset = romfs->region.offset + layout->regionoffset;
+		layout->size = size;
+		layout->encrypted = romfs->encrypted;
+		layout->region = &romfs->region;
+
+		if (size > 0 && ivfc->levelcount > 0) {
+			ivfc_level* level = &ivfc->level[ivfc->levelcount - 1];
+			if (layout->regionoffset >= level->dataoffset && level->hashblocksize) {
+				layout->firstblock = (layout->regionoffset - level->dataoffset) / level->hashblocksize;
+				layout->lastblock = (layout->regionoffset + size - 1 - level->dataoffset) / level->hashblocksize;
+				layout->hasblocks = 1;
+			}
+		}
+
+		if (__atomic_load_n(&node->hashed, __ATOMIC_ACQUIRE)) {
+			memcpy(layout->hash, node->hash, 32);
+			layout->hashed = 1;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+// Hashes a RomFS file through the region. This can take a while, so it
+// runs outside any read section, in chunks that count as user reads.
+static int ctrfuse_hash(struct layout* layout) {
+	ctr_sha256_context sha;
+	u64 done = 0;
+	u8* buf = malloc(XATTR_HASH_CHUNK);
+	int ok = 1;
+
+	if (buf == NULL) {
+		return 0;
+	}
+	ctr_sha_256_init(&sha);
+	while (ok && done < layout->size) {
+		size_t len = layout->size - done < XATTR_HASH_CHUNK ? layout->size - done : XATTR_HASH_CHUNK;
+
+		iosched_foreground_begin();
+		ok = region_read(layout->region, layout->regionoffset + done, buf, len);
+		iosched_foreground_end();
+		if (ok) {
+			ctr_sha_256_update(&sha, buf, len);
+			done += len;
+		}
+	}
+	if (ok) {
+		ctr_sha_256_finish(&sha, layout->hash);
+		layout->hashed = 1;
+	}
+	free(buf);
+	return ok;
+}
+
+static int ctrfuse_has_xattr(struct layout* layout, int index) {
+	switch (index) {
+	case XATTR_SHA256:
+	case XATTR_OFFSET:
+	case XATTR_ENCRYPTED:
+		return layout->isfile;
+	case XATTR_BLOCKS:
+		return layout->hasblocks;
+	case XATTR_TOTAL_BYTES:
+	case XATTR_TOTAL_FILES:
+	case XATTR_TOTAL_DIRS:
+		return layout->hastotals;
+	}
+	return 0;
+}
+
+// Formats an attribute the node is known to have into text and returns
+// its length.
+static int ctrfuse_format_xattr(struct layout* layout, int index, char* text, size_t size) {
+	int i;
+
+	switch (index) {
+	case XATTR_SHA256:
+		for (i = 0; i < 32; i++) {
+			snprintf(text + 2 * i, size - 2 * i, "%02x", layout->hash[i]);
+		}
+		return 64;
+	case XATTR_OFFSET:
+		return snprintf(text, size, "%llu", (unsigned long long)layout->offset);
+	case XATTR_ENCRYPTED:
+		return snprintf(text, size, "%d", layout->encrypted ? 1 : 0);
+	case XATTR_BLOCKS:
+		return snprintf(text, size, "%llu-%llu", (unsigned long long)layout->firstblock,
+			(unsigned long long)layout->lastblock);
+	case XATTR_TOTAL_BYTES:
+		return snprintf(text, size, "%llu", (unsigned long long)layout->total.bytes);
+	case XATTR_TOTAL_FILES:
+		return snprintf(text, size, "%llu", (unsigned long long)layout->total.files);
+	case XATTR_TOTAL_DIRS:
+		return snprintf(text, size, "%llu", (unsigned long long)layout->total.dirs);
+	}
+	return -ENODATA;
+}
+
+// user.ctr.* attributes let tools skip reading a file they already have,
+// read its bytes straight from the image, or size a directory without
+// walking it. The RomFS hash is computed on first request and kept with
+// the node.
+int ctrfuse_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	struct context* ctx = fuse_get_context()->private_data;
+	struct layout layout;
+	struct node* node;
+	struct node* transient;
+	char text[80];
+	int epoch, index, ret;
+
+	for (index = 0; index < XATTR_COUNT; index++) {
+		if (strcmp(name, xattrnames[index]) == 0) {
+			break;
+		}
+	}
+
+	epoch = mem_read_begin();
+	node = lookup(ctx, path, &transient);
+	if (node == NULL) {
+		mem_read_end(epoch);
+		ctrfuse_drop(transient);
+		return -ENOENT;
+	}
+	// searches and their links have no layout, so a transient one ends here
+	if (index == XATTR_COUNT || !ctrfuse_layout(node, &layout) || !ctrfuse_has_xattr(&layout, index)) {
+		mem_read_end(epoch);
+		ctrfuse_drop(transient);
+		return -ENODATA;
+	}
+	pin(node);
+	mem_read_end(epoch);
+
+	ret = 0;
+	if (index == XATTR_SHA256 && !layout.hashed) {
+		if (!ctrfuse_hash(&layout)) {
+			ret = -EIO;
+		} else {
+			pthread_mutex_lock(&populatelock);
+			if (!node->hashed) {
+				memcpy(node->hash, layout.hash, 32);
+				__atomic_store_n(&node->hashed, 1, __ATOMIC_RELEASE);
+			}
+			pthread_mutex_unlock(&populatelock);
+		}
+	}
+	unpin(node);
+
+	if (ret == 0) {
+		ret = ctrfuse_format_xattr(&layout, index, text, sizeof text);
+	}
+	if (ret >= 0 && size > 0) {
+		if ((size_t)ret > size) {
+			return -ERANGE;
+		}
+		memcpy(value, text, ret);
+	}
+	return ret;
+}
+
+int ctrfuse_listxattr(const char *path, char *list, size_t size)
+{
+	struct context* ctx = fuse_get_context()->private_data;
+	struct layout layout;
+	struct node* node;
+	struct node* transient;
+	size_t len = 0;
+	int epoch, i, ret = 0;
+
+	epoch = mem_read_begin();
+	node = lookup(ctx, path, &transient);
+	if (node == NULL) {
+		ret = -ENOENT;
+	} else if (ctrfuse_layout(node, &layout)) {
+		for (i = 0; i < XATTR_COUNT; i++) {
+			size_t n = strlen(xattrnames[i]) + 1;
+
+			if (!ctrfuse_has_xattr(&layout, i)) {
+				continue;
+			}
+			if (size > 0) {
+				if (len + n > size) {
+					ret = -ERANGE;
+					break;
+				}
+				memcpy(list + len, xattrnames[i], n);
+			}
+			len += n;
+		}
+	}
+	mem_read_end(epoch);
+	ctrfuse_drop(transient);
+	return ret < 0 ? ret : (int)len;
+}
+
+// Reports the image contents as a full, read-only filesystem: blocks are
+// the bytes of every RomFS file and ExeFS section, files everything under
+// the RomFS. Both come from the directory totals, but statfs never parses
+// anything itself; until a lookup has loaded the ExeFS and RomFS it gives
+// the image size and no file count.
+int ctrfuse_statfs(const char *path, struct statvfs *st)
+{
+	struct context* ctx = fuse_get_context()->private_data;
+	ncch_context* ncch = &ctx->ncsd.ncch;
+	romfs_dirtotal total;
+	u64 bytes = 0, files = 0;
+	int epoch, i, known = 0;
+
+	memset(st, 0, sizeof *st);
+	st->f_bsize = STATFS_BLOCK_SIZE;
+	st->f_frsize = STATFS_BLOCK_SIZE;
+	st->f_namemax = NAME_MAX;
+
+	epoch = mem_read_begin();
+	if (ncch_is_loaded(ncch, NCCHTYPE_EXEFS)) {
+		for (i = 0; i < 8; i++) {
+			bytes += getle32(ncch->exefs.header.section[i].size);
+			files += getle32(ncch->exefs.header.section[i].size) != 0;
+		}
+	}
+	if (ncch_is_loaded(ncch, NCCHTYPE_ROMFS) && romfs_get_totals(&ncch->romfs, 0, &total)) {
+		bytes += total.bytes;
+		files += total.files + total.dirs;
+		known = 1;
+	}
+	mem_read_end(epoch);
+
+	if (!known) {
+		bytes = ctx->ncsd.size;
+		files = 0;
+	}
+	st->f_blocks = (bytes + STATFS_BLOCK_SIZE - 1) / STATFS_BLOCK_SIZE;
+	st->f_files = files;
+	return 0;
+}
+
+void make_nodes(struct context* ctx) {
+	struct node* infonode;
+	struct node* exefsnode;
+	struct node* romfsnode;
+	struct node* ctrfusenode;
+	struct node* statsnode;
+	struct node* searchnode;
+	struct node* tarnode;
+	ctx->root = newnode(Root, "/");
+
+	infonode = newnode(Info, "info");
+	exefsnode = newnode(ExefsDir, "exefs");
+	romfsnode = newnode(RomfsDir, "romfs");
+
+	ctx->root->child = infonode;
+	ctx->root->child->next = exefsnode;
+	ctx->root->child->next->next = romfsnode;
+
+	// control files live in a hidden directory so they don't clash with
+	// anything in the image
+	ctrfusenode = newnode(VirtualDir, ".ctrfuse");
+
+	// the whole RomFS as one archive, put together as it is read
+	tarnode = newnode(RomfsTar, "romfs.tar");
+	tarnode->ctx = &ctx->ncsd.ncch.romfs;
+	ctx->tar = tarnode;
+	romfsnode->next = tarnode;
+	tarnode->next = ctrfuse_init_decrypted(ctx, ctrfusenode);
+
+	// /.search/PATTERN lists the RomFS files matching PATTERN
+	searchnode = newnode(SearchDir, ".search");
+	searchnode->ctx = &ctx->ncsd.ncch.romfs;
+	ctx->search = searchnode;
+	ctrfusenode->next = searchnode;
+
+	statsnode = newnode(Dynamic, "stats");
+	statsnode->print = stats_print;
+	ctrfusenode->child = statsnode;
+
+	if (ctx->verify) {
+		struct node* verifynode = newnode(Dynamic, "verify");
+		verifynode->print = verify_print;
+		statsnode->next = verifynode;
+	}
+
+	infonode->ctx = &ctx->ncsd;
+	ctx->info = infonode;
+
+	exefsnode->ctx = &ctx->ncsd.ncch;
+
+	romfsnode->diroffset = 0;
+	romfsnode->ctx = &ctx->ncsd.ncch.romfs;
+}
+
+// Runs once FUSE has daemonized, so threads started here survive.
+#ifdef CTRFUSE_FUSE3
+void* ctrfuse_init(struct fuse_conn_info* conn, struct fuse_config* cfg)
+#else
+void* ctrfuse_init(struct fuse_conn_info* conn)
+#endif
+{
+	struct context* ctx = fuse_get_context()->private_data;
+
+	// let replies that name a file descriptor be spliced by the kernel
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#ifdef CTRFUSE_FUSE3
+	// node inode numbers are stable for the life of the mount
+	cfg->use_ino = 1;
+#endif
+
+	stats_add(STATS_MOUNT_NS, stats_now() - ctx->started);
+	if (ctx->verify) {
+		verify_start(&ctx->ncsd);
+	}
+	mem_start();
+	return ctx;
+}
+
+void ctrfuse_destroy(void* private_data)
+{
+	struct context* ctx = private_data;
+
+	iosched_stop();
+	mem_stop();
+	verify_stop();
+	prefetch_stop();
+	reader_close(&ctx->reader);
+	trace_dump();
+}
+
+struct fuse_operations fuse_ops =
+{
+	.getattr	= ctrfuse_getattr,
+	.readlink	= ctrfuse_readlink,
+	.opendir	= ctrfuse_opendir,
+	.readdir	= ctrfuse_readdir,
+	.releasedir	= ctrfuse_releasedir,
+	.open		= ctrfuse_open,
+	.read		= ctrfuse_read,
+	.read_buf	= ctrfuse_read_buf,
+	.release	= ctrfuse_release,
+	.getxattr	= ctrfuse_getxattr,
+	.listxattr	= ctrfuse_listxattr,
+	.statfs		= ctrfuse_statfs,
+	.init		= ctrfuse_init,
+	.destroy	= ctrfuse_destroy,
+};
+
+static ssize_t backing_read(void* cookie, char* buf, size_t size)
+{
+	TRACE_SPAN("backing_read");
+	ssize_t n = read((int)(intptr_t)cookie, buf, size);
+	if (n > 0) {
+		stats_add(STATS_BACKING_BYTES, n);
+	}
+	stats_add(STATS_BACKING_READS, 1);
+	return n;
+}
+
+static int backing_seek(void* cookie, off64_t* offset, int whence)
+{
+	off_t pos = lseek((int)(intptr_t)cookie, *offset, whence);
+	if (pos < 0) {
+		return -1;
+	}
+	stats_add(STATS_BACKING_SEEKS, 1);
+	*offset = pos;
+	return 0;
+}
+
+static int backing_close(void* cookie)
+{
+	return close((int)(intptr_t)cookie);
+}
+
+// Opens the image as a stdio stream that counts what the parsers pull
+// from disk, without having to touch every fread in them. The descriptor
+// underneath is returned in fdp for posix_fadvise.
+FILE* backing_open(const char* filename, int* fdp)
+{
+	cookie_io_functions_t io = {
+		.read = backing_read,
+		.write = NULL,
+		.seek = backing_seek,
+		.close = backing_close,
+	};
+	FILE* file;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	file = fopencookie((void*)(intptr_t)fd, "rb", io);
+	if (file == NULL) {
+		close(fd);
+	}
+	*fdp = fd;
+	return file;
+}
+
+struct options {
+	char* tracefile;
+	char* loglevel;
+	char* logfile;
+	char* cachesize;
+	char* shmcache;
+	char* shmcachesize;
+	char* diskcache;
+	char* diskcachesize;
+	char* readahead;
+	char* backend;
+	int directbacking;
+	char* bgrate;
+	int bgjobs;
+	int bgpause;
+	int verify;
+	char* memlimit;
+};
+
+#define CTRFUSE_OPT(t, p) { t, offsetof(struct options, p), 1 }
+
+static const struct fuse_opt ctrfuse_opts[] = {
+	CTRFUSE_OPT("trace=%s", tracefile),
+	CTRFUSE_OPT("loglevel=%s", loglevel),
+	CTRFUSE_OPT("logfile=%s", logfile),
+	CTRFUSE_OPT("cache_size=%s", cachesize),
+	CTRFUSE_OPT("shm_cache=%s", shmcache),
+	CTRFUSE_OPT("shm_cache_size=%s", shmcachesize),
+	CTRFUSE_OPT("disk_cache=%s", diskcache),
+	CTRFUSE_OPT("disk_cache_size=%s", diskcachesize),
+	CTRFUSE_OPT("readahead=%s", readahead),
+	CTRFUSE_OPT("backend=%s", backend),
+	CTRFUSE_OPT("direct_backing", directbacking),
+	CTRFUSE_OPT("bg_rate=%s", bgrate),
+	CTRFUSE_OPT("bg_jobs=%u", bgjobs),
+	CTRFUSE_OPT("bg_pause=%u", bgpause),
+	CTRFUSE_OPT("verify", verify),
+	CTRFUSE_OPT("mem_limit=%s", memlimit),
+	FUSE_OPT_END
+};
+
+// Parses a byte count with an optional K, M or G suffix.
+static int parse_size(const char* s, u64* size)
+{
+	char* end;
+	u64 n = strtoull(s, &end, 10);
+
+	if (end == s) {
+		return 0;
+	}
+	switch (*end) {
+	case 'G': case 'g': n <<= 10; /* fall through */
+	case 'M': case 'm': n <<= 10; /* fall through */
+	case 'K': case 'k': n <<= 10; end++; break;
+	}
+	if (*end != '\0') {
+		return 0;
+	}
+	*size = n;
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct options options;
+	int i, ret;
+	char *filename;
+	FILE *infile;
+	off_t infilesize;
+	struct context ctx;
+	u64 cachesize = BLOCKCACHE_DEFAULT_SIZE;
+	u64 shmcachesize = SHMCACHE_DEFAULT_SIZE;
+	u64 diskcachesize = DISKCACHE_DEFAULT_SIZE;
+	u64 readahead = PREFETCH_DEFAULT_SIZE;
+	u64 bgrate = 0;
+	u64 memlimit = 0;
+	int directfd;
+	struct stat st;
+
+	ctx.started = stats_now();
+	if(argc < 3)
+	{
+		printf("Usage: %s file.nds mount_point [fuse_options]\n",argv[0]);
+		printf("\nctrfuse options:\n");
+		printf("    -o trace=FILE          write a Chrome trace of hot paths to FILE\n");
+		printf("                           on unmount and on SIGUSR2\n");
+		printf("    -o loglevel=LEVEL      error, warning (default), info or debug\n");
+		printf("    -o logfile=FILE        append log messages to FILE, or \"syslog\"\n");
+		printf("    -o cache_size=SIZE     memory for decrypted blocks, e.g. 256M (default 64M,\n");
+		printf("                           0 disables the cache)\n");
+		printf("    -o shm_cache=FILE      share decrypted blocks with other ctrfuse\n");
+		printf("                           processes through FILE, e.g. /dev/shm/ctrfuse\n");
+		printf("    -o shm_cache_size=SIZE size of a new shared cache (default 256M)\n");
+		printf("    -o disk_cache=DIR      keep decrypted RomFS blocks in DIR across mounts\n");
+		printf("    -o disk_cache_size=SIZE  cap on DIR (default 4G)\n");
+		printf("    -o readahead=SIZE      decrypt up to SIZE ahead of sequential readers\n");
+		printf("                           (default 2M, 0 disables)\n");
+		printf("    -o backend=NAME        read the image with stdio, pread (default), mmap\n");
+		printf("                           or io_uring\n");
+		printf("    -o direct_backing      read image data with O_DIRECT, keeping it out of\n");
+		printf("                           the page cache (pread and io_uring only)\n");
+		printf("    -o bg_rate=SIZE        cap background reading at SIZE per second\n");
+		printf("    -o bg_jobs=N           background tasks running at once (default 1)\n");
+		printf("    -o bg_pause=N          pause background work while N or more user\n");
+		printf("                           reads are in flight (default 4)\n");
+		printf("    -o verify              check every hash and signature in the image in\n");
+		printf("                           the background; see /.ctrfuse/verify\n");
+		printf("    -o mem_limit=SIZE      keep parsed metadata under about SIZE, dropping\n");
+		printf("                           what was used least recently (default no limit)\n");
+		return 1;
+	}
+
+	filename = argv[1];
+
+	for(i=0;i<argc;i++)
+	{
+		if(i != 1) fuse_opt_add_arg(&args, argv[i]);
+	}
+#ifndef CTRFUSE_FUSE3
+	// node inode numbers are stable for the life of the mount; libfuse3
+	// is told so in ctrfuse_init
+	fuse_opt_add_arg(&args, "-ouse_ino");
+#endif
+
+	memset(&options, 0, sizeof options);
+	if (fuse_opt_parse(&args, &options, ctrfuse_opts, NULL) == -1)
+	{
+		return 1;
+	}
+
+	if (options.loglevel)
+	{
+		int level = log_parse_level(options.loglevel);
+		if (level < 0)
+		{
+			fprintf(stderr, "error: unknown log level %s\n", options.loglevel);
+			return 1;
+		}
+		log_set_level(level);
+	}
+
+	if (options.logfile && !log_set_file(options.logfile))
+	{
+		perror(options.logfile);
+		return 1;
+	}
+
+	if (options.tracefile)
+	{
+		trace_init(options.tracefile);
+	}
+
+	if (options.cachesize && !parse_size(options.cachesize, &cachesize))
+	{
+		fprintf(stderr, "error: bad cache size %s\n", options.cachesize);
+		return 1;
+	}
+
+	if (!blockcache_init(cachesize))
+	{
+		fprintf(stderr, "error: could not allocate block cache\n");
+		return 1;
+	}
+
+	if (options.shmcachesize && !parse_size(options.shmcachesize, &shmcachesize))
+	{
+		fprintf(stderr, "error: bad shared cache size %s\n", options.shmcachesize);
+		return 1;
+	}
+
+	if (options.shmcache && !shmcache_attach(options.shmcache, shmcachesize))
+	{
+		fprintf(stderr, "error: could not attach shared cache %s\n", options.shmcache);
+		return 1;
+	}
+
+	if (options.diskcachesize && !parse_size(options.diskcachesize, &diskcachesize))
+	{
+		fprintf(stderr, "error: bad disk cache size %s\n", options.diskcachesize);
+		return 1;
+	}
+
+	if (options.diskcache && !diskcache_init(options.diskcache, diskcachesize))
+	{
+		perror(options.diskcache);
+		return 1;
+	}
+
+	if (options.readahead && !parse_size(options.readahead, &readahead))
+	{
+		fprintf(stderr, "error: bad readahead size %s\n", options.readahead);
+		return 1;
+	}
+
+	if (options.memlimit && !parse_size(options.memlimit, &memlimit))
+	{
+		fprintf(stderr, "error: bad memory limit %s\n", options.memlimit);
+		return 1;
+	}
+	mem_init(memlimit);
+
+	infile = backing_open(filename, &ctx.fd);
+	if (infile == 0)
+	{
+		fprintf(stderr, "error: could not open input file!\n");
+		return -1;
+	}
+
+	if (options.bgrate && !parse_size(options.bgrate, &bgrate))
+	{
+		fprintf(stderr, "error: bad background rate %s\n", options.bgrate);
+		return 1;
+	}
+	iosched_init(bgrate, options.bgjobs ? options.bgjobs : IOSCHED_DEFAULT_JOBS,
+		options.bgpause ? options.bgpause : IOSCHED_DEFAULT_PAUSE_DEPTH);
+
+	directfd = -1;
+	if (options.directbacking)
+	{
+		directfd = open(filename, O_RDONLY | O_DIRECT);
+		if (directfd < 0)
+		{
+			perror("O_DIRECT");
+			return 1;
+		}
+	}
+	ctx.direct = directfd >= 0;
+
+	if (!reader_init(&ctx.reader, options.backend ? options.backend : "pread", infile, ctx.fd, directfd))
+	{
+		return 1;
+	}
+	log_info("reading %s with %s", filename, reader_name(&ctx.reader));
+
+	fseek(infile, 0, SEEK_END);
 	infilesize = ftello(infile);
 	fseek(infile, 0, SEEK_SET);
 
+	ctx.mtime = 0;
+	if (fstat(ctx.fd, &st) == 0)
+	{
+		ctx.mtime = st.st_mtime;
+	}
+
+	ctx.readahead = readahead;
+	ctx.verify = options.verify;
 	ncsd_init(&ctx.ncsd);
 	ncsd_set_file(&ctx.ncsd, infile);
+	ncsd_set_reader(&ctx.ncsd, &ctx.reader);
 	ncsd_set_size(&ctx.ncsd, infilesize);
 	//ncsd_set_usersettings(&ctx.ncsd, &ctx.usersettings);
 
-	ncsd_process(&ctx.ncsd, 0);
+	// Only the NCSD and NCCH headers are read here; the rest is parsed when
+	// a directory that needs it is first looked at.
+	ncsd_process(&ctx.ncsd, LazyFlag);
 	make_nodes(&ctx);
-
-	for(i=0;i<argc;i++)
-	{
-		if(i != 1) fuse_opt_add_arg(&args, argv[i]);
-	}
+	mem_register(ctrfuse_evict_dirs, &ctx);
+	mem_register(ctrfuse_evict_info, &ctx);
+	mem_register(ctrfuse_evict_tar, &ctx);
+	mem_register(ctrfuse_evict_romfs, &ctx);
 
 	ret = fuse_main(args.argc, args.argv, &fuse_ops, &ctx);
 
@@ -0,0 +1,116 @@
+#include <time.h>
+#include <pthread.h>
+
+#include "types.h"
+#include "iosched.h"
+#include "stats.h"
+
+// Two classes of work share the disk and the CPU. Foreground is the reads
+// FUSE is waiting on; it only counts itself in and out, and never waits.
+// Background work (read-ahead, verification) asks before each slice: it
+// runs only while fewer than pausedepth foreground reads are in flight,
+// at most jobs slices at a time, and within rate bytes per second when a
+// rate is set. Slices are short, so a burst of user reads preempts
+// background work at the next slice boundary.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static u32 foreground;
+static u32 background;
+static u32 maxbackground = IOSCHED_DEFAULT_JOBS;
+static u32 pausedepth = IOSCHED_DEFAULT_PAUSE_DEPTH;
+static u64 rate;				// bytes per second, 0 for no limit
+static s64 tokens;
+static u64 refilled;
+static int stopping;
+
+void iosched_init(u64 bytespersecond, u32 jobs, u32 depth)
+{
+	rate = bytespersecond;
+	maxbackground = jobs ? jobs : 1;
+	pausedepth = depth ? depth : 1;
+	refilled = stats_now();
+	tokens = rate / 10;
+}
+
+void iosched_foreground_begin(void)
+{
+	__atomic_add_fetch(&foreground, 1, __ATOMIC_RELAXED);
+}
+
+void iosched_foreground_end(void)
+{
+	__atomic_sub_fetch(&foreground, 1, __ATOMIC_RELAXED);
+}
+
+// Adds the tokens earned since the last refill, keeping at most 100ms
+// worth so an idle spell doesn't turn into a burst. Called locked.
+static void iosched_refill(u64 now)
+{
+	s64 burst = rate / 10;
+
+	tokens += (s64)((now - refilled) * (double)rate / 1e9);
+	if (tokens > burst)
+		tokens = burst;
+	refilled = now;
+}
+
+// Waits until a background slice of bytes may run. Returns 0 if the
+// scheduler is shutting down and the work should be abandoned.
+int iosched_background_begin(u64 bytes)
+{
+	struct timespec pause = { 0, IOSCHED_POLL_NS };
+	int waited = 0, throttled = 0;
+
+	pthread_mutex_lock(&lock);
+	for(;;)
+	{
+		if (stopping)
+		{
+			pthread_mutex_unlock(&lock);
+			return 0;
+		}
+
+		if (__atomic_load_n(&foreground, __ATOMIC_RELAXED) >= pausedepth || background >= maxbackground)
+			waited = 1;
+		else if (rate)
+		{
+			iosched_refill(stats_now());
+			// A slice larger than the bucket runs on credit; the debt
+			// holds back the next one.
+			if (tokens > 0)
+			{
+				tokens -= bytes;
+				break;
+			}
+			throttled = 1;
+		}
+		else
+			break;
+
+		pthread_mutex_unlock(&lock);
+		nanosleep(&pause, 0);
+		pthread_mutex_lock(&lock);
+	}
+	background++;
+	pthread_mutex_unlock(&lock);
+
+	if (waited)
+		stats_add(STATS_SCHED_PAUSES, 1);
+	if (throttled)
+		stats_add(STATS_SCHED_THROTTLED, 1);
+	return 1;
+}
+
+void iosched_background_end(void)
+{
+	pthread_mutex_lock(&lock);
+	background--;
+	pthread_mutex_unlock(&lock);
+}
+
+// Releases anything waiting for a slice, for unmount.
+void iosched_stop(void)
+{
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_mutex_unlock(&lock);
+}
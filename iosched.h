@@ -0,0 +1,25 @@
+#ifndef _IOSCHED_H_
+#define _IOSCHED_H_
+
+#include "types.h"
+
+#define IOSCHED_DEFAULT_JOBS			1		// background tasks running at once
+#define IOSCHED_DEFAULT_PAUSE_DEPTH	4		// foreground reads that pause background
+#define IOSCHED_POLL_NS				1000000
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void iosched_init(u64 rate, u32 jobs, u32 pausedepth);
+void iosched_foreground_begin(void);
+void iosched_foreground_end(void);
+int  iosched_background_begin(u64 bytes);
+void iosched_background_end(void);
+void iosched_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _IOSCHED_H_
@@ -3,12 +3,14 @@
 #include <stdlib.h>
 #include "types.h"
 #include "utils.h"
+#include "log.h"
 #include "ivfc.h"
 #include "ctr.h"
 
 void ivfc_init(ivfc_context* ctx)
 {
 	memset(ctx, 0, sizeof(ivfc_context));
+	pthread_mutex_init(&ctx->trustlock, 0);
 }
 
 void ivfc_set_usersettings(ivfc_context* ctx, settings* usersettings)
@@ -16,12 +18,12 @@ void ivfc_set_usersettings(ivfc_context* ctx, settings* usersettings)
 	ctx->usersettings = usersettings;
 }
 
-void ivfc_set_offset(ivfc_context* ctx, u32 offset)
+void ivfc_set_offset(ivfc_context* ctx, u64 offset)
 {
 	ctx->offset = offset;
 }
 
-void ivfc_set_size(ivfc_context* ctx, u32 size)
+void ivfc_set_size(ivfc_context* ctx, u64 size)
 {
 	ctx->size = size;
 }
@@ -31,23 +33,41 @@ void ivfc_set_file(ivfc_context* ctx, FILE* file)
 	ctx->file = file;
 }
 
+void ivfc_set_region(ivfc_context* ctx, region_context* region)
+{
+	ctx->region = *region;
+	ctx->file = region->file;
+	ctx->offset = region->offset;
+	ctx->size = region->size;
+}
+
+// Records the hash the NCCH header gives for the first size bytes of the
+// RomFS, which hold the IVFC header and master hash.
+void ivfc_set_superblock(ivfc_context* ctx, const u8 hash[0x20], u64 size)
+{
+	memcpy(ctx->superblockhash, hash, 0x20);
+	ctx->superblocksize = size;
+}
+
 
 void ivfc_process(ivfc_context* ctx, u32 actions)
 {
 
 
-	fseek(ctx->file, ctx->offset, SEEK_SET);
-	fread(&ctx->header, 1, sizeof(ivfc_header), ctx->file);
+	if (ctx->region.file == 0)
+		region_init(&ctx->region, ctx->file, ctx->offset, ctx->size);
+
+	region_read(&ctx->region, 0, &ctx->header, sizeof(ivfc_header));
 
 	if (getle32(ctx->header.magic) != MAGIC_IVFC)
 	{
-		fprintf(stdout, "Error, IVFC segment corrupted\n");
+		log_error("Error, IVFC segment corrupted");
 		return;
 	}
 
 	if (getle32(ctx->header.id) == 0x10000)
 	{
-		fread(&ctx->romfsheader, 1, sizeof(ivfc_header_romfs), ctx->file);
+		region_read(&ctx->region, sizeof(ivfc_header), &ctx->romfsheader, sizeof(ivfc_header_romfs));
 
 		ctx->levelcount = 3;
 
@@ -82,8 +102,9 @@ void ivfc_process(ivfc_context* ctx, u32 actions)
 
 void ivfc_verify(ivfc_context* ctx, u32 flags)
 {
-	u32 i, j;
-	u32 blockcount;
+	u32 i;
+	u64 j;
+	u64 blockcount;
 
 	for(i=0; i<ctx->levelcount; i++)
 	{
@@ -99,7 +120,7 @@ void ivfc_verify(ivfc_context* ctx, u32 flags)
 		blockcount = level->datasize / level->hashblocksize;
 		if (blockcount * level->hashblocksize != level->datasize)
 		{
-			fprintf(stderr, "Error, IVFC block size mismatch\n");
+			log_error("Error, IVFC block size mismatch");
 			return;
 		}
 
@@ -120,27 +141,26 @@ void ivfc_verify(ivfc_context* ctx, u32 flags)
 	}
 }
 
-void ivfc_read(ivfc_context* ctx, u32 offset, u32 size, u8* buffer)
+void ivfc_read(ivfc_context* ctx, u64 offset, u32 size, u8* buffer)
 {
 	if ( (offset > ctx->size) || (offset+size > ctx->size) )
 	{
-		fprintf(stderr, "Error, IVFC offset out of range (offset=0x%08x, size=0x%08x)\n", offset, size);
+		log_error("Error, IVFC offset out of range (offset=0x%08llx, size=0x%08x)", offset, size);
 		return;
 	}
 
-	fseek(ctx->file, ctx->offset + offset, SEEK_SET);
-	if (size != fread(buffer, 1, size, ctx->file))
+	if (!region_read_raw(&ctx->region, offset, buffer, size))
 	{
-		fprintf(stderr, "Error, IVFC could not read file\n");
+		log_error("Error, IVFC could not read file");
 		return;
 	}
 }
 
-void ivfc_hash(ivfc_context* ctx, u32 offset, u32 size, u8* hash)
+void ivfc_hash(ivfc_context* ctx, u64 offset, u32 size, u8* hash)
 {
 	if (size > IVFC_MAX_BUFFERSIZE)
 	{
-		fprintf(stderr, "Error, IVFC hash block size too big.\n");
+		log_error("Error, IVFC hash block size too big.");
 		return;
 	}
 
@@ -149,6 +169,201 @@ void ivfc_hash(ivfc_context* ctx, u32 offset, u32 size, u8* hash)
 	ctr_sha_256(ctx->buffer, size, hash);
 }
 
+// Checks the IVFC header and master hash against the superblock hash, once
+// per mount, keeping the master hash if they pass. The level layout was
+// worked out from the header before this, so the header hashed must be
+// the one that was parsed.
+static int ivfc_trust_master(ivfc_context* ctx)
+{
+	u64 size = ctx->superblocksize;
+	u32 mastersize = getle32(ctx->romfsheader.masterhashsize);
+	u8* buffer = 0;
+	u8* master = 0;
+	u8 hash[0x20];
+	int state;
+
+	pthread_mutex_lock(&ctx->trustlock);
+	state = ctx->masterstate;
+	pthread_mutex_unlock(&ctx->trustlock);
+	if (state != Unchecked)
+		return state == Good;
+
+	state = Fail;
+	if (size < ctx->level[0].hashoffset + mastersize || size > ctx->size)
+		goto clean;
+
+	buffer = malloc(size);
+	if (buffer == 0 || !region_read_raw(&ctx->region, 0, buffer, size))
+		goto clean;
+	ctr_sha_256(buffer, size, hash);
+	if (memcmp(hash, ctx->superblockhash, 0x20) != 0)
+		goto clean;
+	if (memcmp(buffer, &ctx->header, sizeof(ivfc_header)) != 0 ||
+		memcmp(buffer + sizeof(ivfc_header), &ctx->romfsheader, sizeof(ivfc_header_romfs)) != 0)
+		goto clean;
+
+	master = malloc(mastersize);
+	if (master == 0)
+		goto clean;
+	memcpy(master, buffer + ctx->level[0].hashoffset, mastersize);
+	state = Good;
+
+clean:
+	pthread_mutex_lock(&ctx->trustlock);
+	if (ctx->masterstate == Unchecked)
+	{
+		ctx->master = master;
+		ctx->masterstate = state;
+		master = 0;
+	}
+	state = ctx->masterstate;
+	pthread_mutex_unlock(&ctx->trustlock);
+
+	free(master);
+	free(buffer);
+	return state == Good;
+}
+
+// Whether a level's layout is sane enough to keep a copy of.
+static int ivfc_level_usable(ivfc_context* ctx, ivfc_level* level)
+{
+	return level->hashblocksize != 0 && level->hashblocksize <= IVFC_MAX_BUFFERSIZE &&
+		level->datasize % level->hashblocksize == 0 && level->datasize <= ctx->size;
+}
+
+static int ivfc_trusted_hash(ivfc_context* ctx, u32 index, u64 block, u8 hash[0x20]);
+
+// Checks hash block block of upper level index against the level above it,
+// once per mount, and keeps the checked copy that hashes below it are then
+// taken from.
+static int ivfc_trust_block(ivfc_context* ctx, u32 index, u64 block)
+{
+	ivfc_level* level = ctx->level + index;
+	u64 offset = level->dataoffset + level->hashblocksize * block;
+	u64 blocks = level->datasize / level->hashblocksize;
+	u8 expected[0x20];
+	u8 calchash[0x20];
+	u8* buffer;
+	int ok;
+
+	pthread_mutex_lock(&ctx->trustlock);
+	ok = ctx->trustedmap[index] && (ctx->trustedmap[index][block / 8] >> (block % 8)) & 1;
+	pthread_mutex_unlock(&ctx->trustlock);
+	if (ok)
+		return 1;
+
+	if (!ivfc_trusted_hash(ctx, index, block, expected))
+		return 0;
+
+	// Hash blocks running past the end of the region count as zeros.
+	buffer = calloc(1, level->hashblocksize);
+	if (buffer == 0)
+		return 0;
+	ok = offset >= ctx->size ||
+		region_read_raw(&ctx->region, offset, buffer, ctx->size - offset < level->hashblocksize ? ctx->size - offset : level->hashblocksize);
+	if (ok)
+	{
+		ctr_sha_256(buffer, level->hashblocksize, calchash);
+		ok = memcmp(calchash, expected, 0x20) == 0;
+	}
+
+	if (ok)
+	{
+		pthread_mutex_lock(&ctx->trustlock);
+		if (ctx->trusted[index] == 0)
+		{
+			ctx->trusted[index] = calloc(1, level->datasize);
+			ctx->trustedmap[index] = calloc(1, (blocks + 7) / 8);
+			if (ctx->trusted[index] == 0 || ctx->trustedmap[index] == 0)
+			{
+				free(ctx->trusted[index]);
+				free(ctx->trustedmap[index]);
+				ctx->trusted[index] = 0;
+				ctx->trustedmap[index] = 0;
+				ok = 0;
+			}
+		}
+		if (ok)
+		{
+			memcpy(ctx->trusted[index] + level->hashblocksize * block, buffer, level->hashblocksize);
+			ctx->trustedmap[index][block / 8] |= 1 << (block % 8);
+		}
+		pthread_mutex_unlock(&ctx->trustlock);
+	}
+
+	free(buffer);
+	return ok;
+}
+
+// Gets the hash that hash block block of level index must match, from the
+// master hash for the first level and from a checked copy of the level
+// above for the others.
+static int ivfc_trusted_hash(ivfc_context* ctx, u32 index, u64 block, u8 hash[0x20])
+{
+	ivfc_level* level = ctx->level + index;
+	ivfc_level* parent;
+	u64 position;
+
+	if (index == 0)
+	{
+		if (!ivfc_trust_master(ctx))
+			return 0;
+		if (block >= getle32(ctx->romfsheader.masterhashsize) / 0x20)
+			return 0;
+		memcpy(hash, ctx->master + 0x20 * block, 0x20);
+		return 1;
+	}
+
+	parent = level - 1;
+	position = level->hashoffset + 0x20 * block;
+	if (!ivfc_level_usable(ctx, parent) || position < parent->dataoffset || position + 0x20 > parent->dataoffset + parent->datasize)
+		return 0;
+	position -= parent->dataoffset;
+	if (!ivfc_trust_block(ctx, index - 1, position / parent->hashblocksize))
+		return 0;
+
+	pthread_mutex_lock(&ctx->trustlock);
+	memcpy(hash, ctx->trusted[index - 1] + position, 0x20);
+	pthread_mutex_unlock(&ctx->trustlock);
+	return 1;
+}
+
+// Checks data at offset against the hashes of the last level, which are
+// themselves checked level by level up to the superblock hash, so a block
+// that passes is what the NCCH header vouches for. With data == 0, only
+// reports whether the range is made of whole hash blocks of that level.
+int ivfc_verify_block(ivfc_context* ctx, u64 offset, const u8* data, u32 size)
+{
+	ivfc_level* level;
+	u8 calchash[32];
+	u8 testhash[32];
+	u64 block;
+	u32 i;
+
+	if (ctx->levelcount == 0)
+		return 0;
+
+	level = ctx->level + ctx->levelcount - 1;
+	if (offset < level->dataoffset || offset + size > level->dataoffset + level->datasize)
+		return 0;
+	if ((offset - level->dataoffset) % level->hashblocksize || size % level->hashblocksize)
+		return 0;
+	if (data == 0)
+		return 1;
+
+	block = (offset - level->dataoffset) / level->hashblocksize;
+	for(i=0; i<size; i+=level->hashblocksize, block++)
+	{
+		ctr_sha_256(data + i, level->hashblocksize, calchash);
+		if (!ivfc_trusted_hash(ctx, ctx->levelcount - 1, block, testhash))
+			return 0;
+		if (memcmp(calchash, testhash, 0x20) != 0)
+			return 0;
+	}
+
+	return 1;
+}
+
 void ivfc_print(ivfc_context* ctx)
 {
 	u32 i;
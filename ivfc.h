@@ -1,8 +1,11 @@
 #ifndef __IVFC_H__
 #define __IVFC_H__
 
+#include <pthread.h>
+
 #include "types.h"
 #include "settings.h"
+#include "region.h"
 
 #define IVFC_MAX_LEVEL 4
 #define IVFC_MAX_BUFFERSIZE 0x4000
@@ -43,9 +46,10 @@ typedef struct
 typedef struct
 {
 	FILE* file;
-	u32 offset;
-	u32 size;
+	u64 offset;
+	u64 size;
 	settings* usersettings;
+	region_context region;
 
 	ivfc_header header;
 	ivfc_header_romfs romfsheader;
@@ -55,18 +59,31 @@ typedef struct
 	u64 bodyoffset;
 	u64 bodysize;
 	u8 buffer[IVFC_MAX_BUFFERSIZE];
+
+	// The NCCH header's hash of the IVFC header and master hash, and what
+	// has been checked against it so far, kept for the mount.
+	u8 superblockhash[0x20];
+	u64 superblocksize;
+	int masterstate;				// Unchecked, Good or Fail
+	u8* master;
+	u8* trusted[IVFC_MAX_LEVEL];	// checked copies of the upper levels
+	u8* trustedmap[IVFC_MAX_LEVEL];	// a bit per hash block in trusted
+	pthread_mutex_t trustlock;
 } ivfc_context;
 
 void ivfc_init(ivfc_context* ctx);
 void ivfc_process(ivfc_context* ctx, u32 actions);
-void ivfc_set_offset(ivfc_context* ctx, u32 offset);
-void ivfc_set_size(ivfc_context* ctx, u32 size);
+void ivfc_set_offset(ivfc_context* ctx, u64 offset);
+void ivfc_set_size(ivfc_context* ctx, u64 size);
 void ivfc_set_file(ivfc_context* ctx, FILE* file);
+void ivfc_set_region(ivfc_context* ctx, region_context* region);
+void ivfc_set_superblock(ivfc_context* ctx, const u8 hash[0x20], u64 size);
 void ivfc_set_usersettings(ivfc_context* ctx, settings* usersettings);
 void ivfc_verify(ivfc_context* ctx, u32 flags);
 void ivfc_print(ivfc_context* ctx);
 
-void ivfc_read(ivfc_context* ctx, u32 offset, u32 size, u8* buffer);
-void ivfc_hash(ivfc_context* ctx, u32 offset, u32 size, u8* hash);
+void ivfc_read(ivfc_context* ctx, u64 offset, u32 size, u8* buffer);
+void ivfc_hash(ivfc_context* ctx, u64 offset, u32 size, u8* hash);
+int ivfc_verify_block(ivfc_context* ctx, u64 offset, const u8* data, u32 size);
 
 #endif // __IVFC_H__
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <time.h>
+#ifndef _WIN32
+#include <syslog.h>
+#endif
+
+#include "types.h"
+#include "log.h"
+
+static const char* levelnames[] =
+{
+	"error",
+	"warning",
+	"info",
+	"debug",
+};
+
+static void log_sink_stderr(int level, const char* message, void* arg);
+
+int log_level = LOG_LEVEL_WARN;
+
+static log_sink sink = log_sink_stderr;
+static void* sinkarg = 0;
+
+void log_set_level(int level)
+{
+	log_level = level;
+}
+
+// Accepts a level name ("error", "warning", ...) or its number.
+int log_parse_level(const char* name)
+{
+	int i;
+
+	for(i=0; i<=LOG_LEVEL_DEBUG; i++)
+	{
+		if (strcasecmp(name, levelnames[i]) == 0)
+			return i;
+	}
+	if (strcasecmp(name, "warn") == 0)
+		return LOG_LEVEL_WARN;
+	if (name[0] >= '0' && name[0] <= '9')
+		return atoi(name);
+	return -1;
+}
+
+void log_set_sink(log_sink newsink, void* arg)
+{
+	sink = newsink;
+	sinkarg = arg;
+}
+
+static void log_sink_stderr(int level, const char* message, void* arg)
+{
+	FILE* fp = arg? (FILE*)arg : stderr;
+
+	fprintf(fp, "ctrfuse: %s: %s\n", levelnames[level], message);
+	if (fp != stderr)
+		fflush(fp);
+}
+
+#ifndef _WIN32
+static void log_sink_syslog(int level, const char* message, void* arg)
+{
+	static const int priorities[] = { LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG };
+
+	syslog(priorities[level], "%s", message);
+}
+#endif
+
+// Sends messages to path, or to syslog if path is "syslog".
+int log_set_file(const char* path)
+{
+	FILE* fp;
+
+#ifndef _WIN32
+	if (strcmp(path, "syslog") == 0)
+	{
+		openlog("ctrfuse", LOG_PID, LOG_USER);
+		log_set_sink(log_sink_syslog, 0);
+		return 1;
+	}
+#endif
+
+	fp = fopen(path, "a");
+	if (fp == 0)
+		return 0;
+
+	log_set_sink(log_sink_stderr, fp);
+	return 1;
+}
+
+int log_ratelimit_allow(log_ratelimit* rl, u32* suppressed)
+{
+	u64 window = (u64)time(0) / LOG_RATELIMIT_INTERVAL;
+
+	*suppressed = 0;
+	if (__atomic_load_n(&rl->window, __ATOMIC_RELAXED) != window)
+	{
+		__atomic_store_n(&rl->window, window, __ATOMIC_RELAXED);
+		__atomic_store_n(&rl->count, 0, __ATOMIC_RELAXED);
+		*suppressed = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+	}
+
+	if (__atomic_fetch_add(&rl->count, 1, __ATOMIC_RELAXED) < LOG_RATELIMIT_BURST)
+		return 1;
+
+	__atomic_fetch_add(&rl->suppressed, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void log_printf(int level, u32 suppressed, const char* fmt, ...)
+{
+	char message[1024];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(message, sizeof(message), fmt, ap);
+	va_end(ap);
+
+	if (len >= 0 && suppressed && (size_t)len < sizeof(message))
+		snprintf(message + len, sizeof(message) - len, " (%u similar messages suppressed)", suppressed);
+
+	sink(level, message, sinkarg);
+}
@@ -0,0 +1,79 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include "types.h"
+
+#define LOG_LEVEL_ERROR		0
+#define LOG_LEVEL_WARN		1
+#define LOG_LEVEL_INFO		2
+#define LOG_LEVEL_DEBUG		3
+
+// Messages above LOG_MAX_LEVEL are compiled out entirely.
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL		LOG_LEVEL_INFO
+#endif
+
+// Each call site may emit LOG_RATELIMIT_BURST messages per
+// LOG_RATELIMIT_INTERVAL seconds; the rest are counted and reported later.
+#define LOG_RATELIMIT_BURST		10
+#define LOG_RATELIMIT_INTERVAL	5
+
+typedef void (*log_sink)(int level, const char* message, void* arg);
+
+typedef struct
+{
+	u64 window;
+	u32 count;
+	u32 suppressed;
+} log_ratelimit;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int log_level;
+
+void log_set_level(int level);
+int  log_parse_level(const char* name);
+void log_set_sink(log_sink sink, void* arg);
+int  log_set_file(const char* path);
+int  log_ratelimit_allow(log_ratelimit* rl, u32* suppressed);
+void log_printf(int level, u32 suppressed, const char* fmt, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 3, 4)))
+#endif
+	;
+
+#ifdef __cplusplus
+}
+#endif
+
+#define log_message(level, ...) \
+	do { \
+		static log_ratelimit log_rl_; \
+		u32 log_suppressed_; \
+		if ((level) <= log_level && log_ratelimit_allow(&log_rl_, &log_suppressed_)) \
+			log_printf(level, log_suppressed_, __VA_ARGS__); \
+	} while (0)
+
+#define log_error(...)	log_message(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_WARN
+#define log_warn(...)	log_message(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define log_warn(...)	do { } while (0)
+#endif
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_INFO
+#define log_info(...)	log_message(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define log_info(...)	do { } while (0)
+#endif
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_DEBUG
+#define log_debug(...)	log_message(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...)	do { } while (0)
+#endif
+
+#endif // _LOG_H_
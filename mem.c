@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "types.h"
+#include "mem.h"
+#include "stats.h"
+#include "log.h"
+
+typedef struct
+{
+	mem_evictor evict;
+	void* arg;
+} mem_evictor_entry;
+
+// Parsed metadata that can be rebuilt from the image is charged here. Once
+// it passes the limit, a trimmer thread calls the evictors in the order
+// they were registered until usage is back under MEM_TARGET.
+static u64 limit;
+static u64 used;
+static mem_evictor_entry evictors[MEM_MAX_EVICTORS];
+static u32 evictorcount;
+static int started;
+static int stopping;
+static int wanted;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+
+// Readers of evictable data run inside a read section and take no locks.
+// Evicting unlinks the data first, then mem_synchronize flips the epoch
+// and waits for the sections counted under the old one, after which
+// nothing can still be looking at it.
+static u32 epoch;
+static u32 readers[2];
+static pthread_mutex_t synclock = PTHREAD_MUTEX_INITIALIZER;
+
+// A limit of 0 means no limit.
+void mem_init(u64 size)
+{
+	limit = size;
+}
+
+void mem_register(mem_evictor evict, void* arg)
+{
+	if (evictorcount == MEM_MAX_EVICTORS)
+		return;
+	evictors[evictorcount].evict = evict;
+	evictors[evictorcount].arg = arg;
+	evictorcount++;
+}
+
+u64 mem_used(void)
+{
+	return __atomic_load_n(&used, __ATOMIC_RELAXED);
+}
+
+void mem_charge(s64 bytes)
+{
+	u64 now = __atomic_add_fetch(&used, bytes, __ATOMIC_RELAXED);
+
+	stats_add(STATS_MEMORY, bytes);
+	if (limit == 0 || now <= limit || !started)
+		return;
+
+	pthread_mutex_lock(&lock);
+	if (!wanted)
+	{
+		wanted = 1;
+		pthread_cond_signal(&wakeup);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+int mem_read_begin(void)
+{
+	for(;;)
+	{
+		int current = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST) & 1;
+
+		__atomic_add_fetch(&readers[current], 1, __ATOMIC_SEQ_CST);
+		if ((__atomic_load_n(&epoch, __ATOMIC_SEQ_CST) & 1) == current)
+			return current;
+		// The epoch flipped under us; count ourselves in the new one.
+		__atomic_sub_fetch(&readers[current], 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+void mem_read_end(int current)
+{
+	__atomic_sub_fetch(&readers[current], 1, __ATOMIC_RELEASE);
+}
+
+// Waits until every read section that started before the call has ended.
+// Must not be called from inside one.
+void mem_synchronize(void)
+{
+	struct timespec pause = { 0, 50000 };
+	int old;
+
+	pthread_mutex_lock(&synclock);
+	old = __atomic_fetch_add(&epoch, 1, __ATOMIC_SEQ_CST) & 1;
+	while(__atomic_load_n(&readers[old], __ATOMIC_ACQUIRE) != 0)
+		nanosleep(&pause, 0);
+	pthread_mutex_unlock(&synclock);
+}
+
+static void mem_trim(void)
+{
+	u64 target = MEM_TARGET(limit);
+	u64 freed = 0;
+	u32 i;
+
+	for(i=0; i<evictorcount && mem_used() > target; i++)
+		freed += evictors[i].evict(evictors[i].arg, mem_used() - target);
+
+	if (freed)
+	{
+		stats_add(STATS_MEMORY_EVICTED, freed);
+		log_debug("trimmed %llu bytes of metadata, %llu left", freed, mem_used());
+	}
+}
+
+static void* mem_worker(void* unused)
+{
+	pthread_mutex_lock(&lock);
+	for(;;)
+	{
+		while(!wanted && !stopping)
+			pthread_cond_wait(&wakeup, &lock);
+		if (stopping)
+			break;
+
+		pthread_mutex_unlock(&lock);
+		mem_trim();
+		pthread_mutex_lock(&lock);
+		wanted = 0;
+	}
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+// Starts the trimmer, after FUSE has daemonized. Anything charged before
+// then is trimmed straight away if it is already over the limit.
+void mem_start(void)
+{
+	if (limit == 0 || evictorcount == 0)
+		return;
+
+	pthread_mutex_lock(&lock);
+	if (pthread_create(&thread, 0, mem_worker, 0) == 0)
+		started = 1;
+	else
+		log_warn("could not start memory trimmer");
+	wanted = started && mem_used() > limit;
+	pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&lock);
+}
+
+void mem_stop(void)
+{
+	int joinable;
+
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	joinable = started;
+	pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&lock);
+
+	if (joinable)
+		pthread_join(thread, 0);
+	started = 0;
+}
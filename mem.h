@@ -0,0 +1,30 @@
+#ifndef _MEM_H_
+#define _MEM_H_
+
+#include "types.h"
+
+#define MEM_MAX_EVICTORS		4
+#define MEM_TARGET(limit)		((limit) / 8 * 7)	// trim down to this once over
+
+// Frees up to want bytes of rebuildable data, returning how much it freed.
+typedef u64 (*mem_evictor)(void* arg, u64 want);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void mem_init(u64 limit);
+void mem_register(mem_evictor evict, void* arg);
+void mem_start(void);
+void mem_stop(void);
+void mem_charge(s64 bytes);
+u64  mem_used(void);
+int  mem_read_begin(void);
+void mem_read_end(int epoch);
+void mem_synchronize(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _MEM_H_
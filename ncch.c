@@ -1,13 +1,15 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include "types.h"
 #include "ncch.h"
 #include "utils.h"
+#include "log.h"
 #include "ctr.h"
 #include "settings.h"
 
-static int programid_is_system(u8 programid[8])
+static int programid_is_system(const u8 programid[8])
 {
 	u32 hiprogramid = getle32(programid+4);
 	
@@ -21,6 +23,7 @@ static int programid_is_system(u8 programid[8])
 void ncch_init(ncch_context* ctx)
 {
 	memset(ctx, 0, sizeof(ncch_context));
+	pthread_mutex_init(&ctx->loadlock, 0);
 	exefs_init(&ctx->exefs);
 	romfs_init(&ctx->romfs);
 }
@@ -30,12 +33,12 @@ void ncch_set_usersettings(ncch_context* ctx, settings* usersettings)
 	ctx->usersettings = usersettings;
 }
 
-void ncch_set_offset(ncch_context* ctx, u32 offset)
+void ncch_set_offset(ncch_context* ctx, u64 offset)
 {
 	ctx->offset = offset;
 }
 
-void ncch_set_size(ncch_context* ctx, u32 size)
+void ncch_set_size(ncch_context* ctx, u64 size)
 {
 	ctx->size = size;
 }
@@ -45,11 +48,16 @@ void ncch_set_file(ncch_context* ctx, FILE* file)
 	ctx->file = file;
 }
 
+void ncch_set_reader(ncch_context* ctx, reader_context* reader)
+{
+	ctx->reader = reader;
+}
+
 void ncch_get_counter(ncch_context* ctx, u8 counter[16], u8 type)
 {
-	u32 version = getle16(ctx->header.version);
+	u32 version = getle16(ctx->header->version);
 	u32 mediaunitsize = ncch_get_mediaunit_size(ctx);
-	u8* partitionid = ctx->header.partitionid;
+	const u8* partitionid = ctx->header->partitionid;
 	u32 i;
 	u32 x = 0;
 
@@ -66,9 +74,9 @@ void ncch_get_counter(ncch_context* ctx, u8 counter[16], u8 type)
 		if (type == NCCHTYPE_EXHEADER)
 			x = 0x200;
 		else if (type == NCCHTYPE_EXEFS)
-			x = getle32(ctx->header.exefsoffset) * mediaunitsize;
+			x = getle32(ctx->header->exefsoffset) * mediaunitsize;
 		else if (type == NCCHTYPE_ROMFS)
-			x = getle32(ctx->header.romfsoffset) * mediaunitsize;
+			x = getle32(ctx->header->romfsoffset) * mediaunitsize;
 
 		for(i=0; i<8; i++)
 			counter[i] = partitionid[i];
@@ -81,8 +89,8 @@ void ncch_get_counter(ncch_context* ctx, u8 counter[16], u8 type)
 
 int ncch_extract_prepare(ncch_context* ctx, u32 type, u32 flags)
 {
-	u32 offset = 0;
-	u32 size = 0;
+	u64 offset = 0;
+	u64 size = 0;
 	u8 counter[16];
 
 
@@ -111,7 +119,7 @@ int ncch_extract_prepare(ncch_context* ctx, u32 type, u32 flags)
 	
 		default:
 		{
-			fprintf(stderr, "Error invalid NCCH type\n");
+			log_error("Error invalid NCCH type");
 			goto clean;
 		}
 		break;
@@ -119,7 +127,7 @@ int ncch_extract_prepare(ncch_context* ctx, u32 type, u32 flags)
 
 	ctx->extractsize = size;
 	ctx->extractflags = flags;
-	fseek(ctx->file, offset, SEEK_SET);
+	fseeko(ctx->file, offset, SEEK_SET);
 	ncch_get_counter(ctx, counter, type);
 	ctr_init_counter(&ctx->aes, ctx->key, counter);
 
@@ -133,7 +141,7 @@ int ncch_extract_buffer(ncch_context* ctx, u8* buffer, u32 buffersize, u32* outs
 {
 	u32 max = buffersize;
 
-	if (max > ctx->extractsize)
+	if ((u64)max > ctx->extractsize)
 		max = ctx->extractsize;
 
 	*outsize = max;
@@ -142,7 +150,7 @@ int ncch_extract_buffer(ncch_context* ctx, u8* buffer, u32 buffersize, u32* outs
 	{
 		if (max != fread(buffer, 1, max, ctx->file))
 		{
-			fprintf(stdout, "Error reading input file\n");
+			log_error("Error reading input file");
 			goto clean;
 		}
 
@@ -181,7 +189,7 @@ void ncch_save(ncch_context* ctx, u32 type, u32 flags)
 	fout = fopen(path->pathname, "wb");
 	if (0 == fout)
 	{
-		fprintf(stdout, "Error opening out file %s\n", path->pathname);
+		log_error("Error opening out file %s", path->pathname);
 		goto clean;
 	}
 
@@ -204,7 +212,7 @@ void ncch_save(ncch_context* ctx, u32 type, u32 flags)
 
 		if (max != fwrite(buffer, 1, max, fout))
 		{
-			fprintf(stdout, "Error writing output file\n");
+			log_error("Error writing output file");
 			goto clean;
 		}
 	}
@@ -217,9 +225,9 @@ clean:
 void ncch_verify(ncch_context* ctx, u32 flags)
 {
 	u32 mediaunitsize = ncch_get_mediaunit_size(ctx);
-	u32 exefshashregionsize = getle32(ctx->header.exefshashregionsize) * mediaunitsize;
-	u32 romfshashregionsize = getle32(ctx->header.romfshashregionsize) * mediaunitsize;
-	u32 exheaderhashregionsize = getle32(ctx->header.extendedheadersize);
+	u32 exefshashregionsize = getle32(ctx->header->exefshashregionsize) * mediaunitsize;
+	u32 romfshashregionsize = getle32(ctx->header->romfshashregionsize) * mediaunitsize;
+	u32 exheaderhashregionsize = getle32(ctx->header->extendedheadersize);
 	u8* exefshashregion = 0;
 	u8* romfshashregion = 0;
 	u8* exheaderhashregion = 0;
@@ -235,7 +243,7 @@ void ncch_verify(ncch_context* ctx, u32 flags)
 
 	if (ctx->usersettings)
 	{
-		if ( (ctx->header.flags[5] & 3) == 1)
+		if ( (ctx->header->flags[5] & 3) == 1)
 			ctx->headersigcheck = ncch_signature_verify(ctx, &ctx->usersettings->keys.ncchrsakey);
 		else 
 		{
@@ -250,7 +258,7 @@ void ncch_verify(ncch_context* ctx, u32 flags)
 			goto clean;
 		if (0 == ncch_extract_buffer(ctx, exefshashregion, exefshashregionsize, &exefshashregionsize))
 			goto clean;
-		ctx->exefshashcheck = ctr_sha_256_verify(exefshashregion, exefshashregionsize, ctx->header.exefssuperblockhash);
+		ctx->exefshashcheck = ctr_sha_256_verify(exefshashregion, exefshashregionsize, ctx->header->exefssuperblockhash);
 	}
 	if (romfshashregionsize)
 	{
@@ -258,7 +266,7 @@ void ncch_verify(ncch_context* ctx, u32 flags)
 			goto clean;
 		if (0 == ncch_extract_buffer(ctx, romfshashregion, romfshashregionsize, &romfshashregionsize))
 			goto clean;
-		ctx->romfshashcheck = ctr_sha_256_verify(romfshashregion, romfshashregionsize, ctx->header.romfssuperblockhash);
+		ctx->romfshashcheck = ctr_sha_256_verify(romfshashregion, romfshashregionsize, ctx->header->romfssuperblockhash);
 	}
 	if (exheaderhashregionsize)
 	{
@@ -266,7 +274,7 @@ void ncch_verify(ncch_context* ctx, u32 flags)
 			goto clean;
 		if (0 == ncch_extract_buffer(ctx, exheaderhashregion, exheaderhashregionsize, &exheaderhashregionsize))
 			goto clean;
-		ctx->exheaderhashcheck = ctr_sha_256_verify(exheaderhashregion, exheaderhashregionsize, ctx->header.extendedheaderhash);
+		ctx->exheaderhashcheck = ctr_sha_256_verify(exheaderhashregion, exheaderhashregionsize, ctx->header->extendedheaderhash);
 	}
 
 	free(exefshashregion);
@@ -282,19 +290,27 @@ void ncch_process(ncch_context* ctx, u32 actions)
 	u8 exheadercounter[16];
 	u8 exefscounter[16];
 	u8 romfscounter[16];
-	int result = 1;
 
 
-	fseek(ctx->file, ctx->offset, SEEK_SET);
-	fread(&ctx->header, 1, 0x200, ctx->file);
+	ctx->valid = 0;
+	ctx->header = 0;
+	if (ctx->reader)
+		ctx->header = (const ctr_ncchheader*)reader_map(ctx->reader, ctx->offset, sizeof(ctr_ncchheader));
+	if (ctx->header == 0)
+	{
+		fseeko(ctx->file, ctx->offset, SEEK_SET);
+		fread(&ctx->headerbuf, 1, sizeof(ctr_ncchheader), ctx->file);
+		ctx->header = &ctx->headerbuf;
+	}
 
-	if (getle32(ctx->header.magic) != MAGIC_NCCH)
+	if (getle32(ctx->header->magic) != MAGIC_NCCH)
 	{
-		fprintf(stdout, "Error, NCCH segment corrupted\n");
+		log_error("Error, NCCH segment corrupted");
 		return;
 	}
 
 	ncch_determine_key(ctx, actions);
+	ncch_determine_imageid(ctx);
 
 	ncch_get_counter(ctx, exheadercounter, NCCHTYPE_EXHEADER);
 	ncch_get_counter(ctx, exefscounter, NCCHTYPE_EXEFS);
@@ -302,32 +318,46 @@ void ncch_process(ncch_context* ctx, u32 actions)
 
 
 	exheader_set_file(&ctx->exheader, ctx->file);
+	exheader_set_reader(&ctx->exheader, ctx->reader);
 	exheader_set_offset(&ctx->exheader, ncch_get_exheader_offset(ctx) );
 	exheader_set_size(&ctx->exheader, ncch_get_exheader_size(ctx) );
 	exheader_set_usersettings(&ctx->exheader, ctx->usersettings);
-	exheader_set_partitionid(&ctx->exheader, ctx->header.partitionid);
-	exheader_set_programid(&ctx->exheader, ctx->header.programid);
+	exheader_set_partitionid(&ctx->exheader, ctx->header->partitionid);
+	exheader_set_programid(&ctx->exheader, ctx->header->programid);
 	exheader_set_counter(&ctx->exheader, exheadercounter);
 	exheader_set_key(&ctx->exheader, ctx->key);
 	exheader_set_encrypted(&ctx->exheader, ctx->encrypted);
+	exheader_set_imageid(&ctx->exheader, ctx->imageid + NCCHTYPE_EXHEADER);
 
 	exefs_set_file(&ctx->exefs, ctx->file);
+	exefs_set_reader(&ctx->exefs, ctx->reader);
 	exefs_set_offset(&ctx->exefs, ncch_get_exefs_offset(ctx) );
 	exefs_set_size(&ctx->exefs, ncch_get_exefs_size(ctx) );
-	exefs_set_partitionid(&ctx->exefs, ctx->header.partitionid);
+	exefs_set_partitionid(&ctx->exefs, ctx->header->partitionid);
 	exefs_set_usersettings(&ctx->exefs, ctx->usersettings);
 	exefs_set_counter(&ctx->exefs, exefscounter);
 	exefs_set_key(&ctx->exefs, ctx->key);
 	exefs_set_encrypted(&ctx->exefs, ctx->encrypted);
+	exefs_set_imageid(&ctx->exefs, ctx->imageid + NCCHTYPE_EXEFS);
 
 	romfs_set_file(&ctx->romfs, ctx->file);
+	romfs_set_reader(&ctx->romfs, ctx->reader);
 	romfs_set_offset(&ctx->romfs, ncch_get_romfs_offset(ctx) );
 	romfs_set_size(&ctx->romfs, ncch_get_romfs_size(ctx) );
-	//romfs_set_partitionid(&ctx->romfs, ctx->header.partitionid);
+	//romfs_set_partitionid(&ctx->romfs, ctx->header->partitionid);
 	romfs_set_usersettings(&ctx->romfs, ctx->usersettings);
-	//romfs_set_counter(&ctx->romfs, romfscounter);
-	//romfs_set_key(&ctx->romfs, ctx->key);
-	//romfs_set_encrypted(&ctx->romfs, ctx->encrypted);
+	romfs_set_counter(&ctx->romfs, romfscounter);
+	romfs_set_key(&ctx->romfs, ctx->key);
+	romfs_set_encrypted(&ctx->romfs, ctx->encrypted);
+	romfs_set_imageid(&ctx->romfs, ctx->imageid + NCCHTYPE_ROMFS);
+	romfs_set_superblock(&ctx->romfs, ctx->header->romfssuperblockhash, (u64)getle32(ctx->header->romfshashregionsize) * ncch_get_mediaunit_size(ctx));
+
+	// With LazyFlag only the header is parsed here; ncch_load does the rest
+	// when it is first needed.
+	ctx->actions = actions;
+	ctx->valid = 1;
+	if (actions & LazyFlag)
+		return;
 
 	exheader_read(&ctx->exheader, actions);
 
@@ -345,67 +375,132 @@ void ncch_process(ncch_context* ctx, u32 actions)
 		ncch_save(ctx, NCCHTYPE_EXHEADER, actions);
 	}
 
+	ncch_load(ctx, NCCHTYPE_EXEFS);
+	ncch_load(ctx, NCCHTYPE_ROMFS);
+}
 
-	if (result && ncch_get_exheader_size(ctx))
-	{
-		if (!exheader_programid_valid(&ctx->exheader))
-			return;
+// Parses the part of the NCCH behind type, once. ExeFS and RomFS depend on
+// the exheader, which is where a wrong key shows. Called locked.
+static int ncch_load_locked(ncch_context* ctx, u32 type)
+{
+	u32 actions = ctx->actions & ~LazyFlag;
+	int result = 1;
 
-		result = exheader_process(&ctx->exheader, actions);
-	} 
+	if (ctx->loaded & (1 << type))
+		return !(ctx->loadfailed & (1 << type));
 
-	if (result && ncch_get_exheader_size(ctx))
+	// Nothing past the header was set up if it was missing or corrupt.
+	if (!ctx->valid)
 	{
-		exefs_set_compressedflag(&ctx->exefs, exheader_get_compressedflag(&ctx->exheader));
-		exefs_process(&ctx->exefs, actions);
+		ctx->loaded |= 1 << type;
+		ctx->loadfailed |= 1 << type;
+		return 0;
 	}
 
-	if (ncch_get_romfs_size(ctx)) {
-		romfs_process(&ctx->romfs, actions);
+	switch(type)
+	{
+	case NCCHTYPE_EXHEADER:
+		if (ncch_get_exheader_size(ctx))
+		{
+			exheader_read(&ctx->exheader, actions);
+			if (!exheader_programid_valid(&ctx->exheader))
+				result = 0;
+			else
+				result = exheader_process(&ctx->exheader, actions);
+		}
+		break;
+
+	case NCCHTYPE_EXEFS:
+		result = ncch_get_exheader_size(ctx) && ncch_load_locked(ctx, NCCHTYPE_EXHEADER);
+		if (result)
+		{
+			exefs_set_compressedflag(&ctx->exefs, exheader_get_compressedflag(&ctx->exheader));
+			exefs_process(&ctx->exefs, actions);
+		}
+		break;
+
+	case NCCHTYPE_ROMFS:
+		result = ncch_get_romfs_size(ctx) && ncch_load_locked(ctx, NCCHTYPE_EXHEADER);
+		if (result)
+			romfs_process(&ctx->romfs, actions);
+		break;
+
+	default:
+		result = 0;
+		break;
 	}
+
+	ctx->loaded |= 1 << type;
+	if (!result)
+		ctx->loadfailed |= 1 << type;
+	return result;
+}
+
+// Returns 1 once the exheader, ExeFS or RomFS is ready to use. Safe to call
+// from several threads.
+int ncch_load(ncch_context* ctx, u32 type)
+{
+	int result;
+
+	pthread_mutex_lock(&ctx->loadlock);
+	result = ncch_load_locked(ctx, type);
+	pthread_mutex_unlock(&ctx->loadlock);
+	return result;
+}
+
+// Returns 1 if the exheader, ExeFS or RomFS has already been parsed, without
+// parsing it.
+int ncch_is_loaded(ncch_context* ctx, u32 type)
+{
+	int result;
+
+	pthread_mutex_lock(&ctx->loadlock);
+	result = (ctx->loaded & ~ctx->loadfailed & (1 << type)) != 0;
+	pthread_mutex_unlock(&ctx->loadlock);
+	return result;
 }
 
 int ncch_signature_verify(ncch_context* ctx, rsakey2048* key)
 {
 	u8 hash[0x20];
 
-	ctr_sha_256(ctx->header.magic, 0x100, hash);
-	return ctr_rsa_verify_hash(ctx->header.signature, hash, key);
+	ctr_sha_256(ctx->header->magic, 0x100, hash);
+	return ctr_rsa_verify_hash(ctx->header->signature, hash, key);
 }
 
 
-u32 ncch_get_exefs_offset(ncch_context* ctx)
+u64 ncch_get_exefs_offset(ncch_context* ctx)
 {
 	u32 mediaunitsize = ncch_get_mediaunit_size(ctx);
-	return ctx->offset + getle32(ctx->header.exefsoffset) * mediaunitsize;
+	return ctx->offset + (u64)getle32(ctx->header->exefsoffset) * mediaunitsize;
 }
 
-u32 ncch_get_exefs_size(ncch_context* ctx)
+u64 ncch_get_exefs_size(ncch_context* ctx)
 {
 	u32 mediaunitsize = ncch_get_mediaunit_size(ctx);
-	return getle32(ctx->header.exefssize) * mediaunitsize;
+	return (u64)getle32(ctx->header->exefssize) * mediaunitsize;
 }
 
-u32 ncch_get_romfs_offset(ncch_context* ctx)
+u64 ncch_get_romfs_offset(ncch_context* ctx)
 {
 	u32 mediaunitsize = ncch_get_mediaunit_size(ctx);
-	return ctx->offset + getle32(ctx->header.romfsoffset) * mediaunitsize;
+	return ctx->offset + (u64)getle32(ctx->header->romfsoffset) * mediaunitsize;
 }
 
-u32 ncch_get_romfs_size(ncch_context* ctx)
+u64 ncch_get_romfs_size(ncch_context* ctx)
 {
 	u32 mediaunitsize = ncch_get_mediaunit_size(ctx);
-	return getle32(ctx->header.romfssize) * mediaunitsize;
+	return (u64)getle32(ctx->header->romfssize) * mediaunitsize;
 }
 
-u32 ncch_get_exheader_offset(ncch_context* ctx)
+u64 ncch_get_exheader_offset(ncch_context* ctx)
 {
 	return ctx->offset + 0x200;
 }
 
 u32 ncch_get_exheader_size(ncch_context* ctx)
 {
-	return getle32(ctx->header.extendedheadersize);
+	return getle32(ctx->header->extendedheadersize);
 }
 
 u32 ncch_get_mediaunit_size(ncch_context* ctx)
@@ -414,22 +509,39 @@ u32 ncch_get_mediaunit_size(ncch_context* ctx)
 
 	if (mediaunitsize == 0)
 	{
-		unsigned short version = getle16(ctx->header.version);
+		unsigned short version = getle16(ctx->header->version);
 		if (version == 1)
 			mediaunitsize = 1;
 		else if (version == 2 || version == 0)
-			mediaunitsize = 1 << (ctx->header.flags[6] + 9);
+			mediaunitsize = 1 << (ctx->header->flags[6] + 9);
 	}
 
 	return mediaunitsize;
 }
 
 
+// Derives an id for the decrypted contents from the header, which pins the
+// exheader, ExeFS and RomFS through their superblock hashes, and the key.
+void ncch_determine_imageid(ncch_context* ctx)
+{
+	ctr_sha256_context sha;
+	u8 hash[0x20];
+
+	ctr_sha_256_init(&sha);
+	ctr_sha_256_update(&sha, (const u8*)ctx->header, sizeof(ctr_ncchheader));
+	ctr_sha_256_update(&sha, ctx->key, 16);
+	ctr_sha_256_update(&sha, (u8*)&ctx->encrypted, sizeof(ctx->encrypted));
+	ctr_sha_256_finish(&sha, hash);
+
+	ctx->imageid = getle64(hash);
+}
+
 void ncch_determine_key(ncch_context* ctx, u32 actions)
 {
-	exheader_header exheader;
+	region_context region;
+	u8 programid[8];
 	u8* key = settings_get_ncch_key(ctx->usersettings);
-	ctr_ncchheader* header = &ctx->header;
+	const ctr_ncchheader* header = ctx->header;
 
 	ctx->encrypted = 0;
 	memset(ctx->key, 0, 0x10);
@@ -449,12 +561,14 @@ void ncch_determine_key(ncch_context* ctx, u32 actions)
 		
 
 		// Firstly, check if the NCCH is already decrypted, by reading the programid in the exheader
-		// Otherwise, use determination rules
-		fseek(ctx->file, ncch_get_exheader_offset(ctx), SEEK_SET);
-		memset(&exheader, 0, sizeof(exheader));
-		fread(&exheader, 1, sizeof(exheader), ctx->file);
-
-		if (!memcmp(exheader.arm11systemlocalcaps.programid, ctx->header.programid, 8))
+		// Otherwise, use determination rules. Only the programid is read; the
+		// rest of the exheader waits until it is needed.
+		region_init(&region, ctx->file, ncch_get_exheader_offset(ctx), sizeof(exheader_header));
+		region_set_reader(&region, ctx->reader);
+		memset(programid, 0, sizeof(programid));
+		region_read_raw(&region, offsetof(exheader_header, arm11systemlocalcaps.programid), programid, sizeof(programid));
+
+		if (!memcmp(programid, ctx->header->programid, 8))
 		{
 			// program id's match, so it's probably not encrypted
 			ctx->encrypted = 0;
@@ -471,7 +585,7 @@ void ncch_determine_key(ncch_context* ctx, u32 actions)
 				ctx->encrypted = 1;
 				key = settings_get_ncch_fixedsystemkey(ctx->usersettings);
 				if (!key)
-					fprintf(stdout, "Warning, could not read system fixed key.\n");
+					log_warn("Warning, could not read system fixed key.");
 				else
 					memcpy(ctx->key, key, 0x10);
 			}
@@ -485,7 +599,7 @@ void ncch_determine_key(ncch_context* ctx, u32 actions)
 		else
 		{
 			// secure key (cannot decrypt!)
-			fprintf(stdout, "Warning, could not read secure key.\n");
+			log_warn("Warning, could not read secure key.");
 			ctx->encrypted = 1;
 			memset(ctx->key, 0, 0x10);
 		}
@@ -527,9 +641,9 @@ void ncch_print(ncch_context* ctx, FILE* fp)
 {
 	char magic[5];
 	char productcode[0x11];
-	ctr_ncchheader *header = &ctx->header;
-	u32 offset = ctx->offset;
-	u32 mediaunitsize = ncch_get_mediaunit_size(ctx);
+	const ctr_ncchheader *header = ctx->header;
+	u64 offset = ctx->offset;
+	u64 mediaunitsize = ncch_get_mediaunit_size(ctx);
 
 
 	fprintf(fp, "\nNCCH:\n");
@@ -545,7 +659,7 @@ void ncch_print(ncch_context* ctx, FILE* fp)
 		memdump(fp, "Signature (GOOD):       ", header->signature, 0x100);
 	else
 		memdump(fp, "Signature (FAIL):       ", header->signature, 0x100);
-	fprintf(fp, "Content size:           0x%08x\n", getle32(header->contentsize)*mediaunitsize);
+	fprintf(fp, "Content size:           0x%08llx\n", getle32(header->contentsize)*mediaunitsize);
 	fprintf(fp, "Partition id:           %016llx\n", getle64(header->partitionid));
 	fprintf(fp, "Maker code:             %04x\n", getle16(header->makercode));
 	fprintf(fp, "Version:                %04x\n", getle16(header->version));
@@ -560,7 +674,7 @@ void ncch_print(ncch_context* ctx, FILE* fp)
 	else
 		memdump(fp, "Exheader hash (FAIL):   ", header->extendedheaderhash, 0x20);
 	fprintf(fp, "Flags:                  %016llx\n", getle64(header->flags));
-	fprintf(fp, " > Mediaunit size:      0x%x\n", mediaunitsize);
+	fprintf(fp, " > Mediaunit size:      0x%llx\n", mediaunitsize);
 	if (header->flags[7] & 4)
 		fprintf(fp, " > Crypto key:          None\n");
 	else if (header->flags[7] & 1)
@@ -575,14 +689,14 @@ void ncch_print(ncch_context* ctx, FILE* fp)
 		fprintf(fp, " > No RomFS mount\n");
 
 
-	fprintf(fp, "Plain region offset:    0x%08x\n", getle32(header->plainregionsize)? offset+getle32(header->plainregionoffset)*mediaunitsize : 0);
-	fprintf(fp, "Plain region size:      0x%08x\n", getle32(header->plainregionsize)*mediaunitsize);
-	fprintf(fp, "ExeFS offset:           0x%08x\n", getle32(header->exefssize)? offset+getle32(header->exefsoffset)*mediaunitsize : 0);
-	fprintf(fp, "ExeFS size:             0x%08x\n", getle32(header->exefssize)*mediaunitsize);
-	fprintf(fp, "ExeFS hash region size: 0x%08x\n", getle32(header->exefshashregionsize)*mediaunitsize);
-	fprintf(fp, "RomFS offset:           0x%08x\n", getle32(header->romfssize)? offset+getle32(header->romfsoffset)*mediaunitsize : 0);
-	fprintf(fp, "RomFS size:             0x%08x\n", getle32(header->romfssize)*mediaunitsize);
-	fprintf(fp, "RomFS hash region size: 0x%08x\n", getle32(header->romfshashregionsize)*mediaunitsize);
+	fprintf(fp, "Plain region offset:    0x%08llx\n", getle32(header->plainregionsize)? offset+getle32(header->plainregionoffset)*mediaunitsize : 0);
+	fprintf(fp, "Plain region size:      0x%08llx\n", getle32(header->plainregionsize)*mediaunitsize);
+	fprintf(fp, "ExeFS offset:           0x%08llx\n", getle32(header->exefssize)? offset+getle32(header->exefsoffset)*mediaunitsize : 0);
+	fprintf(fp, "ExeFS size:             0x%08llx\n", getle32(header->exefssize)*mediaunitsize);
+	fprintf(fp, "ExeFS hash region size: 0x%08llx\n", getle32(header->exefshashregionsize)*mediaunitsize);
+	fprintf(fp, "RomFS offset:           0x%08llx\n", getle32(header->romfssize)? offset+getle32(header->romfsoffset)*mediaunitsize : 0);
+	fprintf(fp, "RomFS size:             0x%08llx\n", getle32(header->romfssize)*mediaunitsize);
+	fprintf(fp, "RomFS hash region size: 0x%08llx\n", getle32(header->romfshashregionsize)*mediaunitsize);
 	if (ctx->exefshashcheck == Unchecked)
 		memdump(fp, "ExeFS Hash:             ", header->exefssuperblockhash, 0x20);
 	else if (ctx->exefshashcheck == Good)
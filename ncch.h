@@ -2,6 +2,7 @@
 #define _NCCH_H_
 
 #include <stdio.h>
+#include <pthread.h>
 #include "types.h"
 #include "keyset.h"
 #include "filepath.h"
@@ -54,12 +55,15 @@ typedef struct
 typedef struct
 {
 	FILE* file;
+	reader_context* reader;
 	u8 key[16];
 	u32 encrypted;
-	u32 offset;
-	u32 size;
+	u64 imageid;
+	u64 offset;
+	u64 size;
 	settings* usersettings;
-	ctr_ncchheader header;
+	const ctr_ncchheader* header;	// into the mapped image, or headerbuf
+	ctr_ncchheader headerbuf;
 	ctr_aes_context aes;
 	exefs_context exefs;
 	romfs_context romfs;
@@ -68,21 +72,29 @@ typedef struct
 	int romfshashcheck;
 	int exheaderhashcheck;
 	int headersigcheck;
-	u32 extractsize;
+	u64 extractsize;
 	u32 extractflags;
+	u32 actions;
+	pthread_mutex_t loadlock;
+	u32 loaded;			// bit per NCCHTYPE_ parsed so far
+	u32 loadfailed;
+	int valid;			// header checked and the parts set up by ncch_process
 } ncch_context;
 
 void ncch_init(ncch_context* ctx);
 void ncch_process(ncch_context* ctx, u32 actions);
-void ncch_set_offset(ncch_context* ctx, u32 offset);
-void ncch_set_size(ncch_context* ctx, u32 size);
+int ncch_load(ncch_context* ctx, u32 type);
+int ncch_is_loaded(ncch_context* ctx, u32 type);
+void ncch_set_offset(ncch_context* ctx, u64 offset);
+void ncch_set_size(ncch_context* ctx, u64 size);
 void ncch_set_file(ncch_context* ctx, FILE* file);
+void ncch_set_reader(ncch_context* ctx, reader_context* reader);
 void ncch_set_usersettings(ncch_context* ctx, settings* usersettings);
-u32 ncch_get_exefs_offset(ncch_context* ctx);
-u32 ncch_get_exefs_size(ncch_context* ctx);
-u32 ncch_get_romfs_offset(ncch_context* ctx);
-u32 ncch_get_romfs_size(ncch_context* ctx);
-u32 ncch_get_exheader_offset(ncch_context* ctx);
+u64 ncch_get_exefs_offset(ncch_context* ctx);
+u64 ncch_get_exefs_size(ncch_context* ctx);
+u64 ncch_get_romfs_offset(ncch_context* ctx);
+u64 ncch_get_romfs_size(ncch_context* ctx);
+u64 ncch_get_exheader_offset(ncch_context* ctx);
 u32 ncch_get_exheader_size(ncch_context* ctx);
 void ncch_print(ncch_context* ctx, FILE* file);
 int ncch_signature_verify(ncch_context* ctx, rsakey2048* key);
@@ -93,4 +105,5 @@ int ncch_extract_buffer(ncch_context* ctx, u8* buffer, u32 buffersize, u32* outs
 u32 ncch_get_mediaunit_size(ncch_context* ctx);
 void ncch_get_counter(ncch_context* ctx, u8 counter[16], u8 type);
 void ncch_determine_key(ncch_context* ctx, u32 actions);
+void ncch_determine_imageid(ncch_context* ctx);
 #endif // _NCCH_H_
@@ -1,9 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "types.h"
 #include "ncsd.h"
 #include "utils.h"
+#include "log.h"
 #include "ctr.h"
 
 
@@ -12,7 +14,7 @@ void ncsd_init(ncsd_context* ctx)
 	memset(ctx, 0, sizeof(ncsd_context));
 }
 
-void ncsd_set_offset(ncsd_context* ctx, u32 offset)
+void ncsd_set_offset(ncsd_context* ctx, u64 offset)
 {
 	ctx->offset = offset;
 }
@@ -22,7 +24,12 @@ void ncsd_set_file(ncsd_context* ctx, FILE* file)
 	ctx->file = file;
 }
 
-void ncsd_set_size(ncsd_context* ctx, u32 size)
+void ncsd_set_reader(ncsd_context* ctx, reader_context* reader)
+{
+	ctx->reader = reader;
+}
+
+void ncsd_set_size(ncsd_context* ctx, u64 size)
 {
 	ctx->size = size;
 }
@@ -44,12 +51,24 @@ int ncsd_signature_verify(const void* blob, rsakey2048* key)
 
 void ncsd_process(ncsd_context* ctx, u32 actions)
 {
-	fseek(ctx->file, ctx->offset, SEEK_SET);
-	fread(&ctx->header, 1, 0x200, ctx->file);
+	u64 partitionoffset = 0x4000;
+	u64 partitionsize;
+	u32 i;
+
+	// A mapped image is parsed in place; only the pages touched are read.
+	ctx->header = 0;
+	if (ctx->reader)
+		ctx->header = (const ctr_ncsdheader*)reader_map(ctx->reader, ctx->offset, sizeof(ctr_ncsdheader));
+	if (ctx->header == 0)
+	{
+		fseeko(ctx->file, ctx->offset, SEEK_SET);
+		fread(&ctx->headerbuf, 1, sizeof(ctr_ncsdheader), ctx->file);
+		ctx->header = &ctx->headerbuf;
+	}
 
-	if (getle32(ctx->header.magic) != MAGIC_NCSD)
+	if (getle32(ctx->header->magic) != MAGIC_NCSD)
 	{
-		fprintf(stdout, "Error, NCSD segment corrupted\n");
+		log_error("Error, NCSD segment corrupted");
 		return;
 	}
 
@@ -57,17 +76,65 @@ void ncsd_process(ncsd_context* ctx, u32 actions)
 	if (actions & VerifyFlag)
 	{
 		if (ctx->usersettings)
-			ctx->headersigcheck = ncsd_signature_verify(&ctx->header, &ctx->usersettings->keys.ncsdrsakey);
+			ctx->headersigcheck = ncsd_signature_verify(ctx->header, &ctx->usersettings->keys.ncsdrsakey);
 	}
 
 	if (actions & InfoFlag)
 		ncsd_print(ctx, stdout);
 
+	// Take partition 0 from the header; its offset only fits in 32 bits
+	// once it has been scaled by the media unit size.
+	if (ctx->header->partitiongeometry[0].size != 0)
+		partitionoffset = (u64)ctx->header->partitiongeometry[0].offset * ncsd_get_mediaunit_size(ctx);
+	partitionsize = ctx->size > partitionoffset ? ctx->size - partitionoffset : 0;
+
 	ncch_set_file(&ctx->ncch, ctx->file);
-	ncch_set_offset(&ctx->ncch, 0x4000);
-	ncch_set_size(&ctx->ncch, ctx->size - 0x4000);
+	ncch_set_reader(&ctx->ncch, ctx->reader);
+	ncch_set_offset(&ctx->ncch, ctx->offset + partitionoffset);
+	ncch_set_size(&ctx->ncch, partitionsize);
 	ncch_set_usersettings(&ctx->ncch, ctx->usersettings);
 	ncch_process(&ctx->ncch, actions);
+	ctx->partitions[0] = &ctx->ncch;
+
+	// The other partitions (manual, download play child) are only taken as
+	// far as their headers and keys, which is all decrypting them needs.
+	for(i=1; i<8; i++)
+	{
+		ncch_context* ncch;
+
+		partitionoffset = (u64)ctx->header->partitiongeometry[i].offset * ncsd_get_mediaunit_size(ctx);
+		partitionsize = (u64)ctx->header->partitiongeometry[i].size * ncsd_get_mediaunit_size(ctx);
+		if (partitionsize == 0 || partitionoffset >= ctx->size)
+			continue;
+		if (partitionsize > ctx->size - partitionoffset)
+			partitionsize = ctx->size - partitionoffset;
+
+		ncch = malloc(sizeof(ncch_context));
+		if (ncch == 0)
+			continue;
+		ncch_init(ncch);
+		ncch_set_file(ncch, ctx->file);
+		ncch_set_reader(ncch, ctx->reader);
+		ncch_set_offset(ncch, ctx->offset + partitionoffset);
+		ncch_set_size(ncch, partitionsize);
+		ncch_set_usersettings(ncch, ctx->usersettings);
+		ncch_process(ncch, LazyFlag | (actions & PlainFlag));
+		ctx->partitions[i] = ncch;
+	}
+}
+
+// Returns the NCCH in partition index, or 0 if there is none or its header
+// is not an NCCH header.
+ncch_context* ncsd_get_partition(ncsd_context* ctx, u32 index)
+{
+	ncch_context* ncch;
+
+	if (index >= 8)
+		return 0;
+	ncch = ctx->partitions[index];
+	if (ncch == 0 || ncch->header == 0 || getle32(ncch->header->magic) != MAGIC_NCCH)
+		return 0;
+	return ncch;
 }
 
 unsigned int ncsd_get_mediaunit_size(ncsd_context* ctx)
@@ -75,7 +142,7 @@ unsigned int ncsd_get_mediaunit_size(ncsd_context* ctx)
 	unsigned int mediaunitsize = settings_get_mediaunit_size(ctx->usersettings);
 
 	if (mediaunitsize == 0)
-		mediaunitsize = 1<<(9+ctx->header.flags[6]);
+		mediaunitsize = 1<<(9+ctx->header->flags[6]);
 
 	return mediaunitsize;
 }
@@ -83,7 +150,7 @@ unsigned int ncsd_get_mediaunit_size(ncsd_context* ctx)
 void ncsd_print(ncsd_context* ctx, FILE* fp)
 {
 	char magic[5];
-	ctr_ncsdheader* header = &ctx->header;
+	const ctr_ncsdheader* header = ctx->header;
 	unsigned int i;
 	unsigned int mediaunitsize = ncsd_get_mediaunit_size(ctx);
 
@@ -106,14 +173,14 @@ void ncsd_print(ncsd_context* ctx, FILE* fp)
 	fprintf(fp, "\n");
 	for(i=0; i<8; i++)
 	{
-		u32 partitionoffset = header->partitiongeometry[i].offset * mediaunitsize;
-		u32 partitionsize = header->partitiongeometry[i].size * mediaunitsize;
+		u64 partitionoffset = (u64)header->partitiongeometry[i].offset * mediaunitsize;
+		u64 partitionsize = (u64)header->partitiongeometry[i].size * mediaunitsize;
 
 		if (partitionsize != 0)
 		{
 			fprintf(fp, "Partition %d            \n", i);
 			memdump(fp, " Id:                    ", header->partitionid+i*8, 8);
-			fprintf(fp, " Area:                  0x%08X-0x%08X\n", partitionoffset, partitionoffset+partitionsize);
+			fprintf(fp, " Area:                  0x%08llX-0x%08llX\n", partitionoffset, partitionoffset+partitionsize);
 			fprintf(fp, " Filesystem:            %02X\n", header->partitionfstype[i]);
 			fprintf(fp, " Encryption:            %02X\n", header->partitioncrypttype[i]);
 			fprintf(fp, "\n");
@@ -33,23 +33,28 @@ typedef struct
 typedef struct
 {
 	FILE* file;
-	u32 offset;
-	u32 size;
-	ctr_ncsdheader header;
+	reader_context* reader;
+	u64 offset;
+	u64 size;
+	const ctr_ncsdheader* header;	// into the mapped image, or headerbuf
+	ctr_ncsdheader headerbuf;
 	settings* usersettings;
 	int headersigcheck;
 	ncch_context ncch;
+	ncch_context* partitions[8];	// [0] is ncch; 0 where a partition is absent
 } ncsd_context;
 
 
 void ncsd_init(ncsd_context* ctx);
-void ncsd_set_offset(ncsd_context* ctx, u32 offset);
-void ncsd_set_size(ncsd_context* ctx, u32 size);
+void ncsd_set_offset(ncsd_context* ctx, u64 offset);
+void ncsd_set_size(ncsd_context* ctx, u64 size);
 void ncsd_set_file(ncsd_context* ctx, FILE* file);
+void ncsd_set_reader(ncsd_context* ctx, reader_context* reader);
 void ncsd_set_usersettings(ncsd_context* ctx, settings* usersettings);
 int ncsd_signature_verify(const void* blob, rsakey2048* key);
 void ncsd_process(ncsd_context* ctx, u32 actions);
 void ncsd_print(ncsd_context* ctx, FILE* fp);
 unsigned int ncsd_get_mediaunit_size(ncsd_context* ctx);
+ncch_context* ncsd_get_partition(ncsd_context* ctx, u32 index);
 
 #endif // _NCSD_H_
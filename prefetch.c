@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "types.h"
+#include "prefetch.h"
+#include "blockcache.h"
+#include "stats.h"
+#include "log.h"
+#include "trace.h"
+#include "iosched.h"
+
+typedef struct
+{
+	region_context* region;
+	u64 offset;
+	u64 size;
+} prefetch_request;
+
+// One worker drains a small ring of requests, reading each range through
+// region_read so the decrypted blocks land in whichever cache the region
+// uses. Requests that don't fit are dropped; read-ahead is only a hint.
+static prefetch_request queue[PREFETCH_QUEUE];
+static u32 head;
+static u32 count;
+static int started;
+static int stopping;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+
+static void prefetch_run(prefetch_request* request, u8* buffer, reader_queue* reads)
+{
+	TRACE_SPAN("prefetch");
+	region_context* region = request->region;
+	u64 offset = request->offset;
+	u64 end = request->offset + request->size;
+	// With a reader, several blocks are read at once.
+	int batched = region->reader && (reads->reader || reader_queue_init(reads, region->reader));
+	u64 slice = batched ? READER_QUEUE_DEPTH * BLOCKCACHE_BLOCKSIZE : BLOCKCACHE_BLOCKSIZE;
+	int ok;
+
+	while(offset < end && !stopping)
+	{
+		// Whole aligned blocks, so a block is decrypted once however the
+		// requests overlap.
+		u64 next = (offset & ~(u64)(BLOCKCACHE_BLOCKSIZE - 1)) + slice;
+
+		if (next > end)
+			next = end;
+
+		// Each slice waits its turn behind foreground reads.
+		if (!iosched_background_begin(next - offset))
+			return;
+		if (batched)
+			ok = region_prefetch(region, reads, offset, next - offset);
+		else
+		{
+			ok = region_read(region, offset, buffer, next - offset);
+			if (ok)
+				stats_add(STATS_PREFETCH_BYTES, next - offset);
+		}
+		iosched_background_end();
+
+		if (!ok)
+		{
+			log_debug("prefetch of %llx failed", offset);
+			return;
+		}
+		offset = next;
+	}
+}
+
+static void* prefetch_worker(void* unused)
+{
+	u8* buffer = malloc(BLOCKCACHE_BLOCKSIZE);
+	prefetch_request request;
+	reader_queue reads;
+
+	if (buffer == 0)
+		return 0;
+	memset(&reads, 0, sizeof(reads));
+
+	pthread_mutex_lock(&lock);
+	for(;;)
+	{
+		while(count == 0 && !stopping)
+			pthread_cond_wait(&wakeup, &lock);
+		if (stopping)
+			break;
+
+		request = queue[head];
+		head = (head + 1) % PREFETCH_QUEUE;
+		count--;
+
+		pthread_mutex_unlock(&lock);
+		prefetch_run(&request, buffer, &reads);
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (reads.reader)
+		reader_queue_free(&reads);
+	free(buffer);
+	return 0;
+}
+
+// Queues [offset, offset+size) of region to be decrypted in the background.
+// The worker starts on first use, after FUSE has daemonized.
+int prefetch_region(region_context* region, u64 offset, u64 size)
+{
+	int queued = 0;
+
+	if (!region_cached(region))
+		return 0;
+
+	pthread_mutex_lock(&lock);
+	if (!started && !stopping)
+	{
+		if (pthread_create(&thread, 0, prefetch_worker, 0) == 0)
+			started = 1;
+		else
+			log_warn("could not start prefetch thread");
+	}
+
+	if (started && !stopping && count < PREFETCH_QUEUE)
+	{
+		prefetch_request* request = &queue[(head + count) % PREFETCH_QUEUE];
+
+		request->region = region;
+		request->offset = offset;
+		request->size = size;
+		count++;
+		queued = 1;
+		pthread_cond_signal(&wakeup);
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (!queued)
+		stats_add(STATS_PREFETCH_DROPPED, 1);
+	return queued;
+}
+
+// Waits for the worker to finish its current block, before the regions it
+// reads from go away.
+void prefetch_stop(void)
+{
+	int joinable;
+
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	joinable = started;
+	pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&lock);
+
+	if (joinable)
+		pthread_join(thread, 0);
+}
@@ -0,0 +1,21 @@
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+#include "types.h"
+#include "region.h"
+
+#define PREFETCH_QUEUE			32		// pending read-ahead requests
+#define PREFETCH_DEFAULT_SIZE	(2 * 1024 * 1024)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int  prefetch_region(region_context* region, u64 offset, u64 size);
+void prefetch_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PREFETCH_H_
@@ -0,0 +1,721 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "types.h"
+#include "reader.h"
+#include "stats.h"
+#include "log.h"
+#include "trace.h"
+
+static const char* names[] = { "stdio", "pread", "mmap", "io_uring" };
+
+// Mapped submission and completion rings of one io_uring instance.
+typedef struct
+{
+	int fd;
+	u32 entries;
+	u8* sq;
+	size_t sqsize;
+	u8* cq;
+	size_t cqsize;
+	struct io_uring_sqe* sqes;
+	size_t sqessize;
+	u32* sqtail;
+	u32 sqmask;
+	u32* sqarray;
+	u32* cqhead;
+	u32* cqtail;
+	u32 cqmask;
+	struct io_uring_cqe* cqes;
+} reader_ring;
+
+// The single ring every thread's reads of one image go through. Readers
+// append SQEs under lock; whoever then takes submitlock hands the kernel
+// everything queued so far in one io_uring_enter, so the reads of several
+// FUSE threads and the prefetcher go down together. A reaper thread takes
+// completions and wakes whoever is waiting.
+typedef struct
+{
+	reader_ring* ring;
+	pthread_mutex_t lock;			// SQ tail, inflight, queues' done lists
+	pthread_cond_t space;
+	pthread_mutex_t submitlock;
+	u32 queued;
+	u32 submitted;
+	u32 inflight;
+	int fixedfile;
+	u8* fixed;						// READER_FIXED_QUEUES sets of queue buffers
+	u32 fixedused;					// bitmap of sets handed out
+	int started;
+	int stopping;
+	pthread_t reaper;
+} reader_executor;
+
+// A blocking read waiting on the executor.
+typedef struct
+{
+	reader_request request;
+	pthread_cond_t cond;
+} reader_waiter;
+
+static void reader_ring_free(reader_ring* ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqessize);
+	if (ring->cq && ring->cq != ring->sq)
+		munmap(ring->cq, ring->cqsize);
+	if (ring->sq)
+		munmap(ring->sq, ring->sqsize);
+	close(ring->fd);
+	free(ring);
+}
+
+static reader_ring* reader_ring_create(u32 depth)
+{
+	struct io_uring_params params;
+	reader_ring* ring = calloc(1, sizeof(reader_ring));
+
+	if (ring == 0)
+		return 0;
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (ring->fd < 0)
+	{
+		free(ring);
+		return 0;
+	}
+
+	ring->entries = params.sq_entries;
+	ring->sqsize = params.sq_off.array + params.sq_entries * sizeof(u32);
+	ring->cqsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->cqsize > ring->sqsize)
+			ring->sqsize = ring->cqsize;
+		ring->cqsize = ring->sqsize;
+	}
+
+	ring->sq = mmap(0, ring->sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq == MAP_FAILED)
+	{
+		ring->sq = 0;
+		goto fail;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq = ring->sq;
+	else
+	{
+		ring->cq = mmap(0, ring->cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq == MAP_FAILED)
+		{
+			ring->cq = 0;
+			goto fail;
+		}
+	}
+
+	ring->sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(0, ring->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+	{
+		ring->sqes = 0;
+		goto fail;
+	}
+
+	ring->sqtail = (u32*)(ring->sq + params.sq_off.tail);
+	ring->sqmask = *(u32*)(ring->sq + params.sq_off.ring_mask);
+	ring->sqarray = (u32*)(ring->sq + params.sq_off.array);
+	ring->cqhead = (u32*)(ring->cq + params.cq_off.head);
+	ring->cqtail = (u32*)(ring->cq + params.cq_off.tail);
+	ring->cqmask = *(u32*)(ring->cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(ring->cq + params.cq_off.cqes);
+	return ring;
+
+fail:
+	reader_ring_free(ring);
+	return 0;
+}
+
+static reader_executor* reader_executor_create(int fd)
+{
+	reader_executor* ex = calloc(1, sizeof(reader_executor));
+	size_t fixedsize = (size_t)READER_FIXED_QUEUES * READER_QUEUE_DEPTH * READER_BUFSIZE;
+	struct iovec iov;
+
+	if (ex == 0)
+		return 0;
+
+	ex->ring = reader_ring_create(READER_URING_ENTRIES);
+	if (ex->ring == 0)
+	{
+		free(ex);
+		return 0;
+	}
+	pthread_mutex_init(&ex->lock, 0);
+	pthread_cond_init(&ex->space, 0);
+	pthread_mutex_init(&ex->submitlock, 0);
+
+	// A fixed file skips the descriptor lookup and refcount on every read;
+	// registered buffers skip pinning the pages each time.
+	ex->fixedfile = syscall(__NR_io_uring_register, ex->ring->fd, IORING_REGISTER_FILES, &fd, 1) == 0;
+	if (!ex->fixedfile)
+		log_warn("could not register the image with io_uring");
+
+	ex->fixed = mmap(0, fixedsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ex->fixed == MAP_FAILED)
+		ex->fixed = 0;
+	if (ex->fixed)
+	{
+		iov.iov_base = ex->fixed;
+		iov.iov_len = fixedsize;
+		if (syscall(__NR_io_uring_register, ex->ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) != 0)
+		{
+			log_warn("could not register io_uring buffers");
+			munmap(ex->fixed, fixedsize);
+			ex->fixed = 0;
+		}
+		else
+			stats_add(STATS_MEMORY, fixedsize);
+	}
+
+	return ex;
+}
+
+// Hands a finished read to whoever is waiting for it. Called locked.
+static void reader_finish(reader_executor* ex, reader_request* request, s32 res)
+{
+	reader_queue* queue = request->queue;
+
+	request->result = res == (s32)request->size;
+	request->count = res > 0 ? res : 0;
+	request->done = 1;
+	if (res > 0)
+		stats_add(STATS_BACKING_BYTES, res);
+
+	if (queue)
+	{
+		request->next = 0;
+		if (queue->donetail)
+			queue->donetail->next = request;
+		else
+			queue->done = request;
+		queue->donetail = request;
+		pthread_cond_signal(&queue->ready);
+	}
+	else
+		pthread_cond_signal(&((reader_waiter*)request)->cond);
+}
+
+static void* reader_reaper(void* arg)
+{
+	reader_executor* ex = arg;
+	reader_ring* ring = ex->ring;
+	struct io_uring_cqe* cqe;
+	u32 head, tail;
+	int stop = 0;
+
+	while(!stop)
+	{
+		syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0);
+
+		pthread_mutex_lock(&ex->lock);
+		head = *ring->cqhead;
+		tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+		for(; head != tail; head++)
+		{
+			cqe = &ring->cqes[head & ring->cqmask];
+			ex->inflight--;
+			if (cqe->user_data)
+				reader_finish(ex, (reader_request*)(uintptr_t)cqe->user_data, cqe->res);
+			else
+				stop = 1;	// the wakeup from reader_close
+		}
+		__atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&ex->space);
+		pthread_mutex_unlock(&ex->lock);
+	}
+	return 0;
+}
+
+// Queues one SQE and makes sure it reaches the kernel. request 0 queues a
+// no-op, used to wake the reaper. Returns 0 if the ring is unusable.
+static int reader_executor_submit(reader_executor* ex, reader_request* request, int fd, int bufindex)
+{
+	reader_ring* ring = ex->ring;
+	struct io_uring_sqe* sqe;
+	u32 tail, index, count;
+	int ret;
+
+	pthread_mutex_lock(&ex->lock);
+	if (ex->stopping && request)
+	{
+		pthread_mutex_unlock(&ex->lock);
+		return 0;
+	}
+	if (!ex->started)
+	{
+		// Started on first use, after FUSE has daemonized.
+		if (pthread_create(&ex->reaper, 0, reader_reaper, ex) != 0)
+		{
+			pthread_mutex_unlock(&ex->lock);
+			return 0;
+		}
+		ex->started = 1;
+	}
+	while(ex->inflight >= ring->entries)
+		pthread_cond_wait(&ex->space, &ex->lock);
+
+	tail = *ring->sqtail;
+	index = tail & ring->sqmask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	if (request == 0)
+		sqe->opcode = IORING_OP_NOP;
+	else
+	{
+		sqe->opcode = bufindex >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+		sqe->buf_index = bufindex >= 0 ? bufindex : 0;
+		sqe->fd = ex->fixedfile ? 0 : fd;
+		sqe->flags = ex->fixedfile ? IOSQE_FIXED_FILE : 0;
+		sqe->off = request->offset;
+		sqe->addr = (u64)(uintptr_t)request->buffer;
+		sqe->len = request->size;
+		sqe->user_data = (u64)(uintptr_t)request;
+	}
+	ring->sqarray[index] = index;
+	__atomic_store_n(ring->sqtail, tail + 1, __ATOMIC_RELEASE);
+	ex->queued++;
+	ex->inflight++;
+	pthread_mutex_unlock(&ex->lock);
+
+	// Anything queued meanwhile by other threads goes down with ours; if
+	// another thread already took ours along, there is nothing left to do.
+	pthread_mutex_lock(&ex->submitlock);
+	count = __atomic_load_n(&ex->queued, __ATOMIC_ACQUIRE) - ex->submitted;
+	while(count)
+	{
+		ret = syscall(__NR_io_uring_enter, ring->fd, count, 0, 0, 0, 0);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		{
+			// The SQEs stay queued for the next submitter to retry.
+			log_error("Error, io_uring_enter failed: %s", strerror(errno));
+			break;
+		}
+		if (ret > 0)
+		{
+			ex->submitted += ret;
+			count -= ret;
+		}
+	}
+	pthread_mutex_unlock(&ex->submitlock);
+
+	if (request)
+		stats_add(STATS_BACKING_READS, 1);
+	return 1;
+}
+
+// Sets up reading file, whose descriptor is fd, with the named backend.
+// If directfd is not -1 it is the same file opened with O_DIRECT, to be
+// used for data reads. Returns 0 if the name is unknown or the backend
+// can't be used here.
+int reader_init(reader_context* ctx, const char* backend, FILE* file, int fd, int directfd)
+{
+	struct stat st;
+	u32 i;
+
+	memset(ctx, 0, sizeof(reader_context));
+	ctx->file = file;
+	ctx->fd = fd;
+	ctx->directfd = directfd;
+
+	for(i=0; i<sizeof(names) / sizeof(names[0]); i++)
+	{
+		if (strcmp(backend, names[i]) == 0)
+			break;
+	}
+	if (i == sizeof(names) / sizeof(names[0]))
+	{
+		log_error("Error, unknown backend %s", backend);
+		return 0;
+	}
+	ctx->backend = i;
+
+	if (fstat(fd, &st) != 0)
+		return 0;
+	ctx->size = st.st_size;
+
+	if (directfd >= 0)
+	{
+		if (ctx->backend != READER_PREAD && ctx->backend != READER_URING)
+		{
+			log_error("Error, direct reads need the pread or io_uring backend");
+			return 0;
+		}
+		if (posix_memalign((void**)&ctx->bounce, READER_DIRECT_ALIGN, READER_DIRECT_BUFFERS * READER_DIRECT_BUFSIZE) != 0)
+			return 0;
+		pthread_mutex_init(&ctx->bouncelock, 0);
+		pthread_cond_init(&ctx->bouncefree, 0);
+		stats_add(STATS_MEMORY, READER_DIRECT_BUFFERS * READER_DIRECT_BUFSIZE);
+	}
+
+	if (ctx->backend == READER_MMAP)
+	{
+		ctx->map = mmap(0, ctx->size, PROT_READ, MAP_SHARED, fd, 0);
+		if (ctx->map == MAP_FAILED)
+		{
+			log_error("Error, could not map image");
+			ctx->map = 0;
+			return 0;
+		}
+	}
+	else if (ctx->backend == READER_URING)
+	{
+		ctx->executor = reader_executor_create(directfd >= 0 ? directfd : fd);
+		if (ctx->executor == 0)
+		{
+			log_error("Error, io_uring is not available");
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Stops the io_uring reaper once everything in flight has come back.
+void reader_close(reader_context* ctx)
+{
+	reader_executor* ex = ctx->executor;
+	int started;
+
+	if (ex == 0)
+		return;
+
+	pthread_mutex_lock(&ex->lock);
+	ex->stopping = 1;
+	started = ex->started;
+	while(started && ex->inflight)
+		pthread_cond_wait(&ex->space, &ex->lock);
+	pthread_mutex_unlock(&ex->lock);
+
+	if (started)
+	{
+		reader_executor_submit(ex, 0, -1, -1);
+		pthread_join(ex->reaper, 0);
+	}
+}
+
+const char* reader_name(reader_context* ctx)
+{
+	return names[ctx->backend];
+}
+
+// Reads up to size bytes at offset from whichever descriptor data reads
+// use, stopping short only at end of file or on error. Returns the number
+// of bytes read.
+static size_t reader_fill(reader_context* ctx, u64 offset, u8* buffer, size_t size)
+{
+	reader_executor* ex = ctx->executor;
+	int fd = ctx->directfd >= 0 ? ctx->directfd : ctx->fd;
+	reader_waiter waiter;
+	struct iovec iov;
+	size_t count = 0;
+	ssize_t n;
+
+	if (ex)
+	{
+		// Whatever the page cache already holds is copied out right here.
+		// Going through the ring would only queue it behind other threads,
+		// since the kernel does cached reads inline at submit.
+		iov.iov_base = buffer;
+		iov.iov_len = size;
+		n = preadv2(fd, &iov, 1, offset, RWF_NOWAIT);
+		if (n > 0)
+		{
+			stats_add(STATS_BACKING_READS, 1);
+			stats_add(STATS_BACKING_BYTES, n);
+			count = n;
+			if (count == size)
+				return count;
+		}
+
+		// The rest has to come from the device. FUSE owns buffer, so it
+		// can't be a registered one; the read still batches with every
+		// other thread's on the shared ring.
+		memset(&waiter, 0, sizeof(waiter));
+		waiter.request.offset = offset + count;
+		waiter.request.buffer = buffer + count;
+		waiter.request.size = size - count;
+		pthread_cond_init(&waiter.cond, 0);
+		if (reader_executor_submit(ex, &waiter.request, fd, -1))
+		{
+			pthread_mutex_lock(&ex->lock);
+			while(!waiter.request.done)
+				pthread_cond_wait(&waiter.cond, &ex->lock);
+			pthread_mutex_unlock(&ex->lock);
+			pthread_cond_destroy(&waiter.cond);
+			return count + waiter.request.count;
+		}
+		pthread_cond_destroy(&waiter.cond);
+		// shutting down: read the rest directly
+	}
+
+	while(count < size)
+	{
+		n = pread(fd, buffer + count, size - count, offset + count);
+		stats_add(STATS_BACKING_READS, 1);
+		if (n <= 0)
+			break;
+		stats_add(STATS_BACKING_BYTES, n);
+		count += n;
+	}
+	return count;
+}
+
+static u8* reader_bounce_get(reader_context* ctx, u32* index)
+{
+	pthread_mutex_lock(&ctx->bouncelock);
+	while(ctx->bounceused == (1u << READER_DIRECT_BUFFERS) - 1)
+		pthread_cond_wait(&ctx->bouncefree, &ctx->bouncelock);
+	*index = __builtin_ctz(~ctx->bounceused);
+	ctx->bounceused |= 1u << *index;
+	pthread_mutex_unlock(&ctx->bouncelock);
+
+	return ctx->bounce + (size_t)*index * READER_DIRECT_BUFSIZE;
+}
+
+static void reader_bounce_put(reader_context* ctx, u32 index)
+{
+	pthread_mutex_lock(&ctx->bouncelock);
+	ctx->bounceused &= ~(1u << index);
+	pthread_cond_signal(&ctx->bouncefree);
+	pthread_mutex_unlock(&ctx->bouncelock);
+}
+
+static int reader_aligned(u64 offset, const void* buffer, size_t size)
+{
+	return ((offset | (uintptr_t)buffer | size) & (READER_DIRECT_ALIGN - 1)) == 0;
+}
+
+// O_DIRECT reads must start, end and land on aligned boundaries. Anything
+// else is read whole aligned blocks at a time into a bounce buffer.
+static int reader_read_direct(reader_context* ctx, u64 offset, u8* buffer, size_t size)
+{
+	u64 start;
+	u32 skip, index;
+	size_t want, len;
+	u8* bounce;
+	int ok;
+
+	if (reader_aligned(offset, buffer, size))
+		return reader_fill(ctx, offset, buffer, size) == size;
+
+	while(size)
+	{
+		start = offset & ~(u64)(READER_DIRECT_ALIGN - 1);
+		skip = offset - start;
+		want = READER_DIRECT_BUFSIZE - skip;
+		if (want > size)
+			want = size;
+		len = (skip + want + READER_DIRECT_ALIGN - 1) & ~(size_t)(READER_DIRECT_ALIGN - 1);
+
+		bounce = reader_bounce_get(ctx, &index);
+		// The last block of the file comes back short; that's fine as
+		// long as it covers what was asked for.
+		ok = reader_fill(ctx, start, bounce, len) >= skip + want;
+		if (ok)
+			memcpy(buffer, bounce + skip, want);
+		reader_bounce_put(ctx, index);
+		if (!ok)
+			return 0;
+
+		buffer += want;
+		offset += want;
+		size -= want;
+	}
+	return 1;
+}
+
+// Reads size bytes at offset into buffer. Returns 1 only if all of them
+// were read.
+int reader_read(reader_context* ctx, u64 offset, void* buffer, size_t size)
+{
+	TRACE_SPAN("reader_read");
+	size_t count = 0;
+
+	switch(ctx->backend)
+	{
+	case READER_STDIO:
+		// Seek and read must not interleave with another thread's.
+		flockfile(ctx->file);
+		if (fseeko(ctx->file, offset, SEEK_SET) == 0)
+			count = fread(buffer, 1, size, ctx->file);
+		funlockfile(ctx->file);
+		return count == size;
+
+	case READER_MMAP:
+		if (offset > ctx->size || size > ctx->size - offset)
+			return 0;
+		memcpy(buffer, ctx->map + offset, size);
+		stats_add(STATS_BACKING_BYTES, size);
+		stats_add(STATS_BACKING_READS, 1);
+		return 1;
+
+	case READER_PREAD:
+	case READER_URING:
+		if (ctx->directfd >= 0)
+			return reader_read_direct(ctx, offset, buffer, size);
+		return reader_fill(ctx, offset, buffer, size) == size;
+	}
+	return 0;
+}
+
+// Returns the bytes at [offset, offset+size) in place, or 0 if the backend
+// does not map the file.
+const u8* reader_map(reader_context* ctx, u64 offset, u64 size)
+{
+	if (ctx->map == 0 || offset > ctx->size || size > ctx->size - offset)
+		return 0;
+	return ctx->map + offset;
+}
+
+// Prepares a queue and its buffers, taking a registered set if the reader
+// has one free.
+int reader_queue_init(reader_queue* queue, reader_context* reader)
+{
+	reader_executor* ex = reader->executor;
+	u32 i;
+
+	memset(queue, 0, sizeof(reader_queue));
+	queue->reader = reader;
+	queue->fixed = -1;
+	pthread_cond_init(&queue->ready, 0);
+
+	if (ex && ex->fixed)
+	{
+		pthread_mutex_lock(&ex->lock);
+		for(i=0; i<READER_FIXED_QUEUES; i++)
+		{
+			if (!(ex->fixedused & (1 << i)))
+			{
+				ex->fixedused |= 1 << i;
+				queue->fixed = i;
+				queue->buffers = ex->fixed + (size_t)i * READER_QUEUE_DEPTH * READER_BUFSIZE;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&ex->lock);
+	}
+
+	if (queue->buffers == 0)
+	{
+		// Page aligned, so queued O_DIRECT reads need no bounce.
+		if (posix_memalign((void**)&queue->buffers, READER_DIRECT_ALIGN, READER_QUEUE_DEPTH * READER_BUFSIZE) != 0)
+		{
+			pthread_cond_destroy(&queue->ready);
+			queue->reader = 0;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void reader_queue_free(reader_queue* queue)
+{
+	reader_executor* ex = queue->reader->executor;
+
+	while(queue->pending)
+		reader_complete(queue);
+
+	if (queue->fixed >= 0)
+	{
+		pthread_mutex_lock(&ex->lock);
+		ex->fixedused &= ~(1 << queue->fixed);
+		pthread_mutex_unlock(&ex->lock);
+	}
+	else
+		free(queue->buffers);
+	queue->buffers = 0;
+	pthread_cond_destroy(&queue->ready);
+}
+
+// Starts a read. Returns 0 if the queue already has READER_QUEUE_DEPTH
+// reads in flight; collect a completion and try again.
+int reader_submit(reader_queue* queue, reader_request* request)
+{
+	reader_executor* ex = queue->reader->executor;
+	u8* buffer = request->buffer;
+	int bufindex = -1;
+
+	if (queue->pending == READER_QUEUE_DEPTH)
+		return 0;
+
+	request->queue = queue;
+	request->done = 0;
+	request->next = 0;
+
+	// O_DIRECT reads that aren't aligned need a bounce; do them now.
+	if (ex && (queue->reader->directfd < 0 || reader_aligned(request->offset, buffer, request->size)))
+	{
+		// Reads into the registered set can use READ_FIXED.
+		if (queue->fixed >= 0 && buffer >= queue->buffers && buffer + request->size <= queue->buffers + READER_QUEUE_DEPTH * READER_BUFSIZE)
+			bufindex = 0;
+
+		queue->pending++;
+		if (reader_executor_submit(ex, request, queue->reader->directfd >= 0 ? queue->reader->directfd : queue->reader->fd, bufindex))
+			return 1;
+		queue->pending--;
+	}
+
+	request->result = reader_read(queue->reader, request->offset, request->buffer, request->size);
+	request->count = request->result ? request->size : 0;
+	request->done = 1;
+	if (ex)
+		pthread_mutex_lock(&ex->lock);
+	if (queue->donetail)
+		queue->donetail->next = request;
+	else
+		queue->done = request;
+	queue->donetail = request;
+	queue->pending++;
+	if (ex)
+		pthread_mutex_unlock(&ex->lock);
+	return 1;
+}
+
+// Waits for the next finished request and returns it, or 0 if nothing is
+// in flight.
+reader_request* reader_complete(reader_queue* queue)
+{
+	reader_executor* ex = queue->reader->executor;
+	reader_request* request;
+
+	if (queue->pending == 0)
+		return 0;
+
+	if (ex)
+	{
+		pthread_mutex_lock(&ex->lock);
+		while(queue->done == 0)
+			pthread_cond_wait(&queue->ready, &ex->lock);
+	}
+
+	request = queue->done;
+	queue->done = request->next;
+	if (queue->done == 0)
+		queue->donetail = 0;
+	queue->pending--;
+
+	if (ex)
+		pthread_mutex_unlock(&ex->lock);
+	return request;
+}
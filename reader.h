@@ -0,0 +1,96 @@
+#ifndef _READER_H_
+#define _READER_H_
+
+#include <stdio.h>
+#include <pthread.h>
+#include "types.h"
+
+#define READER_QUEUE_DEPTH		8			// requests in flight per queue
+#define READER_BUFSIZE			0x10000		// size of each queue buffer
+#define READER_FIXED_QUEUES		4			// queues whose buffers are registered
+#define READER_URING_ENTRIES	256
+#define READER_DIRECT_ALIGN		4096		// O_DIRECT offset, length and buffer alignment
+#define READER_DIRECT_BUFFERS	16			// bounce buffers for unaligned O_DIRECT reads
+#define READER_DIRECT_BUFSIZE	0x40000
+
+typedef enum
+{
+	READER_STDIO,
+	READER_PREAD,
+	READER_MMAP,
+	READER_URING,
+} reader_backend;
+
+// How the image file is read. stdio goes through the FILE* the parsers
+// use; the others work on its descriptor and are safe to use from several
+// threads at once.
+typedef struct
+{
+	reader_backend backend;
+	FILE* file;
+	int fd;
+	u64 size;
+	u8* map;			// whole file, for READER_MMAP
+	void* executor;		// shared ring and its reaper, for READER_URING
+
+	// With O_DIRECT, data reads go to directfd, bypassing the page cache,
+	// through aligned bounce buffers.
+	int directfd;
+	u8* bounce;
+	u32 bounceused;		// bitmap of bounce buffers in use
+	pthread_mutex_t bouncelock;
+	pthread_cond_t bouncefree;
+} reader_context;
+
+struct reader_queue;
+
+// An asynchronous read. result is set once it comes back from
+// reader_complete: 1 if all size bytes were read, 0 if not.
+typedef struct reader_request
+{
+	u64 offset;
+	void* buffer;
+	size_t size;
+	int result;
+	size_t count;		// bytes actually read
+	void* arg;
+	struct reader_request* next;
+	struct reader_queue* queue;	// owner; 0 for a blocking read
+	int done;
+} reader_request;
+
+// Requests in flight for one thread, with READER_QUEUE_DEPTH buffers of
+// READER_BUFSIZE bytes to read into. With io_uring they share the reader's
+// ring, and buffers is registered with it when one of the few registered
+// sets is free; the other backends read on submit and hand results back in
+// order.
+typedef struct reader_queue
+{
+	reader_context* reader;
+	reader_request* done;
+	reader_request* donetail;
+	u32 pending;
+	u8* buffers;
+	int fixed;			// index of the registered set, or -1
+	pthread_cond_t ready;
+} reader_queue;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int  reader_init(reader_context* ctx, const char* backend, FILE* file, int fd, int directfd);
+const char* reader_name(reader_context* ctx);
+int  reader_read(reader_context* ctx, u64 offset, void* buffer, size_t size);
+const u8* reader_map(reader_context* ctx, u64 offset, u64 size);
+void reader_close(reader_context* ctx);
+int  reader_queue_init(reader_queue* queue, reader_context* reader);
+void reader_queue_free(reader_queue* queue);
+int  reader_submit(reader_queue* queue, reader_request* request);
+reader_request* reader_complete(reader_queue* queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _READER_H_
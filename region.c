@@ -0,0 +1,572 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "types.h"
+#include "region.h"
+#include "blockcache.h"
+#include "shmcache.h"
+#include "diskcache.h"
+#include "stats.h"
+#include "ctr.h"
+#include "trace.h"
+
+// A block fill in progress. Readers that miss on a block someone is already
+// filling wait here for the result instead of reading and decrypting it
+// again. The last reference frees it.
+typedef struct region_flight
+{
+	u64 image;
+	u64 offset;
+	u32 size;
+	u32 refs;
+	int done;
+	int ok;
+	u8* data;			// copy of the block, made only if someone waited
+	pthread_cond_t cond;
+	struct region_flight* next;
+} region_flight;
+
+static region_flight* flights;
+static pthread_mutex_t flightlock = PTHREAD_MUTEX_INITIALIZER;
+static u64 landed;		// fills finished, to spot one that ends as we miss
+
+void region_init(region_context* ctx, FILE* file, u64 offset, u64 size)
+{
+	memset(ctx, 0, sizeof(region_context));
+	ctx->file = file;
+	// Until told otherwise, cached blocks are tied to this stream and
+	// region; cache offsets are relative to the region.
+	ctx->image = (u64)(uintptr_t)file * 0x9E3779B97F4A7C15ull + offset;
+	ctx->offset = offset;
+	ctx->size = size;
+}
+
+void region_set_crypto(region_context* ctx, u8 key[16], u8 counter[16], int encrypted)
+{
+	memcpy(ctx->key, key, 16);
+	memcpy(ctx->counter, counter, 16);
+	ctx->encrypted = encrypted;
+}
+
+// Names the region's decrypted contents. Regions with the same image id
+// hold the same bytes in any process, so they may use the shared cache.
+void region_set_image(region_context* ctx, u64 image)
+{
+	ctx->image = image;
+	ctx->shared = 1;
+}
+
+// Blocks can go to the disk cache only if they can be checked on the way
+// back and belong to a content image id that is stable across mounts.
+void region_set_verifier(region_context* ctx, region_verifier verify, void* arg)
+{
+	ctx->verify = verify;
+	ctx->verifyarg = arg;
+}
+
+// Routes the region's data reads through reader instead of stdio.
+void region_set_reader(region_context* ctx, reader_context* reader)
+{
+	ctx->reader = reader;
+}
+
+static int region_disk_usable(region_context* ctx, u64 blockoffset, u32 size)
+{
+	return ctx->shared && ctx->verify && diskcache_enabled() && ctx->verify(ctx->verifyarg, blockoffset, 0, size);
+}
+
+static int region_disk_get(region_context* ctx, u64 blockoffset, u8* block, u32 size)
+{
+	int verified;
+
+	if (!region_disk_usable(ctx, blockoffset, size))
+		return 0;
+	if (!diskcache_get(ctx->image, blockoffset, block, size, &verified))
+		return 0;
+
+	if (!verified)
+	{
+		if (!ctx->verify(ctx->verifyarg, blockoffset, block, size))
+		{
+			stats_add(STATS_DISKCACHE_REJECTS, 1);
+			return 0;
+		}
+		diskcache_set_verified(ctx->image, blockoffset);
+	}
+	return 1;
+}
+
+static void region_disk_put(region_context* ctx, u64 blockoffset, const u8* block, u32 size)
+{
+	if (region_disk_usable(ctx, blockoffset, size))
+		diskcache_put(ctx->image, blockoffset, block, size, 0);
+}
+
+static int region_cache_contains(region_context* ctx, u64 blockoffset)
+{
+	if (ctx->shared && shmcache_enabled() && shmcache_contains(ctx->image, blockoffset))
+		return 1;
+	return blockcache_contains(ctx->image, blockoffset);
+}
+
+static int region_cache_get(region_context* ctx, u64 blockoffset, u8* buffer, u32 start, u32 size)
+{
+	if (ctx->shared && shmcache_enabled() && shmcache_get(ctx->image, blockoffset, buffer, start, size))
+		return 1;
+	return blockcache_get(ctx->image, blockoffset, buffer, start, size);
+}
+
+// Every process that maps the shared cache takes what it finds there on
+// trust, so a block goes there only once it has been checked against the
+// image's own hashes; checked says the caller already did. Anything else,
+// such as the IVFC header and hash levels, stays in this process's cache.
+static void region_cache_put(region_context* ctx, u64 blockoffset, const u8* buffer, u32 size, int checked)
+{
+	if (ctx->shared && shmcache_enabled() && ctx->verify &&
+	    (checked || ctx->verify(ctx->verifyarg, blockoffset, buffer, size)))
+		shmcache_put(ctx->image, blockoffset, buffer, size);
+	else
+		blockcache_put(ctx->image, blockoffset, buffer, size);
+}
+
+// Decrypts size bytes that sit at offset within the region. offset does
+// not need to be block aligned.
+static void region_crypt(region_context* ctx, u64 offset, u8* buffer, size_t size)
+{
+	ctr_aes_context aes;
+	u8 stream[16];
+	u64 block = offset / 16;
+	u32 skip = offset % 16;
+	u32 i, max;
+
+	ctr_init_counter(&aes, ctx->key, ctx->counter);
+	while(block > 0xFFFFFFFF)
+	{
+		ctr_add_counter(&aes, 0xFFFFFFFF);
+		block -= 0xFFFFFFFF;
+	}
+	ctr_add_counter(&aes, (u32)block);
+
+	if (skip)
+	{
+		memset(stream, 0, 16);
+		ctr_crypt_counter_block(&aes, stream, stream);
+
+		max = 16 - skip;
+		if (max > size)
+			max = size;
+		for(i=0; i<max; i++)
+			buffer[i] ^= stream[skip + i];
+
+		buffer += max;
+		size -= max;
+	}
+
+	if (size)
+		ctr_crypt_counter(&aes, buffer, buffer, size);
+}
+
+// Reads straight from the file, bypassing the block cache.
+int region_read_raw(region_context* ctx, u64 offset, void* buffer, size_t size)
+{
+	size_t count = 0;
+
+	if (offset > ctx->size || size > ctx->size - offset)
+		return 0;
+
+	if (ctx->reader)
+	{
+		if (!reader_read(ctx->reader, ctx->offset + offset, buffer, size))
+			return 0;
+	}
+	else
+	{
+		// Seek and read must not interleave with another thread's.
+		flockfile(ctx->file);
+		if (fseeko(ctx->file, ctx->offset + offset, SEEK_SET) == 0)
+			count = fread(buffer, 1, size, ctx->file);
+		funlockfile(ctx->file);
+
+		if (count != size)
+			return 0;
+	}
+
+	if (ctx->encrypted)
+		region_crypt(ctx, offset, buffer, size);
+
+	return 1;
+}
+
+// Fills a whole block from the disk cache, or failing that from the file.
+// checked says the block came from the disk cache and so has been checked.
+static int region_fill(region_context* ctx, u64 blockoffset, u8* block, u32 size, int* checked)
+{
+	*checked = region_disk_get(ctx, blockoffset, block, size);
+	if (*checked)
+		return 1;
+	if (!region_read_raw(ctx, blockoffset, block, size))
+		return 0;
+	region_disk_put(ctx, blockoffset, block, size);
+	return 1;
+}
+
+// Drops a reference to flight. Called with flightlock held.
+static void region_flight_release(region_flight* flight)
+{
+	if (--flight->refs)
+		return;
+	pthread_cond_destroy(&flight->cond);
+	free(flight->data);
+	free(flight);
+}
+
+// Returns the fill of a block in progress, if any. Called with flightlock
+// held.
+static region_flight* region_flight_find(region_context* ctx, u64 blockoffset, u32 size)
+{
+	region_flight* flight;
+
+	for(flight = flights; flight; flight = flight->next)
+	{
+		if (flight->image == ctx->image && flight->offset == blockoffset && flight->size == size)
+			break;
+	}
+	return flight;
+}
+
+// Records the caller as filling a block, so that others who want it wait
+// for the result. Returns 0 if there is no memory for that; the fill then
+// goes ahead unshared. Called with flightlock held.
+static region_flight* region_flight_start(region_context* ctx, u64 blockoffset, u32 size)
+{
+	region_flight* flight = calloc(1, sizeof(region_flight));
+
+	if (flight)
+	{
+		flight->image = ctx->image;
+		flight->offset = blockoffset;
+		flight->size = size;
+		flight->refs = 1;
+		pthread_cond_init(&flight->cond, 0);
+		flight->next = flights;
+		flights = flight;
+	}
+	return flight;
+}
+
+// Ends a fill, handing block to anyone waiting for it.
+static void region_flight_finish(region_flight* flight, const u8* block, int ok)
+{
+	region_flight** link;
+
+	pthread_mutex_lock(&flightlock);
+	if (ok && flight->refs > 1)
+	{
+		flight->data = malloc(flight->size);
+		if (flight->data)
+			memcpy(flight->data, block, flight->size);
+	}
+	flight->ok = flight->data != 0;
+	flight->done = 1;
+	__atomic_add_fetch(&landed, 1, __ATOMIC_RELEASE);
+	for(link = &flights; *link != flight; link = &(*link)->next)
+		;
+	*link = flight->next;
+	pthread_cond_broadcast(&flight->cond);
+	region_flight_release(flight);
+	pthread_mutex_unlock(&flightlock);
+}
+
+// Fills a block and caches it. Only one reader at a time fills any given
+// block, read-ahead included; others that want it meanwhile share the
+// result. seen is the value of landed from before the caller's cache miss.
+static int region_load(region_context* ctx, u64 blockoffset, u8* block, u32 size, u64 seen)
+{
+	region_flight* flight;
+	int checked;
+	int ok;
+
+	pthread_mutex_lock(&flightlock);
+	flight = region_flight_find(ctx, blockoffset, size);
+	if (flight)
+	{
+		flight->refs++;
+		stats_add(STATS_INFLIGHT_WAITS, 1);
+		while(!flight->done)
+			pthread_cond_wait(&flight->cond, &flightlock);
+		ok = flight->ok;
+		if (ok)
+			memcpy(block, flight->data, size);
+		region_flight_release(flight);
+		pthread_mutex_unlock(&flightlock);
+
+		// The fill failed or couldn't be shared; try for ourselves.
+		if (!ok && region_fill(ctx, blockoffset, block, size, &checked))
+		{
+			region_cache_put(ctx, blockoffset, block, size, checked);
+			ok = 1;
+		}
+		return ok;
+	}
+
+	// A fill may have finished between our miss and taking the lock.
+	if (landed != seen && region_cache_get(ctx, blockoffset, block, 0, size))
+	{
+		pthread_mutex_unlock(&flightlock);
+		return 1;
+	}
+
+	flight = region_flight_start(ctx, blockoffset, size);
+	pthread_mutex_unlock(&flightlock);
+
+	ok = region_fill(ctx, blockoffset, block, size, &checked);
+	if (ok)
+		region_cache_put(ctx, blockoffset, block, size, checked);
+
+	if (flight)
+		region_flight_finish(flight, block, ok);
+	return ok;
+}
+
+// Reports whether region_read keeps what it decrypts anywhere, which is
+// what makes reading ahead worth it.
+int region_cached(region_context* ctx)
+{
+	return (ctx->shared && (shmcache_enabled() || diskcache_enabled())) || blockcache_enabled();
+}
+
+// Reads decrypted bytes through the block cache, or the shared cache for
+// regions with a content image id. Blocks are aligned to the start of the
+// region, so one block never mixes two keys.
+int region_read(region_context* ctx, u64 offset, void* buffer, size_t size)
+{
+	TRACE_SPAN("region_read");
+	u8* output = buffer;
+	u8* block = 0;
+	int result = 0;
+
+	if (!region_cached(ctx))
+		return region_read_raw(ctx, offset, buffer, size);
+
+	if (offset > ctx->size || size > ctx->size - offset)
+		return 0;
+
+	while(size)
+	{
+		u64 blockoffset = offset & ~(u64)(BLOCKCACHE_BLOCKSIZE - 1);
+		u32 start = offset - blockoffset;
+		u32 blocksize = BLOCKCACHE_BLOCKSIZE;
+		u64 seen = __atomic_load_n(&landed, __ATOMIC_ACQUIRE);
+		u32 max;
+
+		if (blocksize > ctx->size - blockoffset)
+			blocksize = ctx->size - blockoffset;
+		max = blocksize - start;
+		if (max > size)
+			max = size;
+
+		if (!region_cache_get(ctx, blockoffset, output, start, max))
+		{
+			if (start == 0 && max == blocksize)
+			{
+				// Whole block wanted: fill the caller's buffer directly.
+				if (!region_load(ctx, blockoffset, output, blocksize, seen))
+					goto clean;
+			}
+			else
+			{
+				if (block == 0)
+					block = malloc(BLOCKCACHE_BLOCKSIZE);
+				if (block == 0 || !region_load(ctx, blockoffset, block, blocksize, seen))
+					goto clean;
+				memcpy(output, block + start, max);
+			}
+		}
+
+		output += max;
+		offset += max;
+		size -= max;
+	}
+	result = 1;
+
+clean:
+	free(block);
+	return result;
+}
+
+#if READER_BUFSIZE < BLOCKCACHE_BLOCKSIZE
+#error "reader queue buffers must hold a whole cache block"
+#endif
+
+// Brings the blocks under [offset, offset+size) into the cache, keeping up
+// to READER_QUEUE_DEPTH reads in flight on queue. Blocks already cached or
+// being filled are skipped. Like a region_read miss, each block is recorded
+// as a fill in progress until it lands, is taken from the disk cache when
+// that can vouch for it, and lands in both caches.
+int region_prefetch(region_context* ctx, reader_queue* queue, u64 offset, u64 size)
+{
+	TRACE_SPAN("region_prefetch");
+	reader_request requests[READER_QUEUE_DEPTH];
+	reader_request* request;
+	reader_request* idle = 0;
+	region_flight* flight;
+	u64 next = offset & ~(u64)(BLOCKCACHE_BLOCKSIZE - 1);
+	u64 end = offset + size;
+	u32 i;
+	int result = 1;
+
+	if (end > ctx->size)
+		end = ctx->size;
+
+	for(i=0; i<READER_QUEUE_DEPTH; i++)
+	{
+		requests[i].buffer = queue->buffers + i * READER_BUFSIZE;
+		requests[i].next = idle;
+		idle = &requests[i];
+	}
+
+	for(;;)
+	{
+		while(next < end && idle)
+		{
+			u64 blockoffset = next;
+			u32 blocksize = BLOCKCACHE_BLOCKSIZE;
+			u64 seen = __atomic_load_n(&landed, __ATOMIC_ACQUIRE);
+
+			if (blocksize > ctx->size - blockoffset)
+				blocksize = ctx->size - blockoffset;
+			next += blocksize;
+
+			if (region_cache_contains(ctx, blockoffset))
+				continue;
+
+			pthread_mutex_lock(&flightlock);
+			flight = 0;
+			if (region_flight_find(ctx, blockoffset, blocksize) == 0 &&
+			    (landed == seen || !region_cache_contains(ctx, blockoffset)))
+				flight = region_flight_start(ctx, blockoffset, blocksize);
+			pthread_mutex_unlock(&flightlock);
+			if (flight == 0)
+				continue;
+
+			request = idle;
+			if (region_disk_get(ctx, blockoffset, request->buffer, blocksize))
+			{
+				region_cache_put(ctx, blockoffset, request->buffer, blocksize, 1);
+				region_flight_finish(flight, request->buffer, 1);
+				stats_add(STATS_PREFETCH_BYTES, blocksize);
+				continue;
+			}
+
+			idle = request->next;
+			request->offset = ctx->offset + blockoffset;
+			request->size = blocksize;
+			request->arg = flight;
+			if (!reader_submit(queue, request))
+			{
+				region_flight_finish(flight, 0, 0);
+				request->next = idle;
+				idle = request;
+				next = blockoffset;
+				break;
+			}
+		}
+
+		request = reader_complete(queue);
+		if (request == 0)
+			break;
+
+		flight = request->arg;
+		if (request->result)
+		{
+			u64 blockoffset = flight->offset;
+
+			if (ctx->encrypted)
+				region_crypt(ctx, blockoffset, request->buffer, request->size);
+			region_disk_put(ctx, blockoffset, request->buffer, request->size);
+			region_cache_put(ctx, blockoffset, request->buffer, request->size, 0);
+			stats_add(STATS_PREFETCH_BYTES, request->size);
+		}
+		else
+			result = 0;
+		region_flight_finish(flight, request->buffer, request->result);
+
+		request->next = idle;
+		idle = request;
+	}
+
+	return result;
+}
+
+// Returns the plaintext bytes at [offset, offset+size) of the region in
+// place, or 0 if they would have to be read or decrypted first.
+const u8* region_map(region_context* ctx, u64 offset, u64 size)
+{
+	if (ctx->reader == 0 || ctx->encrypted)
+		return 0;
+	if (offset > ctx->size || size > ctx->size - offset)
+		return 0;
+	return reader_map(ctx->reader, ctx->offset + offset, size);
+}
+
+// Finds a file descriptor holding [offset, offset+size) of the region as
+// plaintext, so it can be passed on without a copy: the image itself when
+// the region isn't encrypted (and isn't read with O_DIRECT, whose point is
+// to stay out of the page cache), else the disk cache once the range is
+// there decrypted and verified.
+int region_locate(region_context* ctx, u64 offset, u64 size, int* fd, u64* position)
+{
+	if (!ctx->encrypted && ctx->reader && ctx->reader->fd >= 0 && ctx->reader->directfd < 0)
+	{
+		if (offset > ctx->size || size > ctx->size - offset)
+			return 0;
+		*fd = ctx->reader->fd;
+		*position = ctx->offset + offset;
+		return 1;
+	}
+
+	if (!ctx->shared || !ctx->verify || !diskcache_enabled())
+		return 0;
+	if (!diskcache_locate(ctx->image, offset, size, fd))
+		return 0;
+
+	*position = offset;
+	return 1;
+}
+
+// Checks [offset, offset+size) against the image's own hashes, for a sweep
+// over the whole region. A range that is a whole block is taken from the
+// disk cache when it is there, and kept there verified once it passes, so
+// later reads of it skip the check. Returns 1 only if the range passed.
+int region_check(region_context* ctx, u64 offset, u8* buffer, u32 size)
+{
+	u64 blocksize = ctx->size - offset < BLOCKCACHE_BLOCKSIZE ? ctx->size - offset : BLOCKCACHE_BLOCKSIZE;
+	int whole = offset % BLOCKCACHE_BLOCKSIZE == 0 && size == blocksize && region_disk_usable(ctx, offset, size);
+	int verified;
+
+	if (!ctx->verify || !ctx->verify(ctx->verifyarg, offset, 0, size))
+		return 0;
+
+	if (whole && diskcache_get(ctx->image, offset, buffer, size, &verified))
+	{
+		if (verified)
+			return 1;
+		if (ctx->verify(ctx->verifyarg, offset, buffer, size))
+		{
+			diskcache_set_verified(ctx->image, offset);
+			return 1;
+		}
+		stats_add(STATS_DISKCACHE_REJECTS, 1);
+	}
+
+	if (!region_read_raw(ctx, offset, buffer, size))
+		return 0;
+	if (!ctx->verify(ctx->verifyarg, offset, buffer, size))
+		return 0;
+	if (whole)
+		diskcache_put(ctx->image, offset, buffer, size, 1);
+	return 1;
+}
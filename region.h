@@ -0,0 +1,50 @@
+#ifndef _REGION_H_
+#define _REGION_H_
+
+#include <stdio.h>
+#include "types.h"
+#include "reader.h"
+
+// Checks decrypted data at offset within a region against the image's own
+// hashes. With data == 0 it only reports whether the range can be checked.
+typedef int (*region_verifier)(void* arg, u64 offset, const u8* data, u32 size);
+
+// A contiguous byte range of the input file, optionally AES-CTR encrypted
+// with a counter that starts at the beginning of the range.
+typedef struct
+{
+	FILE* file;
+	reader_context* reader;	// when set, used instead of file for data reads
+	u64 image;
+	int shared;			// image names the content, not this process's stream
+	u64 offset;
+	u64 size;
+	u8 key[16];
+	u8 counter[16];
+	int encrypted;
+	region_verifier verify;
+	void* verifyarg;
+} region_context;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void region_init(region_context* ctx, FILE* file, u64 offset, u64 size);
+void region_set_crypto(region_context* ctx, u8 key[16], u8 counter[16], int encrypted);
+void region_set_image(region_context* ctx, u64 image);
+void region_set_verifier(region_context* ctx, region_verifier verify, void* arg);
+void region_set_reader(region_context* ctx, reader_context* reader);
+int  region_read(region_context* ctx, u64 offset, void* buffer, size_t size);
+int  region_read_raw(region_context* ctx, u64 offset, void* buffer, size_t size);
+int  region_cached(region_context* ctx);
+int  region_prefetch(region_context* ctx, reader_queue* queue, u64 offset, u64 size);
+const u8* region_map(region_context* ctx, u64 offset, u64 size);
+int  region_locate(region_context* ctx, u64 offset, u64 size, int* fd, u64* position);
+int  region_check(region_context* ctx, u64 offset, u8* buffer, u32 size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _REGION_H_
@@ -7,10 +7,16 @@
 #include "types.h"
 #include "romfs.h"
 #include "utils.h"
+#include "log.h"
+#include "trace.h"
+#include "mem.h"
+#include "utf16.h"
 
 void romfs_init(romfs_context* ctx)
 {
 	memset(ctx, 0, sizeof(romfs_context));
+	pthread_mutex_init(&ctx->blocklock, 0);
+	pthread_mutex_init(&ctx->totalslock, 0);
 	ivfc_init(&ctx->ivfc);
 }
 
@@ -19,12 +25,17 @@ void romfs_set_file(romfs_context* ctx, FILE* file)
 	ctx->file = file;
 }
 
-void romfs_set_offset(romfs_context* ctx, u32 offset)
+void romfs_set_reader(romfs_context* ctx, reader_context* reader)
+{
+	ctx->reader = reader;
+}
+
+void romfs_set_offset(romfs_context* ctx, u64 offset)
 {
 	ctx->offset = offset;
 }
 
-void romfs_set_size(romfs_context* ctx, u32 size)
+void romfs_set_size(romfs_context* ctx, u64 size)
 {
 	ctx->size = size;
 }
@@ -34,39 +45,144 @@ void romfs_set_usersettings(romfs_context* ctx, settings* usersettings)
 	ctx->usersettings = usersettings;
 }
 
+void romfs_set_counter(romfs_context* ctx, u8 counter[16])
+{
+	memcpy(ctx->counter, counter, 16);
+}
+
+void romfs_set_key(romfs_context* ctx, u8 key[16])
+{
+	memcpy(ctx->key, key, 16);
+}
+
+void romfs_set_imageid(romfs_context* ctx, u64 imageid)
+{
+	ctx->imageid = imageid;
+}
+
+void romfs_set_encrypted(romfs_context* ctx, u32 encrypted)
+{
+	ctx->encrypted = encrypted;
+}
+
+// The hash from the NCCH header that the RomFS hash tree is anchored to.
+// Without it no block is taken as verified.
+void romfs_set_superblock(romfs_context* ctx, const u8 hash[0x20], u64 size)
+{
+	memcpy(ctx->superblockhash, hash, 0x20);
+	ctx->superblocksize = size;
+}
+
+
+
+static int romfs_verify_block(void* arg, u64 offset, const u8* data, u32 size)
+{
+	romfs_context* ctx = arg;
+
+	return ivfc_verify_block(&ctx->ivfc, offset, data, size);
+}
+
+static u8* romfs_load_block(romfs_context* ctx, u64 offset, u32 size)
+{
+	u8* block = malloc(size);
+
+	if (block && !region_read(&ctx->region, offset - ctx->offset, block, size))
+	{
+		free(block);
+		block = 0;
+	}
+	if (block)
+		mem_charge(size);
+	return block;
+}
+
+// Returns the directory or file metadata block, reading it in again if it
+// was evicted. Callers must be inside a mem_read_begin section.
+static const u8* romfs_get_block(romfs_context* ctx, const u8** slot, u64 offset, u32 size)
+{
+	const u8* block = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+	if (block || ctx->mapped || offset == 0)
+		return block;
+
+	pthread_mutex_lock(&ctx->blocklock);
+	block = *slot;
+	if (!block)
+	{
+		block = romfs_load_block(ctx, offset, size);
+		__atomic_store_n(slot, block, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&ctx->blocklock);
+	return block;
+}
+
+// Drops the copied metadata blocks; they are read in again on next use.
+// Returns the number of bytes freed.
+u64 romfs_evict(romfs_context* ctx)
+{
+	const u8* dirblock;
+	const u8* fileblock;
+	u64 freed = 0;
+
+	pthread_mutex_lock(&ctx->blocklock);
+	if (ctx->mapped)
+	{
+		pthread_mutex_unlock(&ctx->blocklock);
+		return 0;
+	}
+	dirblock = __atomic_exchange_n(&ctx->dirblock, 0, __ATOMIC_ACQ_REL);
+	fileblock = __atomic_exchange_n(&ctx->fileblock, 0, __ATOMIC_ACQ_REL);
+	pthread_mutex_unlock(&ctx->blocklock);
+
+	if (!dirblock && !fileblock)
+		return 0;
 
+	mem_synchronize();
+	if (dirblock)
+		freed += ctx->dirblocksize;
+	if (fileblock)
+		freed += ctx->fileblocksize;
+	free((void*)dirblock);
+	free((void*)fileblock);
+	mem_charge(-(s64)freed);
+	return freed;
+}
 
 void romfs_process(romfs_context* ctx, u32 actions)
 {
-	u32 dirblockoffset = 0;
+	u64 dirblockoffset = 0;
 	u32 dirblocksize = 0;
-	u32 fileblockoffset = 0;
+	u64 fileblockoffset = 0;
 	u32 fileblocksize = 0;
 
 
-	ivfc_set_offset(&ctx->ivfc, ctx->offset);
-	ivfc_set_size(&ctx->ivfc, ctx->size);
-	ivfc_set_file(&ctx->ivfc, ctx->file);
+	region_init(&ctx->region, ctx->file, ctx->offset, ctx->size);
+	region_set_reader(&ctx->region, ctx->reader);
+	region_set_crypto(&ctx->region, ctx->key, ctx->counter, ctx->encrypted);
+	if (ctx->imageid)
+		region_set_image(&ctx->region, ctx->imageid);
+
+	ivfc_set_region(&ctx->ivfc, &ctx->region);
 	ivfc_set_usersettings(&ctx->ivfc, ctx->usersettings);
+	ivfc_set_superblock(&ctx->ivfc, ctx->superblockhash, ctx->superblocksize);
 	ivfc_process(&ctx->ivfc, actions);
+	region_set_verifier(&ctx->region, romfs_verify_block, ctx);
 
-	fseek(ctx->file, ctx->offset, SEEK_SET);
-	fread(&ctx->header, 1, sizeof(romfs_header), ctx->file);
+	region_read(&ctx->region, 0, &ctx->header, sizeof(romfs_header));
 
 	if (getle32(ctx->header.magic) != MAGIC_IVFC)
 	{
-		fprintf(stdout, "Error, RomFS corrupted\n");
+		log_error("Error, RomFS corrupted");
 		return;
 	}
 
 	ctx->infoblockoffset = ctx->offset + 0x1000;
 
-	fseek(ctx->file, ctx->infoblockoffset, SEEK_SET);
-	fread(&ctx->infoheader, 1, sizeof(romfs_infoheader), ctx->file);
+	region_read(&ctx->region, ctx->infoblockoffset - ctx->offset, &ctx->infoheader, sizeof(romfs_infoheader));
 	
 	if (getle32(ctx->infoheader.headersize) != sizeof(romfs_infoheader))
 	{
-		fprintf(stderr, "Error, info header mismatch\n");
+		log_error("Error, info header mismatch");
 		return;
 	}
 
@@ -75,24 +191,24 @@ void romfs_process(romfs_context* ctx, u32 actions)
 	fileblockoffset = ctx->infoblockoffset + getle32(ctx->infoheader.section[3].offset);
 	fileblocksize = getle32(ctx->infoheader.section[3].size);
 
-	ctx->dirblock = malloc(dirblocksize);
-	ctx->dirblocksize = dirblocksize;
-	ctx->fileblock = malloc(fileblocksize);
-	ctx->fileblocksize = fileblocksize;
-
 	ctx->datablockoffset = ctx->infoblockoffset + getle32(ctx->infoheader.dataoffset);
 
-	if (ctx->dirblock)
-	{
-		fseek(ctx->file, dirblockoffset, SEEK_SET);
-		fread(ctx->dirblock, 1, dirblocksize, ctx->file);
-	}
-
-	if (ctx->fileblock)
+	// Plaintext metadata of a mapped image is used where it lies, so a
+	// mount only faults in the entries it looks at.
+	pthread_mutex_lock(&ctx->blocklock);
+	ctx->dirblocksize = dirblocksize;
+	ctx->fileblocksize = fileblocksize;
+	ctx->dirblockoffset = dirblockoffset;
+	ctx->fileblockoffset = fileblockoffset;
+	ctx->dirblock = region_map(&ctx->region, dirblockoffset - ctx->offset, dirblocksize);
+	ctx->fileblock = region_map(&ctx->region, fileblockoffset - ctx->offset, fileblocksize);
+	ctx->mapped = ctx->dirblock && ctx->fileblock;
+	if (!ctx->mapped)
 	{
-		fseek(ctx->file, fileblockoffset, SEEK_SET);
-		fread(ctx->fileblock, 1, fileblocksize, ctx->file);
+		ctx->dirblock = romfs_load_block(ctx, dirblockoffset, dirblocksize);
+		ctx->fileblock = romfs_load_block(ctx, fileblockoffset, fileblocksize);
 	}
+	pthread_mutex_unlock(&ctx->blocklock);
 
 	if (actions & InfoFlag)
 		romfs_print(ctx);
@@ -103,13 +219,15 @@ void romfs_process(romfs_context* ctx, u32 actions)
 
 int romfs_dirblock_read(romfs_context* ctx, u32 diroffset, u32 dirsize, void* buffer)
 {
-	if (!ctx->dirblock)
+	const u8* dirblock = romfs_get_block(ctx, &ctx->dirblock, ctx->dirblockoffset, ctx->dirblocksize);
+
+	if (!dirblock)
 		return 0;
 
-	if (diroffset+dirsize > ctx->dirblocksize)
+	if (diroffset > ctx->dirblocksize || dirsize > ctx->dirblocksize - diroffset)
 		return 0;
 
-	memcpy(buffer, ctx->dirblock + diroffset, dirsize);
+	memcpy(buffer, dirblock + diroffset, dirsize);
 	return 1;
 }
 
@@ -119,9 +237,6 @@ int romfs_dirblock_readentry(romfs_context* ctx, u32 diroffset, romfs_direntry*
 	u32 namesize;
 
 
-	if (!ctx->dirblock)
-		return 0;
-
 	if (!romfs_dirblock_read(ctx, diroffset, size_without_name, entry))
 		return 0;
 	
@@ -138,13 +253,15 @@ int romfs_dirblock_readentry(romfs_context* ctx, u32 diroffset, romfs_direntry*
 
 int romfs_fileblock_read(romfs_context* ctx, u32 fileoffset, u32 filesize, void* buffer)
 {
-	if (!ctx->fileblock)
+	const u8* fileblock = romfs_get_block(ctx, &ctx->fileblock, ctx->fileblockoffset, ctx->fileblocksize);
+
+	if (!fileblock)
 		return 0;
 
-	if (fileoffset+filesize > ctx->fileblocksize)
+	if (fileoffset > ctx->fileblocksize || filesize > ctx->fileblocksize - fileoffset)
 		return 0;
 
-	memcpy(buffer, ctx->fileblock + fileoffset, filesize);
+	memcpy(buffer, fileblock + fileoffset, filesize);
 	return 1;
 }
 
@@ -154,9 +271,6 @@ int romfs_fileblock_readentry(romfs_context* ctx, u32 fileoffset, romfs_fileentr
 	u32 namesize;
 
 
-	if (!ctx->fileblock)
-		return 0;
-
 	if (!romfs_fileblock_read(ctx, fileoffset, size_without_name, entry))
 		return 0;
 	
@@ -172,6 +286,238 @@ int romfs_fileblock_readentry(romfs_context* ctx, u32 fileoffset, romfs_fileentr
 
 
 
+#define ROMFS_DIRENTRY_SIZE		0x18	// entries without their names
+#define ROMFS_FILEENTRY_SIZE	0x20
+
+static romfs_dirtotal* romfs_find_total(romfs_dirtotal* totals, u32 count, u32 diroffset)
+{
+	u32 lo = 0;
+	u32 hi = count;
+
+	while(lo < hi)
+	{
+		u32 mid = lo + (hi - lo) / 2;
+
+		if (totals[mid].diroffset == diroffset)
+			return totals + mid;
+		if (totals[mid].diroffset < diroffset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return 0;
+}
+
+// Builds recursive totals for every directory with one walk over each
+// metadata table: directory entries in table order, then each file added
+// to its parent, then the sums rolled up from the deepest directories.
+static int romfs_build_totals(romfs_context* ctx, romfs_dirtotal** totalsp, u32* countp)
+{
+	const u8* dirblock = romfs_get_block(ctx, &ctx->dirblock, ctx->dirblockoffset, ctx->dirblocksize);
+	const u8* fileblock = romfs_get_block(ctx, &ctx->fileblock, ctx->fileblockoffset, ctx->fileblocksize);
+	romfs_dirtotal* totals = 0;
+	u32* order = 0;
+	u8* seen = 0;
+	u32 count = 0;
+	u32 head, tail;
+	u32 offset;
+	u32 i;
+	int result = 0;
+
+
+	if (!dirblock || !fileblock)
+		goto clean;
+
+	// Name sizes come from the image; one running past the table would wrap
+	// offset, so the table is rejected. The walks below trust this one.
+	for(offset=0; offset + ROMFS_DIRENTRY_SIZE <= ctx->dirblocksize; count++)
+	{
+		u32 namesize = getle32(dirblock + offset + 0x14);
+
+		if (namesize > ctx->dirblocksize - offset - ROMFS_DIRENTRY_SIZE)
+			goto clean;
+		offset += ROMFS_DIRENTRY_SIZE + align(namesize, 4);
+	}
+	for(offset=0; offset + ROMFS_FILEENTRY_SIZE <= ctx->fileblocksize; )
+	{
+		u32 namesize = getle32(fileblock + offset + 0x1C);
+
+		if (namesize > ctx->fileblocksize - offset - ROMFS_FILEENTRY_SIZE)
+			goto clean;
+		offset += ROMFS_FILEENTRY_SIZE + align(namesize, 4);
+	}
+	if (count == 0)
+		goto clean;
+
+	totals = calloc(count, sizeof(romfs_dirtotal));
+	order = malloc(count * sizeof(u32));
+	seen = calloc(count, 1);
+	if (!totals || !order || !seen)
+		goto clean;
+
+	for(i=0, offset=0; i<count; i++)
+	{
+		totals[i].diroffset = offset;
+		offset += ROMFS_DIRENTRY_SIZE + align(getle32(dirblock + offset + 0x14), 4);
+	}
+
+	for(offset=0; offset + ROMFS_FILEENTRY_SIZE <= ctx->fileblocksize; )
+	{
+		const romfs_fileentry* entry = (const romfs_fileentry*)(fileblock + offset);
+		romfs_dirtotal* parent = romfs_find_total(totals, count, getle32(entry->parentdiroffset));
+
+		if (parent)
+		{
+			parent->bytes += getle64(entry->datasize);
+			parent->files++;
+		}
+		offset += ROMFS_FILEENTRY_SIZE + align(getle32(entry->namesize), 4);
+	}
+
+	// Breadth first from the root puts every parent before its children,
+	// whatever order the table is in. seen guards against looping tables.
+	order[0] = 0;
+	seen[0] = 1;
+	for(head=0, tail=1; head<tail; head++)
+	{
+		u32 child = getle32(dirblock + totals[order[head]].diroffset + 8);
+
+		while(child != (u32)~0)
+		{
+			romfs_dirtotal* total = romfs_find_total(totals, count, child);
+
+			if (!total || seen[total - totals])
+				break;
+			seen[total - totals] = 1;
+			total->parent = order[head];
+			order[tail++] = total - totals;
+			child = getle32(dirblock + child + 4);
+		}
+	}
+
+	for(i=tail-1; i>0; i--)
+	{
+		romfs_dirtotal* total = totals + order[i];
+		romfs_dirtotal* parent = totals + total->parent;
+
+		parent->bytes += total->bytes;
+		parent->files += total->files;
+		parent->dirs += total->dirs + 1;
+	}
+
+	*totalsp = totals;
+	*countp = count;
+	totals = 0;
+	result = 1;
+
+clean:
+	free(totals);
+	free(order);
+	free(seen);
+	return result;
+}
+
+// Looks up the recursive totals of a directory, building the table for
+// the whole RomFS on first use. Callers must be inside a mem_read_begin
+// section.
+int romfs_get_totals(romfs_context* ctx, u32 diroffset, romfs_dirtotal* total)
+{
+	romfs_dirtotal* totals = __atomic_load_n(&ctx->totals, __ATOMIC_ACQUIRE);
+	romfs_dirtotal* found;
+
+	if (!totals)
+	{
+		u32 count;
+
+		pthread_mutex_lock(&ctx->totalslock);
+		totals = ctx->totals;
+		if (!totals && romfs_build_totals(ctx, &totals, &count))
+		{
+			ctx->totalcount = count;
+			mem_charge(count * sizeof(romfs_dirtotal));
+			__atomic_store_n(&ctx->totals, totals, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&ctx->totalslock);
+		if (!totals)
+			return 0;
+	}
+
+	found = romfs_find_total(totals, ctx->totalcount, diroffset);
+	if (!found)
+		return 0;
+	*total = *found;
+	return 1;
+}
+
+// Calls found for every file whose name matches pattern, in one pass over
+// the file table. Callers must be inside a mem_read_begin section.
+int romfs_search(romfs_context* ctx, const search_pattern* pattern, void (*found)(void* arg, u32 fileoffset), void* arg)
+{
+	const u8* fileblock = romfs_get_block(ctx, &ctx->fileblock, ctx->fileblockoffset, ctx->fileblocksize);
+	u32 offset;
+
+
+	if (!fileblock)
+		return 0;
+
+	for(offset=0; offset + ROMFS_FILEENTRY_SIZE <= ctx->fileblocksize; )
+	{
+		u32 namesize = getle32(fileblock + offset + 0x1C);
+
+		if (namesize > ctx->fileblocksize - offset - ROMFS_FILEENTRY_SIZE)
+			break;
+		if (search_match(pattern, fileblock + offset + ROMFS_FILEENTRY_SIZE, namesize))
+			found(arg, offset);
+		offset += ROMFS_FILEENTRY_SIZE + align(namesize, 4);
+	}
+	return 1;
+}
+
+// Converts an entry name, which readentry cuts to ROMFS_MAXNAMESIZE-2.
+static char* romfs_name(u8* name, u32 namesize)
+{
+	if (namesize > ROMFS_MAXNAMESIZE-2)
+		namesize = ROMFS_MAXNAMESIZE-2;
+	return utf16to8(name, namesize);
+}
+
+// Returns the path of a file below the RomFS root, e.g. "sound/a.bcwav",
+// in a buffer the caller frees. Callers must be inside a mem_read_begin
+// section.
+char* romfs_get_path(romfs_context* ctx, u32 fileoffset)
+{
+	romfs_fileentry file;
+	romfs_direntry dir;
+	char* path;
+	u32 diroffset;
+	u32 depth;
+
+
+	if (!romfs_fileblock_readentry(ctx, fileoffset, &file))
+		return 0;
+	path = romfs_name(file.name, getle32(file.namesize));
+
+	// Directory depth is bounded so a looping table can't hang us.
+	diroffset = getle32(file.parentdiroffset);
+	for(depth=0; diroffset != 0 && depth < 256 && path; depth++)
+	{
+		char* name;
+		char* joined;
+
+		if (!romfs_dirblock_readentry(ctx, diroffset, &dir))
+			break;
+		name = romfs_name(dir.name, getle32(dir.namesize));
+		joined = malloc(strlen(name) + strlen(path) + 2);
+		if (joined)
+			sprintf(joined, "%s/%s", name, path);
+		free(name);
+		free(path);
+		path = joined;
+		diroffset = getle32(dir.parentoffset);
+	}
+	return path;
+}
+
 void romfs_visit_dir(romfs_context* ctx, u32 diroffset, u32 depth, u32 actions, filepath* rootpath)
 {
 	u32 siblingoffset;
@@ -201,7 +547,7 @@ void romfs_visit_dir(romfs_context* ctx, u32 diroffset, u32 depth, u32 actions,
 		}
 		else
 		{
-			fprintf(stderr, "Error creating directory in root %s\n", rootpath->pathname);
+			log_error("Error creating directory in root %s", rootpath->pathname);
 			return;
 		}
 	}
@@ -262,7 +608,7 @@ void romfs_visit_file(romfs_context* ctx, u32 fileoffset, u32 depth, u32 actions
 		}
 		else
 		{
-			fprintf(stderr, "Error creating directory in root %s\n", rootpath->pathname);
+			log_error("Error creating directory in root %s", rootpath->pathname);
 			return;
 		}
 	}
@@ -285,8 +631,29 @@ void romfs_visit_file(romfs_context* ctx, u32 fileoffset, u32 depth, u32 actions
 		romfs_visit_file(ctx, siblingoffset, depth, actions, rootpath);
 }
 
+// Clamps a read of the file at entryoffset and finds where it starts in the
+// RomFS region. Returns 0 if the entry is bad.
+int romfs_locate_file(romfs_context* ctx, u32 entryoffset, off_t offset, size_t* size, u64* regionoffset)
+{
+	romfs_fileentry entry;
+	u64 filesize;
+
+	if (!romfs_fileblock_readentry(ctx, entryoffset, &entry))
+		return 0;
+
+	filesize = getle64(entry.datasize);
+	if (offset < 0 || offset >= filesize)
+		*size = 0;
+	else if (*size > filesize - offset)
+		*size = filesize - offset;
+
+	*regionoffset = ctx->datablockoffset - ctx->offset + getle64(entry.dataoffset) + offset;
+	return 1;
+}
+
 ssize_t romfs_read_file(romfs_context* ctx, u32 entryoffset, char* buf, off_t offset, size_t size)
 {
+	TRACE_SPAN("romfs_read_file");
 	romfs_fileentry entry;
 	if (!romfs_fileblock_readentry(ctx, entryoffset, &entry)) {
 		return -ENOENT;
@@ -295,21 +662,16 @@ ssize_t romfs_read_file(romfs_context* ctx, u32 entryoffset, char* buf, off_t of
 	u64 fileoffset = getle64(entry.dataoffset);
 	u64 filesize = getle64(entry.datasize);
 
-	// TODO: crypto
-
 	if (offset < 0 || offset >= filesize) {
 		return 0;
 	}
 
-	fseeko(ctx->file, ctx->datablockoffset + fileoffset, SEEK_SET);
-	fseeko(ctx->file, offset, SEEK_CUR);
-
 	if (size > filesize - offset) {
 		size = filesize - offset;
 	}
 
-	if (fread(buf, 1, size, ctx->file) != size) {
-		return -errno;
+	if (!region_read(&ctx->region, ctx->datablockoffset - ctx->offset + fileoffset + offset, buf, size)) {
+		return -EIO;
 	}
 
 	return size;
@@ -325,18 +687,12 @@ void romfs_extract_datafile(romfs_context* ctx, u64 offset, u64 size, filepath*
 	if (path == 0 || path->valid == 0)
 		goto clean;
 
-	offset += ctx->datablockoffset;
-	if ( (offset >> 32) )
-	{
-		fprintf(stderr, "Error, support for 64-bit offset not yet implemented.\n");
-		goto clean;
-	}
+	offset += ctx->datablockoffset - ctx->offset;
 
-	fseek(ctx->file, offset, SEEK_SET);
 	outfile = fopen(path->pathname, "wb");
 	if (outfile == 0)
 	{
-		fprintf(stderr, "Error opening file for writing\n");
+		log_error("Error opening file for writing");
 		goto clean;
 	}
 
@@ -346,18 +702,19 @@ void romfs_extract_datafile(romfs_context* ctx, u64 offset, u64 size, filepath*
 		if (max > size)
 			max = size;
 
-		if (max != fread(buffer, 1, max, ctx->file))
+		if (!region_read_raw(&ctx->region, offset, buffer, max))
 		{
-			fprintf(stderr, "Error reading file\n");
+			log_error("Error reading file");
 			goto clean;
 		}
 
 		if (max != fwrite(buffer, 1, max, outfile))
 		{
-			fprintf(stderr, "Error writing file\n");
+			log_error("Error writing file");
 			goto clean;
 		}
 
+		offset += max;
 		size -= max;
 	}
 clean:
@@ -375,9 +732,9 @@ void romfs_print(romfs_context* ctx)
 	fprintf(stdout, "Header size:            0x%08X\n", getle32(ctx->infoheader.headersize));
 	for(i=0; i<4; i++)
 	{
-		fprintf(stdout, "Section %d offset:       0x%08X\n", i, ctx->offset + 0x1000 + getle32(ctx->infoheader.section[i].offset));
+		fprintf(stdout, "Section %d offset:       0x%08llX\n", i, ctx->offset + 0x1000 + getle32(ctx->infoheader.section[i].offset));
 		fprintf(stdout, "Section %d size:         0x%08X\n", i, getle32(ctx->infoheader.section[i].size));
 	}
 
-	fprintf(stdout, "Data offset:            0x%08X\n", ctx->offset + 0x1000 + getle32(ctx->infoheader.dataoffset));
+	fprintf(stdout, "Data offset:            0x%08llX\n", ctx->offset + 0x1000 + getle32(ctx->infoheader.dataoffset));
 }
@@ -1,12 +1,15 @@
 #ifndef __ROMFS_H__
 #define __ROMFS_H__
 
+#include <pthread.h>
 #include "types.h"
 #include "info.h"
 #include "ctr.h"
 #include "filepath.h"
 #include "settings.h"
 #include "ivfc.h"
+#include "region.h"
+#include "search.h"
 
 #define ROMFS_MAXNAMESIZE	254		// limit set by ctrtool
 
@@ -52,20 +55,45 @@ typedef struct
 } romfs_fileentry;
 
 
+// Everything under a directory, recursively.
+typedef struct
+{
+	u32 diroffset;
+	u32 parent;			// index of the parent's entry
+	u64 bytes;			// file data
+	u64 files;
+	u64 dirs;
+} romfs_dirtotal;
+
 typedef struct
 {
 	FILE* file;
+	reader_context* reader;
 	settings* usersettings;
-	u32 offset;
-	u32 size;
+	u8 counter[16];
+	u8 key[16];
+	u64 imageid;
+	u64 offset;
+	u64 size;
+	int encrypted;
+	u8 superblockhash[0x20];
+	u64 superblocksize;
+	region_context region;
 	romfs_header header;
 	romfs_infoheader infoheader;
-	u8* dirblock;
+	const u8* dirblock;
 	u32 dirblocksize;
-	u8* fileblock;
+	const u8* fileblock;
 	u32 fileblocksize;
-	u32 datablockoffset;
-	u32 infoblockoffset;
+	int mapped;			// dirblock and fileblock point into the mapped image
+	u64 dirblockoffset;
+	u64 fileblockoffset;
+	pthread_mutex_t blocklock;	// reloading an evicted dirblock or fileblock
+	romfs_dirtotal* totals;		// by diroffset, built on first use
+	u32 totalcount;
+	pthread_mutex_t totalslock;
+	u64 datablockoffset;
+	u64 infoblockoffset;
 	romfs_direntry direntry;
 	romfs_fileentry fileentry;
 	ivfc_context ivfc;
@@ -73,9 +101,15 @@ typedef struct
 
 void romfs_init(romfs_context* ctx);
 void romfs_set_file(romfs_context* ctx, FILE* file);
-void romfs_set_offset(romfs_context* ctx, u32 offset);
-void romfs_set_size(romfs_context* ctx, u32 size);
+void romfs_set_reader(romfs_context* ctx, reader_context* reader);
+void romfs_set_offset(romfs_context* ctx, u64 offset);
+void romfs_set_size(romfs_context* ctx, u64 size);
 void romfs_set_usersettings(romfs_context* ctx, settings* usersettings);
+void romfs_set_counter(romfs_context* ctx, u8 counter[16]);
+void romfs_set_key(romfs_context* ctx, u8 key[16]);
+void romfs_set_imageid(romfs_context* ctx, u64 imageid);
+void romfs_set_encrypted(romfs_context* ctx, u32 encrypted);
+void romfs_set_superblock(romfs_context* ctx, const u8 hash[0x20], u64 size);
 void romfs_test(romfs_context* ctx);
 int  romfs_dirblock_read(romfs_context* ctx, u32 diroffset, u32 dirsize, void* buffer);
 int  romfs_dirblock_readentry(romfs_context* ctx, u32 diroffset, romfs_direntry* entry);
@@ -85,7 +119,12 @@ void romfs_visit_dir(romfs_context* ctx, u32 diroffset, u32 depth, u32 actions,
 void romfs_visit_file(romfs_context* ctx, u32 fileoffset, u32 depth, u32 actions, filepath* rootpath);
 void romfs_extract_datafile(romfs_context* ctx, u64 offset, u64 size, filepath* path);
 ssize_t romfs_read_file(romfs_context* ctx, u32 entryoffset, char* buf, off_t offset, size_t size);
+int  romfs_locate_file(romfs_context* ctx, u32 entryoffset, off_t offset, size_t* size, u64* regionoffset);
 void romfs_process(romfs_context* ctx, u32 actions);
+u64  romfs_evict(romfs_context* ctx);
+int  romfs_get_totals(romfs_context* ctx, u32 diroffset, romfs_dirtotal* total);
+int  romfs_search(romfs_context* ctx, const search_pattern* pattern, void (*found)(void* arg, u32 fileoffset), void* arg);
+char* romfs_get_path(romfs_context* ctx, u32 fileoffset);
 void romfs_print(romfs_context* ctx);
 
 #endif // __ROMFS_H__
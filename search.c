@@ -0,0 +1,287 @@
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "types.h"
+#include "search.h"
+
+#define SEARCH_NO_STAR	((u32)~0)
+
+static u16 search_unit(const u8* s, u32 i)
+{
+	return s[2*i] | (s[2*i+1] << 8);
+}
+
+// Decodes a UTF-8 pattern into UTF-16 code units. Returns 0 if it is not
+// valid UTF-8 or too long.
+static int search_decode(search_pattern* p, const char* pattern)
+{
+	const u8* s = (const u8*)pattern;
+
+	p->length = 0;
+	while(*s)
+	{
+		u32 c;
+		u32 extra;
+
+		if (s[0] < 0x80)
+			c = s[0], extra = 0;
+		else if ((s[0] & 0xE0) == 0xC0)
+			c = s[0] & 0x1F, extra = 1;
+		else if ((s[0] & 0xF0) == 0xE0)
+			c = s[0] & 0x0F, extra = 2;
+		else if ((s[0] & 0xF8) == 0xF0)
+			c = s[0] & 0x07, extra = 3;
+		else
+			return 0;
+
+		for(s++; extra; extra--, s++)
+		{
+			if ((*s & 0xC0) != 0x80)
+				return 0;
+			c = (c << 6) | (*s & 0x3F);
+		}
+
+		if (c >= 0x10000)
+		{
+			if (p->length + 2 > SEARCH_MAX_PATTERN)
+				return 0;
+			c -= 0x10000;
+			p->pattern[p->length++] = 0xD800 | (c >> 10);
+			p->pattern[p->length++] = 0xDC00 | (c & 0x3FF);
+		}
+		else
+		{
+			if (p->length + 1 > SEARCH_MAX_PATTERN)
+				return 0;
+			p->pattern[p->length++] = c;
+		}
+	}
+	return 1;
+}
+
+// Finds the end of the bracket expression starting at pattern[i], or
+// returns 0 if it is not closed.
+static u32 search_bracket_end(const search_pattern* p, u32 i)
+{
+	u32 first;
+
+	i++;
+	if (i < p->length && (p->pattern[i] == '!' || p->pattern[i] == '^'))
+		i++;
+	first = i;
+	for(; i < p->length; i++)
+	{
+		if (p->pattern[i] == '\\' && i + 1 < p->length)
+			i++;
+		else if (p->pattern[i] == ']' && i != first)
+			return i;
+	}
+	return 0;
+}
+
+// Picks the longest run of plain characters. Any name that matches holds
+// it somewhere, which lets most names be turned away on a quick scan.
+static void search_find_literal(search_pattern* p)
+{
+	u16 run[SEARCH_MAX_PATTERN];
+	u32 runlength = 0;
+	u32 i, j;
+
+	p->literallength = 0;
+	for(i=0; i<=p->length; i++)
+	{
+		u16 c = i < p->length ? p->pattern[i] : '*';
+		u32 end;
+
+		if (c == '\\' && i + 1 < p->length)
+		{
+			run[runlength++] = p->pattern[++i];
+			continue;
+		}
+		if (c == '[' && (end = search_bracket_end(p, i)) != 0)
+			i = end;
+		else if (c != '*' && c != '?')
+		{
+			run[runlength++] = c;
+			continue;
+		}
+
+		if (runlength > p->literallength)
+		{
+			for(j=0; j<runlength; j++)
+			{
+				p->literal[2*j] = run[j] & 0xFF;
+				p->literal[2*j+1] = run[j] >> 8;
+			}
+			p->literallength = runlength;
+		}
+		runlength = 0;
+	}
+}
+
+int search_compile(search_pattern* p, const char* pattern)
+{
+	memset(p, 0, sizeof(search_pattern));
+	if (!search_decode(p, pattern))
+		return 0;
+	search_find_literal(p);
+	return 1;
+}
+
+// Returns 1 if the literal occurs in name. With SSE2, eight positions are
+// tried at once against the literal's first and last units, and only
+// where both agree is the whole literal compared.
+static int search_contains(const search_pattern* p, const u8* name, u32 units)
+{
+	u32 n = p->literallength;
+	u32 i = 0;
+
+	if (n == 0)
+		return 1;
+	if (n > units)
+		return 0;
+
+#ifdef __SSE2__
+	{
+		__m128i first = _mm_set1_epi16(search_unit(p->literal, 0));
+		__m128i last = _mm_set1_epi16(search_unit(p->literal, n - 1));
+
+		for(; i + n - 1 + 8 <= units; i += 8)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i*)(name + 2*i));
+			__m128i b = _mm_loadu_si128((const __m128i*)(name + 2*(i + n - 1)));
+			u32 mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi16(a, first), _mm_cmpeq_epi16(b, last)));
+
+			while(mask)
+			{
+				u32 k = i + (__builtin_ctz(mask) >> 1);
+
+				if (memcmp(name + 2*k, p->literal, 2*n) == 0)
+					return 1;
+				// a matching unit sets two bits
+				mask &= mask - 1;
+				mask &= mask - 1;
+			}
+		}
+	}
+#endif
+
+	for(; i + n <= units; i++)
+	{
+		if (memcmp(name + 2*i, p->literal, 2*n) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+// Matches the bracket expression at pattern[i] against c.
+static int search_bracket_match(const search_pattern* p, u32 i, u32 end, u16 c)
+{
+	int negate = 0;
+	int matched = 0;
+
+	i++;
+	if (p->pattern[i] == '!' || p->pattern[i] == '^')
+	{
+		negate = 1;
+		i++;
+	}
+	for(; i < end; i++)
+	{
+		u16 lo = p->pattern[i];
+		u16 hi;
+
+		if (lo == '\\')
+			lo = p->pattern[++i];
+		hi = lo;
+		if (i + 2 < end && p->pattern[i+1] == '-')
+		{
+			i += 2;
+			hi = p->pattern[i];
+			if (hi == '\\' && i + 1 < end)
+				hi = p->pattern[++i];
+		}
+		if (lo <= c && c <= hi)
+			matched = 1;
+	}
+	return matched != negate;
+}
+
+static int search_glob(const search_pattern* p, const u8* name, u32 units)
+{
+	u32 pi = 0;
+	u32 ni = 0;
+	u32 starpi = SEARCH_NO_STAR;
+	u32 starni = 0;
+
+	while(ni < units)
+	{
+		if (pi < p->length)
+		{
+			u16 c = p->pattern[pi];
+			u16 n = search_unit(name, ni);
+			u32 end;
+
+			if (c == '*')
+			{
+				starpi = ++pi;
+				starni = ni;
+				continue;
+			}
+			if (c == '?')
+			{
+				pi++;
+				ni++;
+				continue;
+			}
+			if (c == '[' && (end = search_bracket_end(p, pi)) != 0)
+			{
+				if (search_bracket_match(p, pi, end, n))
+				{
+					pi = end + 1;
+					ni++;
+					continue;
+				}
+			}
+			else
+			{
+				u32 width = 1;
+
+				if (c == '\\' && pi + 1 < p->length)
+				{
+					c = p->pattern[pi + 1];
+					width = 2;
+				}
+				if (c == n)
+				{
+					pi += width;
+					ni++;
+					continue;
+				}
+			}
+		}
+
+		if (starpi == SEARCH_NO_STAR)
+			return 0;
+		pi = starpi;
+		ni = ++starni;
+	}
+
+	while(pi < p->length && p->pattern[pi] == '*')
+		pi++;
+	return pi == p->length;
+}
+
+// Matches a UTF-16LE name of namesize bytes, as stored in the RomFS file
+// table. ? matches one code unit.
+int search_match(const search_pattern* p, const u8* name, u32 namesize)
+{
+	u32 units = namesize / 2;
+
+	if (!search_contains(p, name, units))
+		return 0;
+	return search_glob(p, name, units);
+}
@@ -0,0 +1,29 @@
+#ifndef _SEARCH_H_
+#define _SEARCH_H_
+
+#include "types.h"
+
+#define SEARCH_MAX_PATTERN		256		// UTF-16 code units
+
+// A glob pattern (*, ?, [...] and \ escapes) ready to match RomFS names
+// where they lie in the metadata table, as UTF-16LE.
+typedef struct
+{
+	u16 pattern[SEARCH_MAX_PATTERN];
+	u32 length;
+	u8 literal[SEARCH_MAX_PATTERN * 2];		// longest run every match contains, UTF-16LE
+	u32 literallength;						// in code units
+} search_pattern;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int search_compile(search_pattern* p, const char* pattern);
+int search_match(const search_pattern* p, const u8* name, u32 namesize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SEARCH_H_
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "types.h"
+#include "shmcache.h"
+#include "blockcache.h"
+#include "stats.h"
+#include "log.h"
+
+static shmcache_header* header;
+static shmcache_slot* slots;
+static u8* data;
+static u32 setcount;
+
+static u64 shmcache_datastart(u32 slotcount)
+{
+	u64 start = sizeof(shmcache_header) + (u64)slotcount * sizeof(shmcache_slot);
+
+	return (start + 4095) & ~4095ull;
+}
+
+static u64 shmcache_hash(u64 image, u64 offset)
+{
+	u64 hash = (image * 0x9E3779B97F4A7C15ull) ^ (offset / BLOCKCACHE_BLOCKSIZE);
+
+	hash ^= hash >> 33;
+	hash *= 0xC4CEB9FE1A85EC53ull;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+// Maps the cache file at path, creating it with room for about size bytes
+// of blocks if it is new. Every process of this user that names the same
+// file (normally on a tmpfs such as /dev/shm) shares the blocks in it; a
+// file that anyone else owns or can open is refused, as what is read from
+// it is not checked again.
+int shmcache_attach(const char* path, u64 size)
+{
+	struct stat st;
+	shmcache_header existing;
+	u32 slotcount;
+	u64 mapsize;
+	void* map = MAP_FAILED;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return 0;
+
+	// Whoever gets here first lays out a new file; the rest wait for it.
+	flock(fd, LOCK_EX);
+	if (fstat(fd, &st) != 0)
+		goto clean;
+	if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077) != 0)
+	{
+		log_error("Error, shared cache %s must be a file only its owner can use", path);
+		goto clean;
+	}
+
+	if (st.st_size == 0)
+	{
+		slotcount = (size - sizeof(shmcache_header)) / (BLOCKCACHE_BLOCKSIZE + sizeof(shmcache_slot));
+		slotcount -= slotcount % SHMCACHE_WAYS;
+		if (size <= sizeof(shmcache_header) || slotcount == 0)
+		{
+			log_error("Error, shared cache size too small");
+			goto clean;
+		}
+
+		mapsize = shmcache_datastart(slotcount) + (u64)slotcount * BLOCKCACHE_BLOCKSIZE;
+		if (ftruncate(fd, mapsize) != 0)
+			goto clean;
+
+		map = mmap(0, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			goto clean;
+
+		header = map;
+		header->version = SHMCACHE_VERSION;
+		header->blocksize = BLOCKCACHE_BLOCKSIZE;
+		header->slotcount = slotcount;
+		__atomic_store_n(&header->magic, SHMCACHE_MAGIC, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		if (pread(fd, &existing, sizeof(existing), 0) != sizeof(existing) ||
+			existing.magic != SHMCACHE_MAGIC || existing.version != SHMCACHE_VERSION ||
+			existing.blocksize != BLOCKCACHE_BLOCKSIZE || existing.slotcount % SHMCACHE_WAYS)
+		{
+			log_error("Error, %s is not a compatible shared cache", path);
+			goto clean;
+		}
+
+		slotcount = existing.slotcount;
+		mapsize = shmcache_datastart(slotcount) + (u64)slotcount * BLOCKCACHE_BLOCKSIZE;
+		if ((u64)st.st_size < mapsize)
+		{
+			log_error("Error, shared cache %s is truncated", path);
+			goto clean;
+		}
+
+		map = mmap(0, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			goto clean;
+
+		header = map;
+	}
+
+	slots = (shmcache_slot*)(header + 1);
+	data = (u8*)map + shmcache_datastart(slotcount);
+	setcount = slotcount / SHMCACHE_WAYS;
+
+clean:
+	flock(fd, LOCK_UN);
+	close(fd);
+	return map != MAP_FAILED;
+}
+
+int shmcache_enabled(void)
+{
+	return header != 0;
+}
+
+// Lock-free: the copy is only trusted if the slot's sequence number was
+// even and unchanged across it.
+// Reports whether some way of the block's set holds it. The answer may be
+// stale by the time it is used; it is only a hint.
+int shmcache_contains(u64 image, u64 offset)
+{
+	u32 set = shmcache_hash(image, offset) % setcount;
+	u32 i;
+
+	for(i=0; i<SHMCACHE_WAYS; i++)
+	{
+		shmcache_slot* slot = &slots[set * SHMCACHE_WAYS + i];
+
+		if (__atomic_load_n(&slot->image, __ATOMIC_RELAXED) == image &&
+			__atomic_load_n(&slot->offset, __ATOMIC_RELAXED) == offset)
+			return 1;
+	}
+	return 0;
+}
+
+int shmcache_get(u64 image, u64 offset, u8* buffer, u32 start, u32 size)
+{
+	u32 set = shmcache_hash(image, offset) % setcount;
+	u32 i;
+
+	for(i=0; i<SHMCACHE_WAYS; i++)
+	{
+		u32 index = set * SHMCACHE_WAYS + i;
+		shmcache_slot* slot = &slots[index];
+		u64 sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+		if (sequence & 1)
+			continue;
+		if (__atomic_load_n(&slot->image, __ATOMIC_RELAXED) != image ||
+			__atomic_load_n(&slot->offset, __ATOMIC_RELAXED) != offset ||
+			__atomic_load_n(&slot->size, __ATOMIC_RELAXED) < start + size ||
+			start + size > BLOCKCACHE_BLOCKSIZE)
+			continue;
+
+		memcpy(buffer, data + (u64)index * BLOCKCACHE_BLOCKSIZE + start, size);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence)
+			break;
+
+		__atomic_store_n(&slot->epoch, __atomic_load_n(&header->epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		stats_add(STATS_SHMCACHE_HITS, 1);
+		return 1;
+	}
+
+	stats_add(STATS_SHMCACHE_MISSES, 1);
+	return 0;
+}
+
+// Whether the process that took a slot is gone, leaving the slot to be
+// taken over.
+static int shmcache_owner_dead(u32 owner)
+{
+	return kill((pid_t)owner, 0) != 0 && errno == ESRCH;
+}
+
+// Replaces the way in the set that was used longest ago. If another writer
+// holds that slot the block is simply not cached.
+void shmcache_put(u64 image, u64 offset, const u8* buffer, u32 size)
+{
+	u32 set = shmcache_hash(image, offset) % setcount;
+	shmcache_slot* victim = 0;
+	u64 oldest = ~0ull;
+	u64 sequence;
+	u32 owner;
+	u32 i;
+
+	for(i=0; i<SHMCACHE_WAYS; i++)
+	{
+		shmcache_slot* slot = &slots[set * SHMCACHE_WAYS + i];
+		u64 epoch = __atomic_load_n(&slot->epoch, __ATOMIC_RELAXED);
+
+		if (__atomic_load_n(&slot->image, __ATOMIC_RELAXED) == image &&
+			__atomic_load_n(&slot->offset, __ATOMIC_RELAXED) == offset)
+			return;
+		if (epoch < oldest)
+		{
+			oldest = epoch;
+			victim = slot;
+		}
+	}
+
+	owner = __atomic_load_n(&victim->owner, __ATOMIC_RELAXED);
+	if (owner != 0 && !shmcache_owner_dead(owner))
+		return;
+	if (!__atomic_compare_exchange_n(&victim->owner, &owner, (u32)getpid(), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	// A writer that died mid-copy left sequence odd; it stays odd until
+	// this copy is done.
+	sequence = __atomic_load_n(&victim->sequence, __ATOMIC_RELAXED);
+	if ((sequence & 1) == 0)
+		__atomic_store_n(&victim->sequence, ++sequence, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&victim->image, image, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->offset, offset, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->size, size, __ATOMIC_RELAXED);
+	memcpy(data + (u64)(victim - slots) * BLOCKCACHE_BLOCKSIZE, buffer, size);
+	__atomic_store_n(&victim->epoch, __atomic_add_fetch(&header->epoch, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+
+	__atomic_store_n(&victim->sequence, sequence + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&victim->owner, 0, __ATOMIC_RELEASE);
+}
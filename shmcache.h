@@ -0,0 +1,49 @@
+#ifndef _SHMCACHE_H_
+#define _SHMCACHE_H_
+
+#include "types.h"
+
+#define SHMCACHE_MAGIC			0x48534643	// "CFSH"
+#define SHMCACHE_VERSION		2
+#define SHMCACHE_WAYS			4
+#define SHMCACHE_DEFAULT_SIZE	(256 * 1024 * 1024)
+
+typedef struct
+{
+	u32 magic;
+	u32 version;
+	u32 blocksize;
+	u32 slotcount;
+	u64 epoch;
+	u8 reserved[40];
+} shmcache_header;
+
+// A writer takes a slot by setting owner to its pid, and sequence is odd
+// while it writes; readers retry on change. A slot whose owner died is
+// taken over by the next writer.
+typedef struct
+{
+	u64 sequence;
+	u64 image;
+	u64 offset;
+	u64 epoch;
+	u32 size;
+	u32 owner;
+	u8 reserved[24];
+} shmcache_slot;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int  shmcache_attach(const char* path, u64 size);
+int  shmcache_enabled(void);
+int  shmcache_contains(u64 image, u64 offset);
+int  shmcache_get(u64 image, u64 offset, u8* buffer, u32 start, u32 size);
+void shmcache_put(u64 image, u64 offset, const u8* buffer, u32 size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SHMCACHE_H_
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "types.h"
+#include "stats.h"
+
+typedef struct
+{
+	u64 count;
+	u64 total;
+	u64 max;
+	u64 buckets[STATS_HIST_BUCKETS];
+} stats_histogram;
+
+static const char* opnames[STATS_OP_COUNT] =
+{
+	"getattr",
+	"readdir",
+	"read",
+};
+
+static u64 counters[STATS_COUNTER_COUNT];
+static stats_histogram histograms[STATS_OP_COUNT];
+
+u64 stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_add(stats_counter counter, s64 n)
+{
+	__atomic_fetch_add(&counters[counter], (u64)n, __ATOMIC_RELAXED);
+}
+
+u64 stats_get(stats_counter counter)
+{
+	return __atomic_load_n(&counters[counter], __ATOMIC_RELAXED);
+}
+
+static u32 stats_bucket(u64 value)
+{
+	u32 msb;
+
+	if (value < (1 << STATS_HIST_SUBBITS))
+		return value;
+
+	msb = 63 - __builtin_clzll(value);
+	return ((msb - STATS_HIST_SUBBITS + 1) << STATS_HIST_SUBBITS) + ((value >> (msb - STATS_HIST_SUBBITS)) & ((1 << STATS_HIST_SUBBITS) - 1));
+}
+
+// Returns the largest value that falls into bucket.
+static u64 stats_bucket_limit(u32 bucket)
+{
+	u32 shift;
+	u64 sub;
+
+	if (bucket < (1 << STATS_HIST_SUBBITS))
+		return bucket;
+
+	shift = (bucket >> STATS_HIST_SUBBITS) - 1;
+	sub = (bucket & ((1 << STATS_HIST_SUBBITS) - 1)) | (1 << STATS_HIST_SUBBITS);
+	return ((sub + 1) << shift) - 1;
+}
+
+void stats_record(stats_op op, u64 start)
+{
+	stats_histogram* hist = &histograms[op];
+	u64 elapsed = stats_now() - start;
+	u64 max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->total, elapsed, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->buckets[stats_bucket(elapsed)], 1, __ATOMIC_RELAXED);
+	while (elapsed > max && !__atomic_compare_exchange_n(&hist->max, &max, elapsed, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static u64 stats_percentile(const u64* buckets, u64 count, u32 permille, u64 max)
+{
+	u64 rank = (count * permille + 999) / 1000;
+	u64 seen = 0;
+	u32 i;
+
+	if (count == 0)
+		return 0;
+
+	for(i=0; i<STATS_HIST_BUCKETS; i++)
+	{
+		seen += buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	if (i == STATS_HIST_BUCKETS || stats_bucket_limit(i) > max)
+		return max;
+	return stats_bucket_limit(i);
+}
+
+static void stats_print_ratio(FILE* fp, const char* name, u64 hits, u64 misses)
+{
+	fprintf(fp, "%s.hits %llu\n", name, hits);
+	fprintf(fp, "%s.misses %llu\n", name, misses);
+	if (hits + misses)
+		fprintf(fp, "%s.hit_ratio %.4f\n", name, (double)hits / (hits + misses));
+	else
+		fprintf(fp, "%s.hit_ratio 0\n", name);
+}
+
+// One "name value" pair per line. Names are stable; new counters are only
+// ever appended, so scrapers can rely on them.
+void stats_print(void* unused, FILE* fp)
+{
+	u64 buckets[STATS_HIST_BUCKETS];
+	u32 i, j;
+
+	for(i=0; i<STATS_OP_COUNT; i++)
+	{
+		stats_histogram* hist = &histograms[i];
+		u64 max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+		u64 count = 0;
+
+		// Percentiles come from a copy so that they agree with the count.
+		for(j=0; j<STATS_HIST_BUCKETS; j++)
+		{
+			buckets[j] = __atomic_load_n(&hist->buckets[j], __ATOMIC_RELAXED);
+			count += buckets[j];
+		}
+
+		fprintf(fp, "op.%s.count %llu\n", opnames[i], count);
+		fprintf(fp, "op.%s.total_ns %llu\n", opnames[i], __atomic_load_n(&hist->total, __ATOMIC_RELAXED));
+		fprintf(fp, "op.%s.p50_ns %llu\n", opnames[i], stats_percentile(buckets, count, 500, max));
+		fprintf(fp, "op.%s.p99_ns %llu\n", opnames[i], stats_percentile(buckets, count, 990, max));
+		fprintf(fp, "op.%s.p999_ns %llu\n", opnames[i], stats_percentile(buckets, count, 999, max));
+		fprintf(fp, "op.%s.max_ns %llu\n", opnames[i], max);
+	}
+
+	fprintf(fp, "backing.read_bytes %llu\n", stats_get(STATS_BACKING_BYTES));
+	fprintf(fp, "backing.reads %llu\n", stats_get(STATS_BACKING_READS));
+	fprintf(fp, "backing.seeks %llu\n", stats_get(STATS_BACKING_SEEKS));
+	fprintf(fp, "fuse.returned_bytes %llu\n", stats_get(STATS_RETURNED_BYTES));
+	fprintf(fp, "crypto.decrypted_bytes %llu\n", stats_get(STATS_DECRYPTED_BYTES));
+	fprintf(fp, "crypto.hashed_bytes %llu\n", stats_get(STATS_HASHED_BYTES));
+	stats_print_ratio(fp, "cache.dir", stats_get(STATS_DIRCACHE_HITS), stats_get(STATS_DIRCACHE_MISSES));
+	fprintf(fp, "nodes.count %llu\n", stats_get(STATS_NODES));
+	fprintf(fp, "memory.bytes %llu\n", stats_get(STATS_MEMORY));
+	stats_print_ratio(fp, "cache.block", stats_get(STATS_BLOCKCACHE_HITS), stats_get(STATS_BLOCKCACHE_MISSES));
+	stats_print_ratio(fp, "cache.shm", stats_get(STATS_SHMCACHE_HITS), stats_get(STATS_SHMCACHE_MISSES));
+	stats_print_ratio(fp, "cache.disk", stats_get(STATS_DISKCACHE_HITS), stats_get(STATS_DISKCACHE_MISSES));
+	fprintf(fp, "cache.disk.rejects %llu\n", stats_get(STATS_DISKCACHE_REJECTS));
+	fprintf(fp, "fuse.zerocopy_reads %llu\n", stats_get(STATS_ZEROCOPY_READS));
+	fprintf(fp, "prefetch.bytes %llu\n", stats_get(STATS_PREFETCH_BYTES));
+	fprintf(fp, "prefetch.dropped %llu\n", stats_get(STATS_PREFETCH_DROPPED));
+	fprintf(fp, "cache.inflight_waits %llu\n", stats_get(STATS_INFLIGHT_WAITS));
+	fprintf(fp, "sched.background_paused %llu\n", stats_get(STATS_SCHED_PAUSES));
+	fprintf(fp, "sched.background_throttled %llu\n", stats_get(STATS_SCHED_THROTTLED));
+	fprintf(fp, "mount.time_ns %llu\n", stats_get(STATS_MOUNT_NS));
+	fprintf(fp, "memory.evicted_bytes %llu\n", stats_get(STATS_MEMORY_EVICTED));
+}
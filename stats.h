@@ -0,0 +1,64 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+#include "types.h"
+
+typedef enum
+{
+	STATS_OP_GETATTR,
+	STATS_OP_READDIR,
+	STATS_OP_READ,
+	STATS_OP_COUNT
+} stats_op;
+
+typedef enum
+{
+	STATS_BACKING_BYTES,		// bytes read from the image file
+	STATS_BACKING_READS,		// read calls against the image file
+	STATS_BACKING_SEEKS,		// seeks on the image file
+	STATS_RETURNED_BYTES,		// bytes handed back to FUSE
+	STATS_DECRYPTED_BYTES,
+	STATS_HASHED_BYTES,
+	STATS_DIRCACHE_HITS,		// romfs directories already populated
+	STATS_DIRCACHE_MISSES,
+	STATS_NODES,
+	STATS_MEMORY,				// bytes of parsed metadata held by the mount
+	STATS_BLOCKCACHE_HITS,		// decrypted blocks served from memory
+	STATS_BLOCKCACHE_MISSES,
+	STATS_SHMCACHE_HITS,		// blocks found in the cross-process cache
+	STATS_SHMCACHE_MISSES,
+	STATS_DISKCACHE_HITS,		// blocks read back from the disk cache
+	STATS_DISKCACHE_MISSES,
+	STATS_DISKCACHE_REJECTS,	// disk blocks that failed their hash check
+	STATS_ZEROCOPY_READS,		// reads handed to FUSE as a file descriptor
+	STATS_PREFETCH_BYTES,		// bytes decrypted ahead of sequential readers
+	STATS_PREFETCH_DROPPED,		// read-ahead requests dropped on a full queue
+	STATS_INFLIGHT_WAITS,		// block misses that waited on another reader's fill
+	STATS_SCHED_PAUSES,			// background slices held back by foreground reads
+	STATS_SCHED_THROTTLED,		// background slices held back by the rate limit
+	STATS_MOUNT_NS,				// from startup until the mount could serve requests
+	STATS_MEMORY_EVICTED,		// bytes of metadata dropped to stay under mem_limit
+	STATS_COUNTER_COUNT
+} stats_counter;
+
+// Latency histograms are log-linear: 16 linear sub-buckets per power of two,
+// which keeps percentile error under ~6% at any scale.
+#define STATS_HIST_SUBBITS	4
+#define STATS_HIST_BUCKETS	(64 << STATS_HIST_SUBBITS)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+u64  stats_now(void);
+void stats_add(stats_counter counter, s64 n);
+u64  stats_get(stats_counter counter);
+void stats_record(stats_op op, u64 start);
+void stats_print(void* unused, FILE* fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _STATS_H_
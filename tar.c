@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include "types.h"
+#include "tar.h"
+#include "utils.h"
+#include "utf16.h"
+
+#define TAR_OCTAL_MAX(digits)	((u64)1 << (3 * (digits)))
+
+// the modes the mount shows, so extracting reproduces what ls -l lists
+#define TAR_FILE_MODE			"0000444"
+#define TAR_DIR_MODE			"0000555"
+
+// ustar header, as laid out in the first block of each entry.
+typedef struct
+{
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char checksum[8];
+	char type;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+} tar_header;
+
+static int tar_add_name(tar_map* map, const char* name, u32* offset)
+{
+	u32 size = strlen(name) + 1;
+
+	if (map->namesize + size > map->namecapacity)
+	{
+		u32 capacity = map->namecapacity ? map->namecapacity : 4096;
+		char* names;
+
+		while(map->namesize + size > capacity)
+			capacity *= 2;
+		names = realloc(map->names, capacity);
+		if (names == 0)
+			return 0;
+		map->names = names;
+		map->namecapacity = capacity;
+	}
+
+	memcpy(map->names + map->namesize, name, size);
+	*offset = map->namesize;
+	map->namesize += size;
+	return 1;
+}
+
+static u32 tar_digits(u32 n)
+{
+	u32 digits = 1;
+
+	for(; n>=10; n/=10)
+		digits++;
+	return digits;
+}
+
+// Length of the pax record "LEN key=value\n", which counts its own digits.
+static u32 tar_pax_record_size(const char* key, u32 valuesize)
+{
+	u32 size = strlen(key) + valuesize + 3;
+	u32 digits = tar_digits(size);
+
+	// the digits themselves may carry the total past a power of ten
+	if (tar_digits(size + digits) > digits)
+		digits++;
+	return size + digits;
+}
+
+// Bytes of pax records an entry needs: a path too long for the ustar
+// field, or a size too large for it.
+static u32 tar_pax_size(const char* name, u64 datasize)
+{
+	u32 size = 0;
+	char digits[24];
+
+	if (strlen(name) > TAR_NAMESIZE)
+		size += tar_pax_record_size("path", strlen(name));
+	if (datasize >= TAR_OCTAL_MAX(11))
+		size += tar_pax_record_size("size", sprintf(digits, "%llu", datasize));
+	return size;
+}
+
+static int tar_add_entry(tar_map* map, const char* name, u32 fileoffset, u64 datasize)
+{
+	tar_entry* entry;
+	u32 paxsize = tar_pax_size(name, datasize);
+
+	if (map->entrycount == map->entrycapacity)
+	{
+		u32 capacity = map->entrycapacity ? map->entrycapacity * 2 : 64;
+		tar_entry* entries = realloc(map->entries, capacity * sizeof(tar_entry));
+
+		if (entries == 0)
+			return 0;
+		map->entries = entries;
+		map->entrycapacity = capacity;
+	}
+
+	entry = &map->entries[map->entrycount];
+	entry->start = map->end;
+	entry->datasize = datasize;
+	entry->fileoffset = fileoffset;
+	entry->headersize = TAR_BLOCKSIZE;
+	if (paxsize)
+		entry->headersize += TAR_BLOCKSIZE + align64(paxsize, TAR_BLOCKSIZE);
+	if (!tar_add_name(map, name, &entry->name))
+		return 0;
+
+	map->entrycount++;
+	map->end += entry->headersize + align64(datasize, TAR_BLOCKSIZE);
+	return 1;
+}
+
+// readentry keeps only the first ROMFS_MAXNAMESIZE-2 bytes of a name
+static u32 tar_namesize(u32 namesize)
+{
+	return namesize > ROMFS_MAXNAMESIZE-2 ? ROMFS_MAXNAMESIZE-2 : namesize;
+}
+
+// Adds a directory and everything below it, files first, the way the
+// RomFS lists them. path holds the directory's own path, "romfs/..." with
+// a trailing slash, and is used as scratch for the names below it.
+static int tar_add_dir(tar_map* map, romfs_context* romfs, u32 diroffset, char* path, u32 depth, u32* budget)
+{
+	romfs_direntry dir;
+	u32 pathlength = strlen(path);
+	u32 offset;
+
+	if (depth >= TAR_MAXDEPTH || !romfs_dirblock_readentry(romfs, diroffset, &dir))
+		return 0;
+	if (!tar_add_entry(map, path, ~0, 0))
+		return 0;
+
+	// budget bounds the walk, so a looping table can't hang us
+	for(offset = getle32(dir.fileoffset); offset != (u32)~0; )
+	{
+		romfs_fileentry file;
+		char* name;
+
+		if (*budget == 0 || !romfs_fileblock_readentry(romfs, offset, &file))
+			return 0;
+		(*budget)--;
+
+		name = utf16to8(file.name, tar_namesize(getle32(file.namesize)));
+		if (name == 0)
+			return 0;
+		strcpy(path + pathlength, name);
+		free(name);
+		if (!tar_add_entry(map, path, offset, getle64(file.datasize)))
+			return 0;
+		offset = getle32(file.siblingoffset);
+	}
+
+	for(offset = getle32(dir.childoffset); offset != (u32)~0; )
+	{
+		romfs_direntry child;
+		char* name;
+
+		if (*budget == 0 || !romfs_dirblock_readentry(romfs, offset, &child))
+			return 0;
+		(*budget)--;
+
+		name = utf16to8(child.name, tar_namesize(getle32(child.namesize)));
+		if (name == 0)
+			return 0;
+		strcpy(path + pathlength, name);
+		strcat(path, "/");
+		free(name);
+		if (!tar_add_dir(map, romfs, offset, path, depth + 1, budget))
+			return 0;
+		path[pathlength] = 0;
+		offset = getle32(child.siblingoffset);
+	}
+	return 1;
+}
+
+// Lays out the archive of everything in the RomFS, under the directory
+// root. Only the metadata is read. Callers must be inside a mem_read_begin
+// section.
+int tar_build(tar_map* map, romfs_context* romfs, const char* root, u64 mtime)
+{
+	// a UTF-16 unit becomes at most three bytes, and each level adds a slash
+	u32 pathcapacity = strlen(root) + 2 + TAR_MAXDEPTH * ((ROMFS_MAXNAMESIZE-2) / 2 * 3 + 1);
+	u32 budget = romfs->dirblocksize / offsetof(romfs_direntry, name) + romfs->fileblocksize / offsetof(romfs_fileentry, name);
+	char* path = malloc(pathcapacity);
+	int result = 0;
+
+	memset(map, 0, sizeof(tar_map));
+	map->mtime = mtime;
+	if (path == 0)
+		goto clean;
+
+	snprintf(path, pathcapacity, "%s/", root);
+	if (!tar_add_dir(map, romfs, 0, path, 0, &budget))
+		goto clean;
+
+	map->size = map->end + 2 * TAR_BLOCKSIZE;
+	result = 1;
+
+clean:
+	free(path);
+	if (!result)
+		tar_free(map);
+	return result;
+}
+
+void tar_free(tar_map* map)
+{
+	free(map->entries);
+	free(map->names);
+	memset(map, 0, sizeof(tar_map));
+}
+
+u64 tar_memory(tar_map* map)
+{
+	return sizeof(tar_map) + (u64)map->entrycapacity * sizeof(tar_entry) + map->namecapacity;
+}
+
+// Writes value as a zero-padded octal number filling all but the last byte
+// of field, which ends it.
+static void tar_octal(char* field, u32 size, u64 value)
+{
+	u32 i;
+
+	field[size - 1] = 0;
+	for(i=size-1; i>0; i--)
+	{
+		field[i - 1] = '0' + (value & 7);
+		value >>= 3;
+	}
+}
+
+static void tar_fill_header(tar_map* map, tar_header* header, const char* name, char type, u64 size, const char* mode)
+{
+	u32 checksum = 0;
+	u32 i;
+
+	memset(header, 0, sizeof(tar_header));
+	strncpy(header->name, name, sizeof(header->name));
+	strcpy(header->mode, mode);
+	tar_octal(header->uid, sizeof(header->uid), 0);
+	tar_octal(header->gid, sizeof(header->gid), 0);
+	tar_octal(header->size, sizeof(header->size), size < TAR_OCTAL_MAX(11) ? size : 0);
+	tar_octal(header->mtime, sizeof(header->mtime), map->mtime < TAR_OCTAL_MAX(11) ? map->mtime : 0);
+	header->type = type;
+	memcpy(header->magic, "ustar", 6);
+	memcpy(header->version, "00", 2);
+
+	memset(header->checksum, ' ', sizeof(header->checksum));
+	for(i=0; i<sizeof(tar_header); i++)
+		checksum += ((u8*)header)[i];
+	tar_octal(header->checksum, 7, checksum);
+}
+
+// Renders the headers of entry into out, which holds entry->headersize
+// bytes: a pax header and its records if needed, then the ustar header.
+static void tar_render(tar_map* map, tar_entry* entry, u8* out)
+{
+	const char* name = map->names + entry->name;
+	int dir = entry->fileoffset == (u32)~0;
+	u8* header = out;
+
+	memset(out, 0, entry->headersize);
+	if (entry->headersize > TAR_BLOCKSIZE)
+	{
+		char* records = (char*)out + TAR_BLOCKSIZE;
+		u32 paxsize = 0;
+		u32 length = strlen(name);
+
+		if (length > TAR_NAMESIZE)
+			paxsize += sprintf(records + paxsize, "%u path=%s\n", tar_pax_record_size("path", length), name);
+		if (entry->datasize >= TAR_OCTAL_MAX(11))
+		{
+			char digits[24];
+
+			sprintf(digits, "%llu", entry->datasize);
+			paxsize += sprintf(records + paxsize, "%u size=%s\n", tar_pax_record_size("size", strlen(digits)), digits);
+		}
+
+		tar_fill_header(map, (tar_header*)out, "././@PaxHeader", 'x', paxsize, TAR_FILE_MODE);
+		header = out + entry->headersize - TAR_BLOCKSIZE;
+	}
+
+	tar_fill_header(map, (tar_header*)header, name, dir ? '5' : '0', entry->datasize, dir ? TAR_DIR_MODE : TAR_FILE_MODE);
+}
+
+// Returns the last entry starting at or before offset, which must be below
+// map->end.
+static tar_entry* tar_find_entry(tar_map* map, u64 offset)
+{
+	u32 lo = 0;
+	u32 hi = map->entrycount;
+
+	while(hi - lo > 1)
+	{
+		u32 mid = lo + (hi - lo) / 2;
+
+		if (map->entries[mid].start <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return &map->entries[lo];
+}
+
+// Reads the archive, making headers and reading file data as they come.
+// Callers must be inside a mem_read_begin section.
+ssize_t tar_read(tar_map* map, romfs_context* romfs, char* buf, off_t offset, size_t size)
+{
+	u8 block[TAR_BLOCKSIZE * 2];
+	size_t done = 0;
+
+	if (offset < 0 || (u64)offset >= map->size)
+		return 0;
+	if (size > map->size - offset)
+		size = map->size - offset;
+
+	while(done < size)
+	{
+		u64 pos = offset + done;
+		tar_entry* entry;
+		u64 within, datastart, entryend;
+		size_t max;
+
+		if (pos >= map->end)
+		{
+			memset(buf + done, 0, size - done);
+			break;
+		}
+
+		entry = tar_find_entry(map, pos);
+		within = pos - entry->start;
+		datastart = entry->headersize;
+		entryend = datastart + align64(entry->datasize, TAR_BLOCKSIZE);
+
+		if (within < datastart)
+		{
+			u8* headers = entry->headersize <= sizeof(block) ? block : malloc(entry->headersize);
+
+			if (headers == 0)
+				return -ENOMEM;
+			tar_render(map, entry, headers);
+			max = datastart - within;
+			if (max > size - done)
+				max = size - done;
+			memcpy(buf + done, headers + within, max);
+			if (headers != block)
+				free(headers);
+		}
+		else if (within < datastart + entry->datasize)
+		{
+			ssize_t n;
+
+			max = datastart + entry->datasize - within;
+			if (max > size - done)
+				max = size - done;
+			n = romfs_read_file(romfs, entry->fileoffset, buf + done, within - datastart, max);
+			if (n < 0)
+				return n;
+			if ((size_t)n != max)
+				return -EIO;
+		}
+		else
+		{
+			max = entryend - within;
+			if (max > size - done)
+				max = size - done;
+			memset(buf + done, 0, max);
+		}
+		done += max;
+	}
+
+	return size;
+}
+
+// Reports whether offset falls in file data, and if so which RomFS file
+// and where in it, cutting size down to what lies in that file.
+int tar_locate(tar_map* map, off_t offset, size_t* size, u32* fileoffset, u64* position)
+{
+	tar_entry* entry;
+	u64 within;
+
+	if (offset < 0 || (u64)offset >= map->end)
+		return 0;
+
+	entry = tar_find_entry(map, offset);
+	within = offset - entry->start;
+	if (within < entry->headersize || within - entry->headersize >= entry->datasize)
+		return 0;
+
+	within -= entry->headersize;
+	if (*size > entry->datasize - within)
+		*size = entry->datasize - within;
+	*fileoffset = entry->fileoffset;
+	*position = within;
+	return 1;
+}
@@ -0,0 +1,52 @@
+#ifndef _TAR_H_
+#define _TAR_H_
+
+#include <sys/types.h>
+#include "types.h"
+#include "romfs.h"
+
+#define TAR_BLOCKSIZE		512
+#define TAR_NAMESIZE		100		// longer paths go in a pax header
+#define TAR_MAXDEPTH		256
+
+// One directory or file of the archive: its headers, then for a file its
+// data, padded to a whole block. Headers are not stored; they are made
+// again from the entry whenever they are read.
+typedef struct
+{
+	u64 start;				// offset of the headers in the archive
+	u64 datasize;			// 0 for a directory
+	u32 fileoffset;			// RomFS file entry, or ~0 for a directory
+	u32 headersize;			// a multiple of TAR_BLOCKSIZE
+	u32 name;				// offset of the path in names
+} tar_entry;
+
+// Where every byte of a RomFS packed as a ustar archive comes from.
+typedef struct
+{
+	tar_entry* entries;		// sorted by start
+	u32 entrycount;
+	u32 entrycapacity;
+	char* names;
+	u32 namesize;
+	u32 namecapacity;
+	u64 mtime;
+	u64 end;				// where the two zero blocks closing the archive start
+	u64 size;
+} tar_map;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int     tar_build(tar_map* map, romfs_context* romfs, const char* root, u64 mtime);
+void    tar_free(tar_map* map);
+u64     tar_memory(tar_map* map);
+ssize_t tar_read(tar_map* map, romfs_context* romfs, char* buf, off_t offset, size_t size);
+int     tar_locate(tar_map* map, off_t offset, size_t* size, u32* fileoffset, u64* position);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _TAR_H_
@@ -0,0 +1,154 @@
+// Opens an image built by mkimage.py with its NCCH at a given offset the
+// way the mount does, and checks that every offset on the way down to
+// /big.bin survived in full and that the file reads back intact.
+//
+// usage: bigimage IMAGE BASE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "utils.h"
+#include "utf16.h"
+#include "ncsd.h"
+#include "reader.h"
+#include "mem.h"
+
+#define BIGSIZE		300000		// as written by mkimage.py
+#define CHUNK		4099		// odd, so reads straddle cache blocks
+
+static int failures;
+
+static void check(int ok, const char* what, u64 got, u64 want)
+{
+	if (ok)
+		return;
+	fprintf(stderr, "FAIL: %s: got %llx, want %llx\n", what, got, want);
+	failures++;
+}
+
+static int find_file(romfs_context* ctx, const char* want, romfs_fileentry* entry)
+{
+	romfs_direntry root;
+	u32 fileoffset;
+
+	if (!romfs_dirblock_readentry(ctx, 0, &root))
+		return -1;
+
+	for(fileoffset = getle32(root.fileoffset); fileoffset != (u32)~0; fileoffset = getle32(entry->siblingoffset))
+	{
+		char* name;
+		int match;
+
+		if (!romfs_fileblock_readentry(ctx, fileoffset, entry))
+			return -1;
+		name = utf16to8(entry->name, getle32(entry->namesize));
+		match = name && strcmp(name, want) == 0;
+		free(name);
+		if (match)
+			return fileoffset;
+	}
+	return -1;
+}
+
+int main(int argc, char* argv[])
+{
+	static ncsd_context ncsd;
+	reader_context reader;
+	ncch_context* ncch;
+	romfs_context* romfs;
+	romfs_fileentry entry;
+	FILE* file;
+	int fd;
+	u64 base;
+	u64 size;
+	u64 offset;
+	int entryoffset;
+	int epoch;
+	char buffer[CHUNK];
+
+	if (argc != 3)
+	{
+		fprintf(stderr, "usage: %s IMAGE BASE\n", argv[0]);
+		return 2;
+	}
+	base = strtoull(argv[2], 0, 0);
+
+	file = fopen(argv[1], "rb");
+	if (file == 0)
+	{
+		perror(argv[1]);
+		return 2;
+	}
+	fd = fileno(file);
+	size = lseek(fd, 0, SEEK_END);
+	if (!reader_init(&reader, "pread", file, fd, -1))
+		return 2;
+
+	mem_init(0);
+	ncsd_init(&ncsd);
+	ncsd_set_file(&ncsd, file);
+	ncsd_set_reader(&ncsd, &reader);
+	ncsd_set_size(&ncsd, size);
+	ncsd_process(&ncsd, LazyFlag);
+
+	ncch = &ncsd.ncch;
+	check(ncsd.size == size, "ncsd size", ncsd.size, size);
+	check(ncch->valid, "ncch valid", ncch->valid, 1);
+	check(ncch->offset == base, "ncch offset", ncch->offset, base);
+	check(ncch->offset + ncch->size == size, "ncch end", ncch->offset + ncch->size, size);
+	if (!ncch_load(ncch, NCCHTYPE_ROMFS))
+	{
+		fprintf(stderr, "FAIL: could not load the RomFS\n");
+		return 1;
+	}
+
+	romfs = &ncch->romfs;
+	check(romfs->offset == ncch_get_romfs_offset(ncch), "romfs offset", romfs->offset, ncch_get_romfs_offset(ncch));
+	check(romfs->size == ncch_get_romfs_size(ncch), "romfs size", romfs->size, ncch_get_romfs_size(ncch));
+	check(romfs->region.offset == romfs->offset, "romfs region offset", romfs->region.offset, romfs->offset);
+
+	epoch = mem_read_begin();
+	entryoffset = find_file(romfs, "big.bin", &entry);
+	if (entryoffset < 0)
+	{
+		mem_read_end(epoch);
+		fprintf(stderr, "FAIL: no /big.bin\n");
+		return 1;
+	}
+	check(getle64(entry.datasize) == BIGSIZE, "big.bin size", getle64(entry.datasize), BIGSIZE);
+	printf("big.bin at %llx\n", romfs->datablockoffset + getle64(entry.dataoffset));
+
+	for(offset = 0; offset < BIGSIZE; offset += CHUNK)
+	{
+		ssize_t n = romfs_read_file(romfs, entryoffset, buffer, offset, CHUNK);
+		ssize_t want = BIGSIZE - offset < CHUNK ? BIGSIZE - offset : CHUNK;
+		ssize_t i;
+
+		if (n != want)
+		{
+			check(0, "read length", n, want);
+			break;
+		}
+		for(i=0; i<n; i++)
+		{
+			if ((u8)buffer[i] != (u8)((offset + i) * 7 + 3))
+				break;
+		}
+		if (i < n)
+		{
+			check(0, "big.bin byte", (u8)buffer[i], (u8)((offset + i) * 7 + 3));
+			break;
+		}
+	}
+	mem_read_end(epoch);
+
+	fclose(file);
+	if (failures)
+		return 1;
+	printf("ok\n");
+	return 0;
+}
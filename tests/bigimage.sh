@@ -0,0 +1,15 @@
+#!/bin/sh
+# Builds sparse images whose NCCH sits around and past the 4 GB mark and
+# checks that they open and read back intact. The first puts /big.bin
+# across the 4 GB boundary, the second puts everything above it.
+set -e
+
+dir=$(dirname "$0")
+image=${TMPDIR:-/tmp}/ctrfuse-bigimage.$$.3ds
+trap 'rm -f "$image"' EXIT
+
+for base in 0xffff0000 0x100004000; do
+	python3 "$dir/mkimage.py" "$image" --base $base
+	echo "bigimage: ncch at $base"
+	"$dir/bigimage" "$image" $base
+done
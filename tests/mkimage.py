@@ -0,0 +1,226 @@
+#!/usr/bin/env python3
+# Builds a small synthetic NCSD image for the tests and benchmarks: one NCCH
+# with an exheader, an ExeFS with hashed sections and an IVFC-wrapped RomFS.
+# The NCCH can be placed at any offset; the space before it is left as a
+# hole, so images past 4 GB cost next to nothing on disk.
+#
+# usage: mkimage.py OUTPUT [--base OFFSET] [--files N] [--encrypt]
+#
+# big.bin in the RomFS holds BIGSIZE bytes of (i*7+3) & 0xff, so readers can
+# check any byte of it without a copy of the file.
+
+import argparse
+import hashlib
+import struct
+import subprocess
+
+MEDIAUNIT = 0x200
+BIGSIZE = 300000
+PROGRAMID = 0x0004000000123400
+NONE = 0xFFFFFFFF
+
+
+def pad(data, align):
+	return data + b'\0' * ((-len(data)) % align)
+
+
+def utf16(name):
+	return name.encode('utf-16-le')
+
+
+# AES-128-CTR with the all-zero fixed key, through openssl(1) so the script
+# needs nothing beyond the standard library.
+def aesctr(data, counter):
+	if not data:
+		return data
+	return subprocess.run(['openssl', 'enc', '-aes-128-ctr', '-K', '00' * 16, '-iv', counter.hex(), '-nopad'],
+		input=data, stdout=subprocess.PIPE, check=True).stdout
+
+
+# tree maps names to bytes (files) or to nested dicts (directories).
+def build_romfs(tree):
+	dirs = []
+	files = []
+	data = bytearray()
+
+	def add_dir(name, node, parent):
+		dirs.append({'name': name, 'parent': parent, 'child': None, 'file': None, 'sibling': None, 'node': node})
+		return len(dirs) - 1
+
+	def walk(index):
+		node = dirs[index]['node']
+		prev = None
+		for name, value in node.items():
+			if isinstance(value, bytes):
+				files.append({'name': name, 'parent': index, 'sibling': None, 'offset': len(data), 'size': len(value)})
+				data.extend(pad(value, 16))
+				if prev is None:
+					dirs[index]['file'] = len(files) - 1
+				else:
+					files[prev]['sibling'] = len(files) - 1
+				prev = len(files) - 1
+		prev = None
+		children = []
+		for name, value in node.items():
+			if isinstance(value, dict):
+				child = add_dir(name, value, index)
+				if prev is None:
+					dirs[index]['child'] = child
+				else:
+					dirs[prev]['sibling'] = child
+				prev = child
+				children.append(child)
+		for child in children:
+			walk(child)
+
+	add_dir('', tree, 0)
+	walk(0)
+
+	diroffsets = []
+	offset = 0
+	for d in dirs:
+		diroffsets.append(offset)
+		offset += 0x18 + len(pad(utf16(d['name']), 4))
+	fileoffsets = []
+	offset = 0
+	for f in files:
+		fileoffsets.append(offset)
+		offset += 0x20 + len(pad(utf16(f['name']), 4))
+
+	def ref(offsets, index):
+		return NONE if index is None else offsets[index]
+
+	dirmeta = b''.join(struct.pack('<6I', diroffsets[d['parent']], ref(diroffsets, d['sibling']),
+		ref(diroffsets, d['child']), ref(fileoffsets, d['file']), NONE, len(utf16(d['name']))) +
+		pad(utf16(d['name']), 4) for d in dirs)
+	filemeta = b''.join(struct.pack('<2IQQ2I', diroffsets[f['parent']], ref(fileoffsets, f['sibling']),
+		f['offset'], f['size'], NONE, len(utf16(f['name']))) +
+		pad(utf16(f['name']), 4) for f in files)
+	dirhash = struct.pack('<I', NONE)
+	filehash = struct.pack('<I', NONE)
+
+	offset = 0x28
+	sections = []
+	for section in (dirhash, dirmeta, filehash, filemeta):
+		sections.append((offset, len(section)))
+		offset += len(section)
+	dataoffset = (offset + 15) & ~15
+
+	header = struct.pack('<I', 0x28) + b''.join(struct.pack('<2I', *s) for s in sections) + struct.pack('<I', dataoffset)
+	body = pad(header + dirhash + dirmeta + filehash + filemeta, 16)
+	return body + b'\0' * (dataoffset - len(body)) + bytes(data)
+
+
+def build_ivfc(body):
+	blocksize = 0x1000
+
+	def hashes(level):
+		level = pad(level, blocksize)
+		return b''.join(hashlib.sha256(level[i:i + blocksize]).digest() for i in range(0, len(level), blocksize))
+
+	level2 = hashes(body)
+	level1 = hashes(level2)
+	master = hashes(level1)
+
+	level1offset = 0
+	level2offset = len(pad(level1, blocksize))
+	level3offset = level2offset + len(pad(level2, blocksize))
+	header = b'IVFC' + struct.pack('<II', 0x10000, len(master))
+	header += struct.pack('<QQII', level1offset, len(level1), 12, 0)
+	header += struct.pack('<QQII', level2offset, len(level2), 12, 0)
+	header += struct.pack('<QQII', level3offset, len(body), 12, 0)
+	header += struct.pack('<II', 0, 0)
+
+	out = bytearray(pad(header, 4))
+	out += b'\0' * (0x60 - len(out)) + master
+	out += b'\0' * (0x1000 - len(out))
+	out += pad(body, blocksize) + pad(level1, blocksize) + pad(level2, blocksize)
+	return bytes(out)
+
+
+def build_exefs():
+	sections = [(b'.code', bytes((i * 13) & 0xff for i in range(0x1234))), (b'banner', b'B' * 0x300), (b'icon', b'I' * 0x36c0)]
+	header = bytearray(0x200)
+	body = b''
+	for i, (name, data) in enumerate(sections):
+		header[i * 16:i * 16 + 8] = name.ljust(8, b'\0')
+		struct.pack_into('<II', header, i * 16 + 8, len(body), len(data))
+		header[0x200 - 0x20 * (i + 1):0x200 - 0x20 * i] = hashlib.sha256(data).digest()
+		body += pad(data, MEDIAUNIT)
+	return bytes(header) + body
+
+
+def build(path, base, files, encrypt):
+	programid = struct.pack('<Q', PROGRAMID)
+	tree = {
+		'a.txt': b'hello world\n',
+		'big.bin': bytes((i * 7 + 3) & 0xff for i in range(BIGSIZE)),
+		'sound': {'x.bcwav': b'X' * 5000, 'y.bcwav': b'Y' * 123, 'deep': {'z.bcwav': b'Z' * 77}},
+		'many': {('f%05d.dat' % i): bytes([i & 0xff]) * (i % 512 + 1) for i in range(files)},
+	}
+	romfs = pad(build_ivfc(build_romfs(tree)), MEDIAUNIT)
+	exefs = pad(build_exefs(), MEDIAUNIT)
+
+	exheader = bytearray(0x800)
+	exheader[0:8] = b'TestApp\0'
+	exheader[0x200:0x208] = programid
+
+	exefsoffset = 0xa00 // MEDIAUNIT
+	romfsoffset = exefsoffset + len(exefs) // MEDIAUNIT
+	contentsize = romfsoffset + len(romfs) // MEDIAUNIT
+
+	header = bytearray(0x200)
+	header[0x100:0x104] = b'NCCH'
+	struct.pack_into('<I', header, 0x104, contentsize)
+	header[0x108:0x110] = programid
+	header[0x110:0x112] = b'00'
+	struct.pack_into('<H', header, 0x112, 2)
+	header[0x118:0x120] = programid
+	header[0x150:0x160] = b'CTR-P-TEST'.ljust(16, b'\0')
+	header[0x160:0x180] = hashlib.sha256(exheader[:0x400]).digest()
+	struct.pack_into('<I', header, 0x180, 0x400)
+	header[0x188 + 5] = 3
+	header[0x188 + 7] = 1 if encrypt else 4	# FixedCryptoKey or NoCrypto
+	struct.pack_into('<4I', header, 0x1a0, exefsoffset, len(exefs) // MEDIAUNIT, 1, 0)
+	struct.pack_into('<4I', header, 0x1b0, romfsoffset, len(romfs) // MEDIAUNIT, 1, 0)
+	header[0x1c0:0x1e0] = hashlib.sha256(exefs[:MEDIAUNIT]).digest()
+	header[0x1e0:0x200] = hashlib.sha256(romfs[:MEDIAUNIT]).digest()
+
+	exheader = bytes(exheader)
+	if encrypt:
+		def counter(kind):
+			return programid[::-1] + bytes([kind]) + b'\0' * 7
+		exheader = aesctr(exheader, counter(1))
+		exefs = aesctr(exefs, counter(2))
+		romfs = aesctr(romfs, counter(3))
+
+	ncch = bytes(header) + exheader + exefs + romfs
+
+	ncsd = bytearray(0x4000)
+	ncsd[0x100:0x104] = b'NCSD'
+	struct.pack_into('<I', ncsd, 0x104, (base + len(ncch)) // MEDIAUNIT)
+	ncsd[0x108:0x110] = programid
+	struct.pack_into('<II', ncsd, 0x120, base // MEDIAUNIT, len(ncch) // MEDIAUNIT)
+	ncsd[0x190:0x198] = programid
+
+	with open(path, 'wb') as f:
+		f.write(ncsd)
+		f.seek(base)
+		f.write(ncch)
+
+
+def main():
+	parser = argparse.ArgumentParser(description='Build a synthetic NCSD image.')
+	parser.add_argument('output')
+	parser.add_argument('--base', type=lambda s: int(s, 0), default=0x4000, help='offset of the NCCH (default 0x4000)')
+	parser.add_argument('--files', type=int, default=300, help='files in /many (default 300)')
+	parser.add_argument('--encrypt', action='store_true', help='encrypt with the fixed key')
+	args = parser.parse_args()
+
+	if args.base < 0x4000 or args.base % MEDIAUNIT or args.base // MEDIAUNIT > 0xFFFFFFFF:
+		parser.error('base must be a media unit multiple from 0x4000 up')
+	build(args.output, args.base, args.files, args.encrypt)
+
+
+if __name__ == '__main__':
+	main()
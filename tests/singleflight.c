@@ -0,0 +1,178 @@
+// Has many threads miss on the same encrypted blocks at once, first on their
+// own and then racing read-ahead, and checks that each block was still read
+// from the file and decrypted only once, and that everyone got the right
+// bytes.
+//
+// usage: singleflight [THREADS]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "types.h"
+#include "region.h"
+#include "reader.h"
+#include "blockcache.h"
+#include "stats.h"
+
+#define MAX_THREADS		64
+#define REGIONSIZE		(4 << 20)
+#define BLOCKS			(REGIONSIZE / BLOCKCACHE_BLOCKSIZE)
+
+static region_context region;
+static reader_context reader;
+static pthread_barrier_t barrier;
+static u32 threadcount;
+static u8* results[MAX_THREADS];
+static int failures;
+
+// Even threads read the region front to back, odd ones starting halfway,
+// so misses collide both on the first block and all the way through.
+static void* read_region(void* arg)
+{
+	u32 id = (u32)(uintptr_t)arg;
+	u32 i;
+
+	pthread_barrier_wait(&barrier);
+	for(i=0; i<BLOCKS; i++)
+	{
+		u64 offset = (u64)((i + (id & 1) * BLOCKS / 2) % BLOCKS) * BLOCKCACHE_BLOCKSIZE;
+
+		if (!region_read(&region, offset, results[id] + offset, BLOCKCACHE_BLOCKSIZE))
+		{
+			fprintf(stderr, "FAIL: thread %u: read of %llx failed\n", id, offset);
+			__atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	return 0;
+}
+
+static void* prefetch_region(void* arg)
+{
+	reader_queue queue;
+
+	if (!reader_queue_init(&queue, &reader))
+		return 0;
+	pthread_barrier_wait(&barrier);
+	if (!region_prefetch(&region, &queue, 0, REGIONSIZE))
+	{
+		fprintf(stderr, "FAIL: read-ahead failed\n");
+		__atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+	}
+	reader_queue_free(&queue);
+	return 0;
+}
+
+static void run(const char* name, FILE* file, u64 offset, int prefetch)
+{
+	pthread_t threads[MAX_THREADS + 1];
+	u64 read = stats_get(STATS_BACKING_BYTES);
+	u64 decrypted = stats_get(STATS_DECRYPTED_BYTES);
+	u64 waits = stats_get(STATS_INFLIGHT_WAITS);
+	u8* expected = malloc(REGIONSIZE);
+	u8 key[16] = {1};
+	u8 counter[16] = {2};
+	u32 i;
+
+	region_init(&region, file, offset, REGIONSIZE);
+	region_set_crypto(&region, key, counter, 1);
+	region_set_reader(&region, &reader);
+
+	pthread_barrier_init(&barrier, 0, threadcount + (prefetch != 0));
+	for(i=0; i<threadcount; i++)
+		pthread_create(&threads[i], 0, read_region, (void*)(uintptr_t)i);
+	if (prefetch)
+		pthread_create(&threads[threadcount], 0, prefetch_region, 0);
+	for(i=0; i<threadcount + (prefetch != 0); i++)
+		pthread_join(threads[i], 0);
+	pthread_barrier_destroy(&barrier);
+
+	read = stats_get(STATS_BACKING_BYTES) - read;
+	decrypted = stats_get(STATS_DECRYPTED_BYTES) - decrypted;
+	waits = stats_get(STATS_INFLIGHT_WAITS) - waits;
+	printf("%s: %u threads, %llu bytes read, %llu decrypted, %llu waits\n", name, threadcount, read, decrypted, waits);
+
+	if (read != REGIONSIZE)
+	{
+		fprintf(stderr, "FAIL: %s: read %llu bytes of a %u byte region\n", name, read, REGIONSIZE);
+		failures++;
+	}
+	if (decrypted != REGIONSIZE)
+	{
+		fprintf(stderr, "FAIL: %s: decrypted %llu bytes of a %u byte region\n", name, decrypted, REGIONSIZE);
+		failures++;
+	}
+
+	if (expected == 0 || !region_read_raw(&region, 0, expected, REGIONSIZE))
+	{
+		fprintf(stderr, "FAIL: %s: could not read the region back\n", name);
+		failures++;
+	}
+	else
+	{
+		for(i=0; i<threadcount; i++)
+		{
+			if (memcmp(results[i], expected, REGIONSIZE) != 0)
+			{
+				fprintf(stderr, "FAIL: %s: thread %u read the wrong bytes\n", name, i);
+				failures++;
+			}
+		}
+	}
+	free(expected);
+}
+
+int main(int argc, char* argv[])
+{
+	char path[] = "/tmp/ctrfuse-singleflight.XXXXXX";
+	u8* data;
+	FILE* file;
+	int fd;
+	u32 i;
+
+	threadcount = argc > 1 ? atoi(argv[1]) : 16;
+	if (threadcount < 2 || threadcount > MAX_THREADS)
+	{
+		fprintf(stderr, "usage: %s [THREADS], 2 to %d\n", argv[0], MAX_THREADS);
+		return 2;
+	}
+
+	// Two regions' worth of noise: one for each run, so the second doesn't
+	// find the first's blocks cached.
+	fd = mkstemp(path);
+	if (fd < 0)
+	{
+		perror(path);
+		return 2;
+	}
+	unlink(path);
+	data = malloc(2 * REGIONSIZE);
+	srand(1);
+	for(i=0; i<2 * REGIONSIZE; i++)
+		data[i] = rand();
+	if (write(fd, data, 2 * REGIONSIZE) != 2 * REGIONSIZE)
+	{
+		perror("write");
+		return 2;
+	}
+	free(data);
+
+	file = fdopen(fd, "rb");
+	if (file == 0 || !reader_init(&reader, "pread", file, fd, -1))
+		return 2;
+	if (!blockcache_init(4 * REGIONSIZE))
+		return 2;
+	for(i=0; i<threadcount; i++)
+		results[i] = malloc(REGIONSIZE);
+
+	run("readers", file, 0, 0);
+	run("readers and read-ahead", file, REGIONSIZE, 1);
+
+	if (failures)
+		return 1;
+	printf("ok\n");
+	return 0;
+}
@@ -16,7 +16,7 @@ void tmd_set_file(tmd_context* ctx, FILE* file)
 	ctx->file = file;
 }
 
-void tmd_set_offset(tmd_context* ctx, u32 offset)
+void tmd_set_offset(tmd_context* ctx, u64 offset)
 {
 	ctx->offset = offset;
 }
@@ -38,7 +38,7 @@ void tmd_process(tmd_context* ctx, u32 actions)
 
 	if (ctx->buffer)
 	{
-		fseek(ctx->file, ctx->offset, SEEK_SET);
+		fseeko(ctx->file, ctx->offset, SEEK_SET);
 		fread(ctx->buffer, 1, ctx->size, ctx->file);
 
 		if (actions & InfoFlag)
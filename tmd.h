@@ -70,7 +70,7 @@ typedef struct
 typedef struct
 {
 	FILE* file;
-	u32 offset;
+	u64 offset;
 	u32 size;
 	u8* buffer;
 	u8 content_hash_stat[64];
@@ -85,7 +85,7 @@ extern "C" {
 
 void tmd_init(tmd_context* ctx);
 void tmd_set_file(tmd_context* ctx, FILE* file);
-void tmd_set_offset(tmd_context* ctx, u32 offset);
+void tmd_set_offset(tmd_context* ctx, u64 offset);
 void tmd_set_size(tmd_context* ctx, u32 size);
 void tmd_set_usersettings(tmd_context* ctx, settings* usersettings);
 void tmd_print(tmd_context* ctx);
@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "types.h"
+#include "trace.h"
+
+typedef struct
+{
+	const char* name;
+	u64 start;
+	u64 duration;
+} trace_event;
+
+// Each thread owns one ring and is its only writer. head counts every event
+// ever written; the dumper only trusts the slots that head says are stable.
+typedef struct trace_ring
+{
+	struct trace_ring* next;
+	int tid;
+	u64 head;
+	trace_event events[TRACE_RING_SIZE];
+} trace_ring;
+
+int trace_enabled = 0;
+
+static char* trace_path;
+static trace_ring* trace_rings;
+static __thread trace_ring* trace_local;
+static volatile sig_atomic_t trace_dump_requested;
+
+static void trace_signal(int sig)
+{
+	trace_dump_requested = 1;
+}
+
+// Enables tracing. Spans are written as Chrome trace JSON to path on
+// trace_dump(), which runs on unmount and after SIGUSR2.
+int trace_init(const char* path)
+{
+	trace_path = strdup(path);
+	if (trace_path == NULL)
+		return 0;
+
+	signal(SIGUSR2, trace_signal);
+	trace_enabled = 1;
+	return 1;
+}
+
+u64 trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static trace_ring* trace_ring_get(void)
+{
+	trace_ring* ring = trace_local;
+
+	if (ring)
+		return ring;
+
+	ring = calloc(1, sizeof(trace_ring));
+	if (ring == 0)
+		return 0;
+
+	ring->tid = syscall(SYS_gettid);
+	ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	trace_local = ring;
+	return ring;
+}
+
+void trace_record(const char* name, u64 start)
+{
+	trace_ring* ring = trace_ring_get();
+	trace_event* event;
+	u64 head;
+
+	if (ring == 0)
+		return;
+
+	head = ring->head;
+	event = &ring->events[head & (TRACE_RING_SIZE - 1)];
+	event->name = name;
+	event->start = start;
+	event->duration = trace_now() - start;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	if (trace_dump_requested)
+	{
+		trace_dump_requested = 0;
+		trace_dump();
+	}
+}
+
+static void trace_dump_ring(FILE* fp, trace_ring* ring, int pid, int* first)
+{
+	static trace_event copy[TRACE_RING_SIZE];
+	u64 before, after, begin, i;
+
+	// Copy what the writer has published, then throw away any slot that it
+	// may have lapped while we were copying.
+	before = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	begin = before > TRACE_RING_SIZE ? before - TRACE_RING_SIZE : 0;
+	for(i=begin; i<before; i++)
+		copy[i & (TRACE_RING_SIZE - 1)] = ring->events[i & (TRACE_RING_SIZE - 1)];
+	after = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (after > TRACE_RING_SIZE && after - TRACE_RING_SIZE > begin)
+		begin = after - TRACE_RING_SIZE;
+
+	for(i=begin; i<before; i++)
+	{
+		trace_event* event = &copy[i & (TRACE_RING_SIZE - 1)];
+
+		fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+				*first ? "" : ",", event->name, event->start / 1000.0, event->duration / 1000.0, pid, ring->tid);
+		*first = 0;
+	}
+}
+
+void trace_dump(void)
+{
+	static int dumping;
+	trace_ring* ring;
+	FILE* fp;
+	int first = 1;
+
+	if (!trace_enabled || __atomic_exchange_n(&dumping, 1, __ATOMIC_ACQUIRE))
+		return;
+
+	fp = fopen(trace_path, "w");
+	if (fp == 0)
+	{
+		perror(trace_path);
+		goto clean;
+	}
+
+	fprintf(fp, "{\"traceEvents\":[");
+	for(ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+		trace_dump_ring(fp, ring, getpid(), &first);
+	fprintf(fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	fclose(fp);
+
+clean:
+	__atomic_store_n(&dumping, 0, __ATOMIC_RELEASE);
+}
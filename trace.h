@@ -0,0 +1,64 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "types.h"
+
+// Build with CFLAGS+=-DCTRFUSE_USDT to get span__begin/span__end USDT probes
+// (provider "ctrfuse") at every TRACE_SPAN; they cost a nop when unused.
+#ifdef CTRFUSE_USDT
+#include <sys/sdt.h>
+#define TRACE_PROBE(probe, name)	DTRACE_PROBE1(ctrfuse, probe, name)
+#else
+#define TRACE_PROBE(probe, name)	do { } while (0)
+#endif
+
+#define TRACE_RING_SIZE	16384	// events per thread, power of two
+
+typedef struct
+{
+	const char* name;
+	u64 start;
+} trace_span;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int trace_enabled;
+
+int  trace_init(const char* path);
+u64  trace_now(void);
+void trace_record(const char* name, u64 start);
+void trace_dump(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+// Opens a span that closes when the enclosing block is left. With tracing
+// off this is a single well-predicted branch on entry and on exit.
+#ifdef __GNUC__
+static inline trace_span trace_span_begin(const char* name)
+{
+	trace_span span;
+
+	TRACE_PROBE(span__begin, name);
+	span.name = name;
+	span.start = __builtin_expect(trace_enabled, 0) ? trace_now() : 0;
+	return span;
+}
+
+static inline void trace_span_end(trace_span* span)
+{
+	TRACE_PROBE(span__end, span->name);
+	if (__builtin_expect(span->start != 0, 0))
+		trace_record(span->name, span->start);
+}
+
+#define TRACE_SPAN(n) \
+	trace_span trace_span_ __attribute__((cleanup(trace_span_end), unused)) = trace_span_begin(n)
+#else
+#define TRACE_SPAN(n)
+#endif
+
+#endif // _TRACE_H_
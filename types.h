@@ -21,7 +21,8 @@ enum flags
 	VerboseFlag = (1<<3),
 	VerifyFlag = (1<<4),
 	RawFlag = (1<<5),
-	ShowKeysFlag = (1<<6)
+	ShowKeysFlag = (1<<6),
+	LazyFlag = (1<<7)
 };
 
 
@@ -9,6 +9,11 @@
 #define PATH_SEPERATOR '/'
 #endif
 
+#ifdef _WIN32
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#endif
+
 #ifndef MAX_PATH
 	#define MAX_PATH 255
 #endif
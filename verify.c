@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "types.h"
+#include "verify.h"
+#include "blockcache.h"
+#include "iosched.h"
+#include "utils.h"
+#include "log.h"
+#include "trace.h"
+
+#define VERIFY_NOKEY	3		// beside Unchecked, Good and Fail
+
+typedef enum
+{
+	VERIFY_NCSD_SIGNATURE,
+	VERIFY_NCCH_SIGNATURE,
+	VERIFY_EXHEADER_HASH,
+	VERIFY_EXEFS_SUPERBLOCK,
+	VERIFY_EXEFS_SECTION,
+	VERIFY_ROMFS_SUPERBLOCK,
+	VERIFY_IVFC_LEVEL,
+} verify_kind;
+
+typedef struct
+{
+	char name[32];
+	verify_kind kind;
+	u32 index;			// exefs section or ivfc level
+	u64 size;
+	int state;			// Unchecked, Good, Fail or VERIFY_NOKEY
+	u64 blocks;			// hash blocks in an ivfc level
+	u64 checked;
+	u64 bad;
+} verify_check;
+
+// One sweep per mount, on its own thread, over everything the image carries
+// a hash or signature for. Reads are background work, so the sweep yields
+// to user reads and counts against bg_rate. What it has found so far is
+// kept here for verify_print.
+static ncsd_context* image;
+static verify_check checks[VERIFY_MAX_CHECKS];
+static u32 checkcount;
+static int current = -1;
+static u64 done;
+static u64 total;
+static const char* state = "running";
+static u32 failures;
+static int started;
+static int stopping;		// set by verify_stop while the sweep runs
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static verify_check* verify_add(verify_kind kind, u32 index, u64 size, const char* name)
+{
+	verify_check* check = &checks[checkcount++];
+
+	snprintf(check->name, sizeof(check->name), "%s", name);
+	check->kind = kind;
+	check->index = index;
+	check->size = size;
+	total += size;
+	return check;
+}
+
+static void verify_progress(verify_check* check, u64 bytes, u64 blocks, u64 bad)
+{
+	pthread_mutex_lock(&lock);
+	done += bytes;
+	check->checked += blocks;
+	check->bad += bad;
+	pthread_mutex_unlock(&lock);
+}
+
+// Waits for a background slot for bytes of reading. Returns 0 once the
+// mount is going away.
+static int verify_slice_begin(u64 bytes)
+{
+	if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+		return 0;
+	return iosched_background_begin(bytes);
+}
+
+// Hashes [offset, offset+size) of region a block at a time. Returns 1 with
+// the hash, 0 on a read error and -1 if stopped.
+static int verify_hash_range(verify_check* check, region_context* region, u64 offset, u64 size, u8* buffer, u8 hash[32])
+{
+	ctr_sha256_context sha;
+	int ok;
+
+	ctr_sha_256_init(&sha);
+	while(size)
+	{
+		u32 max = size < BLOCKCACHE_BLOCKSIZE ? size : BLOCKCACHE_BLOCKSIZE;
+
+		if (!verify_slice_begin(max))
+			return -1;
+		ok = region_read_raw(region, offset, buffer, max);
+		iosched_background_end();
+		if (!ok)
+			return 0;
+
+		ctr_sha_256_update(&sha, buffer, max);
+		verify_progress(check, max, 0, 0);
+		offset += max;
+		size -= max;
+	}
+	ctr_sha_256_finish(&sha, hash);
+	return 1;
+}
+
+static int verify_against(verify_check* check, region_context* region, u64 offset, u64 size, u8* buffer, const u8 expected[32])
+{
+	u8 hash[32];
+	int ok = verify_hash_range(check, region, offset, size, buffer, hash);
+
+	if (ok <= 0)
+		return ok < 0 ? -1 : Fail;
+	return memcmp(hash, expected, 32) == 0 ? Good : Fail;
+}
+
+// Checks one level of the RomFS hash tree against the level above it.
+// Blocks of the last level go through region_check, which also marks them
+// verified in the disk cache.
+static int verify_ivfc_level(verify_check* check, romfs_context* romfs, u8* buffer)
+{
+	ivfc_context* ivfc = &romfs->ivfc;
+	region_context* region = &romfs->region;
+	ivfc_level* level = ivfc->level + check->index;
+	u64 blocksize = level->hashblocksize;
+	u64 offset = level->dataoffset;
+	u64 end = level->dataoffset + level->datasize;
+	u8 calchash[32];
+	u8 testhash[32];
+	int ok;
+
+	if (blocksize == 0 || blocksize > IVFC_MAX_BUFFERSIZE || offset % blocksize)
+		return Fail;
+
+	if (check->index == ivfc->levelcount - 1)
+	{
+		while(offset < end)
+		{
+			u64 next = (offset / BLOCKCACHE_BLOCKSIZE + 1) * BLOCKCACHE_BLOCKSIZE;
+			u64 blocks, bad = 0;
+			u64 i;
+
+			if (next > end)
+				next = end;
+			blocks = (next - offset + blocksize - 1) / blocksize;
+
+			if (!verify_slice_begin(next - offset))
+				return -1;
+			if (!region_check(region, offset, buffer, next - offset))
+			{
+				// Find out how much of it is bad.
+				for(i=offset; i<next; i+=blocksize)
+					bad += !region_check(region, i, buffer, blocksize);
+			}
+			iosched_background_end();
+
+			verify_progress(check, next - offset, blocks, bad);
+			offset = next;
+		}
+	}
+	else
+	{
+		u64 j;
+
+		for(j=0; offset<end; j++, offset+=blocksize)
+		{
+			u64 size = region->size - offset < blocksize ? region->size - offset : blocksize;
+
+			// Hash blocks running past the end of the region count as zeros.
+			memset(buffer, 0, blocksize);
+			if (!verify_slice_begin(blocksize))
+				return -1;
+			ok = offset < region->size &&
+				region_read_raw(region, offset, buffer, size) &&
+				region_read_raw(region, level->hashoffset + 0x20 * j, testhash, 0x20);
+			iosched_background_end();
+
+			ctr_sha_256(buffer, blocksize, calchash);
+			verify_progress(check, blocksize, 1, !ok || memcmp(calchash, testhash, 0x20) != 0);
+		}
+	}
+
+	return check->bad ? Fail : Good;
+}
+
+static int verify_run(verify_check* check, u8* buffer)
+{
+	ncch_context* ncch = &image->ncch;
+	exefs_context* exefs = &ncch->exefs;
+	romfs_context* romfs = &ncch->romfs;
+	rsakey2048 ncchrsakey;
+	u64 offset;
+	u8 hash[32];
+
+	switch(check->kind)
+	{
+	case VERIFY_NCSD_SIGNATURE:
+		if (image->usersettings == 0)
+			return VERIFY_NOKEY;
+		return ncsd_signature_verify(image->header, &image->usersettings->keys.ncsdrsakey);
+
+	case VERIFY_NCCH_SIGNATURE:
+		// Executables carry the key in their exheader, data archives
+		// need the fixed one from the keyset.
+		if ((ncch->header->flags[5] & 3) != 1)
+		{
+			ctr_rsa_init_key_pubmodulus(&ncchrsakey, ncch->exheader.header.accessdesc.ncchpubkeymodulus);
+			return ncch_signature_verify(ncch, &ncchrsakey);
+		}
+		if (ncch->usersettings == 0)
+			return VERIFY_NOKEY;
+		return ncch_signature_verify(ncch, &ncch->usersettings->keys.ncchrsakey);
+
+	case VERIFY_EXHEADER_HASH:
+		ctr_sha_256((const u8*)&ncch->exheader.header, check->size, hash);
+		verify_progress(check, check->size, 0, 0);
+		return memcmp(hash, ncch->header->extendedheaderhash, 32) == 0 ? Good : Fail;
+
+	case VERIFY_EXEFS_SUPERBLOCK:
+		return verify_against(check, &exefs->region, 0, check->size, buffer, ncch->header->exefssuperblockhash);
+
+	case VERIFY_EXEFS_SECTION:
+		offset = sizeof(exefs_header) + getle32(exefs->header.section[check->index].offset);
+		return verify_against(check, &exefs->region, offset, check->size, buffer, exefs->header.hashes[7 - check->index]);
+
+	case VERIFY_ROMFS_SUPERBLOCK:
+		return verify_against(check, &romfs->region, 0, check->size, buffer, ncch->header->romfssuperblockhash);
+
+	case VERIFY_IVFC_LEVEL:
+		return verify_ivfc_level(check, romfs, buffer);
+	}
+	return Fail;
+}
+
+// Lists what the image can be checked against, parsing the parts of it
+// that haven't been looked at yet.
+static void verify_plan(ncsd_context* ncsd)
+{
+	ncch_context* ncch = &ncsd->ncch;
+	exefs_context* exefs = &ncch->exefs;
+	romfs_context* romfs = &ncch->romfs;
+	u32 mediaunitsize = ncch_get_mediaunit_size(ncch);
+	int haveexheader = ncch_get_exheader_size(ncch) && ncch_load(ncch, NCCHTYPE_EXHEADER);
+	int haveexefs = ncch_load(ncch, NCCHTYPE_EXEFS);
+	int haveromfs = ncch_load(ncch, NCCHTYPE_ROMFS);
+	u64 size;
+	char name[32];
+	u32 i;
+
+	pthread_mutex_lock(&lock);
+	verify_add(VERIFY_NCSD_SIGNATURE, 0, 0, "ncsd signature");
+	verify_add(VERIFY_NCCH_SIGNATURE, 0, 0, "ncch signature");
+
+	size = getle32(ncch->header->extendedheadersize);
+	if (haveexheader && size <= sizeof(exheader_header))
+		verify_add(VERIFY_EXHEADER_HASH, 0, size, "exheader hash");
+
+	size = (u64)getle32(ncch->header->exefshashregionsize) * mediaunitsize;
+	if (size && haveexefs)
+	{
+		verify_add(VERIFY_EXEFS_SUPERBLOCK, 0, size, "exefs superblock");
+		for(i=0; i<8; i++)
+		{
+			const char* section = (const char*)exefs->header.section[i].name;
+
+			size = getle32(exefs->header.section[i].size);
+			if (size == 0)
+				continue;
+			snprintf(name, sizeof(name), "exefs/%.8s.bin", section[0] == '.' ? section + 1 : section);
+			verify_add(VERIFY_EXEFS_SECTION, i, size, name);
+		}
+	}
+
+	size = (u64)getle32(ncch->header->romfshashregionsize) * mediaunitsize;
+	if (size && haveromfs)
+	{
+		verify_add(VERIFY_ROMFS_SUPERBLOCK, 0, size, "romfs superblock");
+		for(i=0; i<romfs->ivfc.levelcount; i++)
+		{
+			ivfc_level* level = romfs->ivfc.level + i;
+			verify_check* check;
+
+			snprintf(name, sizeof(name), "romfs level %u", i + 1);
+			check = verify_add(VERIFY_IVFC_LEVEL, i, level->datasize, name);
+			if (level->hashblocksize)
+				check->blocks = (level->datasize + level->hashblocksize - 1) / level->hashblocksize;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static void* verify_worker(void* unused)
+{
+	TRACE_SPAN("verify");
+	u8* buffer = malloc(BLOCKCACHE_BLOCKSIZE);
+	int result = -1;
+	u32 i;
+
+	verify_plan(image);
+	for(i=0; i<checkcount && buffer; i++)
+	{
+		verify_check* check = &checks[i];
+
+		pthread_mutex_lock(&lock);
+		current = i;
+		pthread_mutex_unlock(&lock);
+
+		result = verify_run(check, buffer);
+		if (result < 0)
+			break;
+
+		pthread_mutex_lock(&lock);
+		check->state = result;
+		if (result == Fail)
+			failures++;
+		pthread_mutex_unlock(&lock);
+
+		if (result == Fail)
+			log_warn("verify: %s failed", check->name);
+	}
+
+	pthread_mutex_lock(&lock);
+	current = -1;
+	state = buffer == 0 ? "out of memory" : result < 0 ? "stopped" : "done";
+	pthread_mutex_unlock(&lock);
+
+	if (result >= 0)
+		log_info("verify: done, %u of %u checks failed", failures, checkcount);
+	free(buffer);
+	return 0;
+}
+
+// Starts the sweep. Must be called after FUSE has daemonized, as the thread
+// doesn't survive fork.
+int verify_start(ncsd_context* ncsd)
+{
+	image = ncsd;
+	if (pthread_create(&thread, 0, verify_worker, 0) != 0)
+	{
+		log_warn("could not start verify thread");
+		state = "not started";
+		return 0;
+	}
+	started = 1;
+	return 1;
+}
+
+// Waits for the sweep to give up, before the contexts it reads go away.
+// iosched_stop must come first so a sweep waiting for its turn wakes up.
+void verify_stop(void)
+{
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	if (started)
+		pthread_join(thread, 0);
+	started = 0;
+}
+
+static const char* verify_state_name(int state)
+{
+	switch(state)
+	{
+	case Good: return "good";
+	case Fail: return "FAIL";
+	case VERIFY_NOKEY: return "no key";
+	default: return "pending";
+	}
+}
+
+void verify_print(void* unused, FILE* fp)
+{
+	u32 i;
+
+	pthread_mutex_lock(&lock);
+	fprintf(fp, "state %s\n", state);
+	if (current >= 0)
+		fprintf(fp, "step %s\n", checks[current].name);
+	fprintf(fp, "progress %llu/%llu bytes\n", done, total);
+	fprintf(fp, "failures %u\n", failures);
+	fprintf(fp, "\n");
+	for(i=0; i<checkcount; i++)
+	{
+		verify_check* check = &checks[i];
+
+		fprintf(fp, "%-24s %s", check->name, verify_state_name(check->state));
+		if (check->kind == VERIFY_IVFC_LEVEL)
+			fprintf(fp, " (%llu/%llu blocks, %llu bad)", check->checked, check->blocks, check->bad);
+		fprintf(fp, "\n");
+	}
+	pthread_mutex_unlock(&lock);
+}
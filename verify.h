@@ -0,0 +1,22 @@
+#ifndef _VERIFY_H_
+#define _VERIFY_H_
+
+#include <stdio.h>
+#include "types.h"
+#include "ncsd.h"
+
+#define VERIFY_MAX_CHECKS		24		// signatures, hashes and levels listed
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int  verify_start(ncsd_context* ncsd);
+void verify_stop(void);
+void verify_print(void* unused, FILE* fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _VERIFY_H_